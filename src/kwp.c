@@ -1,5 +1,6 @@
 #define _LARGEFILE_SOURCE
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,8 +9,16 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <stdint.h>
-#include <wchar.h>
 #include <locale.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WINDOWS
+#include <sys/resource.h>
+#endif
+
+#include "kwp.h"
 
 /**
  * Name........: keyboard-walk-processor (kwp)
@@ -18,87 +27,50 @@
  * License.....: MIT
  */
 
-#define VERSION_BIN           100
-
-#define DIST_CNT              16
-#define MOD_CNT               3
-#define DIR_CNT               9
-
-#define KEYMAP_WIDTH          14
-#define KEYMAP_HEIGHT         4
-#define KEYMAP_ENTRIES        (KEYMAP_WIDTH * KEYMAP_HEIGHT)
-
-#define RC_OK                 0
-#define RC_INVALID            -1
-
-#define ROUTE_LENGTH_MIN      1
-#define ROUTE_LENGTH_MAX      32
+// command line front end, everything else lives in libkwp
 
-#define ROUTE_REPEAT_MIN      1
-#define ROUTE_REPEAT_MAX      16
-
-#define USER_MOD_BASIC        1
-#define USER_MOD_SHIFT        0
-#define USER_MOD_ALTGR        0
 #define USER_MOD_ALL          0
-
-#define USER_DIR_SOUTH_WEST   0
-#define USER_DIR_SOUTH        1
-#define USER_DIR_SOUTH_EAST   0
-#define USER_DIR_WEST         1
-#define USER_DIR_REPEAT       0
-#define USER_DIR_EAST         1
-#define USER_DIR_NORTH_WEST   0
-#define USER_DIR_NORTH        1
-#define USER_DIR_NORTH_EAST   0
 #define USER_DIR_CONT         0
 #define USER_DIR_ALL          0
 
-#define USER_DIST_MIN         1
-#define USER_DIST_MAX         1
-
-// types
+#define KEYSPACE              0
+#define SKIP                  0
+#define LIMIT                 0
+#define TIMING                0
+#define BENCHMARK             0
+#define RESTORE               0
+#define RESTORE_TIMER         60
+#define HASH_TYPE             HASH_MD5
+#define COMBINATOR            0
+#define COMBINED_LENGTH_MAX   0
+#define LAYOUT_TAG            0
+#define LAYOUT_SPLIT          0
+
+#define LAYOUT_NAME_MAX       256
+
+#define STATS_NONE            0
+#define STATS_TABLE           1
+#define STATS_JSON            2
 
 typedef uint64_t u64;
 
-typedef struct
-{
-  FILE *fp;
-
-  char buf[BUFSIZ];
-  int  len;
-
-} out_t;
-
-typedef struct
-{
-  int x;
-  int y;
-
-} co_t;
-
-typedef struct
-{
-  wchar_t map[DIST_CNT][MOD_CNT][DIR_CNT];
-
-  int is_basic;
-  int is_shift;
-  int is_altgr;
-
-} cs_t;
+// rewrites the restore file every timer seconds until done is set
 
 typedef struct
 {
-  int repeat[ROUTE_LENGTH_MAX];
-  int changes;
+  kwp_ctx_t      *ctx;
+  const char     *file;
+  int             timer;
+  int             done;
 
-} route_t;
+  pthread_mutex_t mux;
+  pthread_cond_t  cond;
 
-// functions
+} restore_t;
 
 static const char *USAGE_MINI[] =
 {
-  "Usage: %s [options]... basechars-file keymap-file routes-file",
+  "Usage: %s [options]... basechars-file keymap-file... routes-file",
   "",
   "Try --help for more help.",
   NULL
@@ -108,7 +80,7 @@ static const char *USAGE_BIG[] =
 {
   "Advanced keyboard-walk generator with configureable basechars, keymap and routes",
   "",
-  "Usage: %s [options]... basechars-file keymap-file routes-file",
+  "Usage: %s [options]... basechars-file keymap-file... routes-file",
   "",
   " Options Short / Long        | Type | Description                                                 | Default",
   "=============================+======+=============================================================+=========",
@@ -132,6 +104,42 @@ static const char *USAGE_BIG[] =
   "  -0, --keywalk-all          |      | Shortcut to enable all --keywalk-* directions               |",
   "  -n, --keywalk-distance-min | NUM  | Minimum allowed distance between keys                       | 1",
   "  -x, --keywalk-distance-max | NUM  | Maximum allowed distance between keys                       | 1",
+  "  -t, --threads              | NUM  | Number of generator threads                                 | 1",
+  "  -u, --unordered            |      | Write candidates as soon as any thread has them (threads>1) |",
+  "  -r, --rules-file           | FILE | Write every walk once per hashcat rule in FILE              |",
+  "      --keyspace             |      | Print number of candidates (per route to stderr) and exit   |",
+  "      --skip                 | NUM  | Skip the first NUM candidates                               | 0",
+  "      --limit                | NUM  | Stop after NUM candidates (0 = no limit)                    | 0",
+  "      --timing               |      | Print time spent on startup to stderr                       |",
+  "      --output-encoding      | ENC  | Output encoding: locale, utf8, latin1 or utf16le            | locale",
+  "      --route-order          |      | Keep the per-route output order                             |",
+  "      --benchmark            |      | Generate into a discarding sink and print throughput        |",
+  "      --write-buffer         | NUM  | Size in MB of each output buffer of the writer (1-64)       | 4",
+  "      --output-backend       | NAME | Output backend: auto, fwrite or vmsplice (pipes only)       | auto",
+  "      --unique               | NAME | Remove duplicates: none, exact or bloom (bounded memory)    | none",
+  "      --unique-memory        | NUM  | Size in MB of the bloom filter                              | 256",
+  "      --stats                | FMT  | Print per-route statistics to stderr: table or json         |",
+  "      --restore-file         | FILE | Write the position to FILE periodically and on a signal     |",
+  "      --restore-timer        | NUM  | Seconds between updates of the restore file                 | 60",
+  "      --restore              |      | Continue from the position in --restore-file                |",
+  "      --policy-length-min    | NUM  | Skip routes making candidates shorter than NUM              | 0",
+  "      --policy-length-max    | NUM  | Skip routes making candidates longer than NUM               | 0",
+  "      --policy-classes       | CLS  | Require each class: l lower, u upper, d digit, s special    |",
+  "      --policy-keyboards     | KBD  | Require a key of each keymap: b basic, s shift, a altgr     |",
+  "      --policy-run-max       | NUM  | Maximum run of the same character                           | 0",
+  "      --compile              | FILE | Write the parsed files and all tables to FILE and exit      |",
+  "      --cache                | FILE | Load a --compile FILE instead of the three input files      |",
+  "      --match                | FILE | Print the words of FILE that are walks, - for stdin         |",
+  "      --crack                | FILE | Print hash:plain for the hashes in FILE a candidate cracks  |",
+  "      --hash-type            | NAME | Hash type of --crack: md5, sha1 or ntlm                     | md5",
+  "      --combinator           |      | Join every walk with every walk of the --right-* files      |",
+  "      --right-basechars      | FILE | Basechars of the right walks (default: basechars-file)      |",
+  "      --right-keymap         | FILE | Keymap of the right walks (default: keymap-file)            |",
+  "      --right-routes         | FILE | Routes of the right walks (default: routes-file)            |",
+  "      --separators           | STR  | Join through each character of STR instead of directly      |",
+  "      --combined-length-max  | NUM  | Skip joined walks longer than NUM characters                | 0",
+  "      --layout-tag           |      | Write the keymap name and a tab in front of each candidate  |",
+  "      --layout-split         |      | Write each keymap to output-file.NAME, --unique per file    |",
   "",
   NULL
 };
@@ -190,415 +198,170 @@ static void usage_big_print (const char *progname)
   }
 }
 
-int count_lines (FILE *fp)
+static int stats_parse (const char *name)
 {
-  int cnt = 0;
+  if (strcmp (name, "table") == 0) return STATS_TABLE;
+  if (strcmp (name, "json")  == 0) return STATS_JSON;
 
-  char *buf = (char *) malloc (BUFSIZ);
-
-  char prev = '\n';
-
-  while (!feof (fp))
-  {
-    const size_t nread = fread (buf, sizeof (char), BUFSIZ - 1, fp);
-
-    if (nread < 1) continue;
-
-    size_t i;
-
-    for (i = 0; i < nread; i++)
-    {
-      if (prev == '\n') cnt++;
-
-      prev = buf[i];
-    }
-  }
-
-  free (buf);
-
-  return cnt;
-}
-
-int hex_convert (const wchar_t c)
-{
-  return (c & 15) + (c >> 6) * 9;
+  return -1;
 }
 
-void out_flush (out_t *out)
-{
-  if (out->len == 0) return;
-
-  fwrite (out->buf, 1, out->len, out->fp);
-
-  out->len = 0;
-}
-
-void out_push (out_t *out, const wchar_t *pw_buf, const int pw_len)
-{
-  for (int i = 0; i < pw_len; i++)
-  {
-    out->len += wctomb (out->buf + out->len, pw_buf[i]);
-  }
-
-  out->buf[out->len] = '\n';
-
-  out->len++;
+// --skip and --limit, a plain decimal number that fits 64 bit
 
-  if (out->len >= BUFSIZ - 100)
-  {
-    out_flush (out);
-  }
-}
-
-wchar_t co_to_chr (const wchar_t keymap[KEYMAP_WIDTH][KEYMAP_HEIGHT], const int x, const int y)
+static int count_parse (const char *str, u64 *cnt)
 {
-  if (x < 0) return RC_INVALID;
-  if (y < 0) return RC_INVALID;
+  if ((*str < '0') || (*str > '9')) return -1;
 
-  if (x > KEYMAP_WIDTH  - 1) return RC_INVALID;
-  if (y > KEYMAP_HEIGHT - 1) return RC_INVALID;
+  char *end = NULL;
 
-  return keymap[x][y];
-}
+  errno = 0;
 
-int chr_to_co (const wchar_t keymap[KEYMAP_WIDTH][KEYMAP_HEIGHT], const wchar_t chr, co_t *co)
-{
-  for (int x = 0; x < KEYMAP_WIDTH; x++)
-  {
-    for (int y = 0; y < KEYMAP_HEIGHT; y++)
-    {
-      if (keymap[x][y] == chr)
-      {
-        co->x = x;
-        co->y = y;
+  const unsigned long long val = strtoull (str, &end, 10);
 
-        return RC_OK;
-      }
-    }
-  }
+  if ((errno) || (*end != 0)) return -1;
 
-  return RC_INVALID;
-}
+  *cnt = val;
 
-void add_keymap_to_map (wchar_t *map, const wchar_t keymap[KEYMAP_WIDTH][KEYMAP_HEIGHT], const co_t *co, const int user_dist, const int user_dir_south_west, const int user_dir_south, const int user_dir_south_east, const int user_dir_west, const int user_dir_repeat, const int user_dir_east, const int user_dir_north_west, const int user_dir_north, const int user_dir_north_east)
-{
-  int dir_pos = 0;
-
-  if (user_dir_south_west == 1) map[dir_pos++] = co_to_chr (keymap, co->x - user_dist, co->y + user_dist);
-  if (user_dir_south      == 1) map[dir_pos++] = co_to_chr (keymap, co->x            , co->y + user_dist);
-  if (user_dir_south_east == 1) map[dir_pos++] = co_to_chr (keymap, co->x + user_dist, co->y + user_dist);
-  if (user_dir_west       == 1) map[dir_pos++] = co_to_chr (keymap, co->x - user_dist, co->y            );
-  if (user_dir_repeat     == 1) map[dir_pos++] = co_to_chr (keymap, co->x            , co->y            );
-  if (user_dir_east       == 1) map[dir_pos++] = co_to_chr (keymap, co->x + user_dist, co->y            );
-  if (user_dir_north_west == 1) map[dir_pos++] = co_to_chr (keymap, co->x - user_dist, co->y - user_dist);
-  if (user_dir_north      == 1) map[dir_pos++] = co_to_chr (keymap, co->x            , co->y - user_dist);
-  if (user_dir_north_east == 1) map[dir_pos++] = co_to_chr (keymap, co->x + user_dist, co->y - user_dist);
+  return 0;
 }
 
-void setup_cs (cs_t *cs, const wchar_t c, const wchar_t keymap_basic[KEYMAP_WIDTH][KEYMAP_HEIGHT], const wchar_t keymap_shift[KEYMAP_WIDTH][KEYMAP_HEIGHT], const wchar_t keymap_altgr[KEYMAP_WIDTH][KEYMAP_HEIGHT], const int user_mod_basic, const int user_mod_shift, const int user_mod_altgr, const int user_dir_south_west, const int user_dir_south, const int user_dir_south_east, const int user_dir_west, const int user_dir_repeat, const int user_dir_east, const int user_dir_north_west, const int user_dir_north, const int user_dir_north_east, const int user_dist_min, const int user_dist_max)
+static void stats_print (const kwp_ctx_t *ctx, const int format)
 {
-  for (int i = 0; i < DIST_CNT; i++)
-  {
-    for (int j = 0; j < MOD_CNT; j++)
-    {
-      for (int k = 0; k < DIR_CNT; k++)
-      {
-        cs->map[i][j][k] = RC_INVALID;
-      }
-    }
-  }
+  const int routes_cnt = kwp_routes_cnt (ctx);
 
-  cs->is_basic = 0;
-  cs->is_shift = 0;
-  cs->is_altgr = 0;
+  kwp_route_stats_t *stats_buf = (kwp_route_stats_t *) calloc (routes_cnt, sizeof (kwp_route_stats_t));
 
-  co_t co;
+  kwp_route_stats (ctx, stats_buf);
 
-  int rc = RC_INVALID;
+  double ms_total = 0;
 
-  if (rc == RC_INVALID) { rc = chr_to_co (keymap_basic, c, &co); cs->is_basic = 1; }
-  if (rc == RC_INVALID) { rc = chr_to_co (keymap_shift, c, &co); cs->is_shift = 1; }
-  if (rc == RC_INVALID) { rc = chr_to_co (keymap_altgr, c, &co); cs->is_altgr = 1; }
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++) ms_total += stats_buf[routes_pos].ms;
 
-  if (rc == RC_INVALID) return;
+  if (format == STATS_JSON) fprintf (stderr, "{\"routes\":[\n");
+  else                      fprintf (stderr, "%-32s %20s %20s %20s %20s %14s %10s %6s\n", "Route", "Keyspace", "Emitted", "Rejected keymap", "Rejected repeat", "Bytes", "ms", "Time");
 
-  for (int user_dist = user_dist_min, dist_pos = 0; user_dist <= user_dist_max; user_dist++, dist_pos++)
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
   {
-    int mod_pos = 0;
+    const kwp_route_stats_t *stats = stats_buf + routes_pos;
 
-    if (user_mod_basic == 1) add_keymap_to_map (cs->map[dist_pos][mod_pos++], keymap_basic, &co, user_dist, user_dir_south_west, user_dir_south, user_dir_south_east, user_dir_west, user_dir_repeat, user_dir_east, user_dir_north_west, user_dir_north, user_dir_north_east);
-    if (user_mod_shift == 1) add_keymap_to_map (cs->map[dist_pos][mod_pos++], keymap_shift, &co, user_dist, user_dir_south_west, user_dir_south, user_dir_south_east, user_dir_west, user_dir_repeat, user_dir_east, user_dir_north_west, user_dir_north, user_dir_north_east);
-    if (user_mod_altgr == 1) add_keymap_to_map (cs->map[dist_pos][mod_pos++], keymap_altgr, &co, user_dist, user_dir_south_west, user_dir_south, user_dir_south_east, user_dir_west, user_dir_repeat, user_dir_east, user_dir_north_west, user_dir_north, user_dir_north_east);
-  }
-}
+    char route[KWP_ROUTE_STR_SIZE];
 
-wchar_t *fgetl (FILE *fp, wchar_t *buf, int len)
-{
-  wchar_t *line_buf = fgetws (buf, len - 1, fp);
+    kwp_route_str (ctx, routes_pos, route);
 
-  if (line_buf == NULL) return NULL;
+    const double share = (ms_total > 0) ? 100 * stats->ms / ms_total : 0;
 
-  size_t line_len = wcslen (line_buf);
-
-  while (line_len)
-  {
-    if (line_buf[line_len - 1] == '\n')
+    if (format == STATS_JSON)
     {
-      line_len--;
-
-      continue;
+      fprintf (stderr, "{\"route\":\"%s\",\"keyspace\":%.0f,\"emitted\":%llu,\"rejected_keymap\":%.0f,\"rejected_repeat\":%.0f,\"bytes\":%llu,\"ms\":%.3f}%s\n",
+        route,
+        stats->keyspace,
+        (unsigned long long) stats->emitted,
+        stats->rejected_keymap,
+        stats->rejected_repeat,
+        (unsigned long long) stats->bytes,
+        stats->ms,
+        (routes_pos < routes_cnt - 1) ? "," : "");
     }
-
-    if (line_buf[line_len - 1] == '\r')
+    else
     {
-      line_len--;
-
-      continue;
+      fprintf (stderr, "%-32s %20.0f %20llu %20.0f %20.0f %14llu %10.3f %5.1f%%\n",
+        route,
+        stats->keyspace,
+        (unsigned long long) stats->emitted,
+        stats->rejected_keymap,
+        stats->rejected_repeat,
+        (unsigned long long) stats->bytes,
+        stats->ms,
+        share);
     }
-
-    break;
   }
 
-  line_buf[line_len] = 0;
-
-  return line_buf;
-}
+  if (format == STATS_JSON) fprintf (stderr, "]}\n");
 
-static int check_keymap_line_width(size_t line_len, int total_line_num, const char *section_name, int section_row)
-{
-  if (line_len > KEYMAP_WIDTH)
-  {
-    fprintf(stderr, "ERROR: Keymap file format error.\n");
-    fprintf(stderr, "       Line %d (%s map, row %d) is too long.\n", total_line_num, section_name, section_row);
-    fprintf(stderr, "       Maximum allowed width is %d characters, but this line has %zu.\n", KEYMAP_WIDTH, line_len);
-    return RC_INVALID;
-  }
-  return RC_OK;
+  free (stats_buf);
 }
 
-static wchar_t* read_keymap_line(FILE *fp, wchar_t *tmp_buf, const char *section_name, int section_row)
-{
-  wchar_t *line_buf = fgetl(fp, tmp_buf, BUFSIZ);
-
-  if (line_buf == NULL)
-  {
-    fprintf(stderr, "ERROR: Keymap file is incomplete. Expected line for %s map, row %d.\n", section_name, section_row);
-  }
-
-  return line_buf;
-}
+// keymap file without directory and extension, names a layout for --layout-tag and --layout-split
 
-int parse_keymap_file (FILE *fp, wchar_t keymap_basic[KEYMAP_WIDTH][KEYMAP_HEIGHT], wchar_t keymap_shift[KEYMAP_WIDTH][KEYMAP_HEIGHT], wchar_t keymap_altgr[KEYMAP_WIDTH][KEYMAP_HEIGHT])
+static void layout_name (const char *file, char *buf, const size_t size)
 {
-  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
-
-  // first 4 lines are basic
-
-  for (int y = 0; y < 4; y++)
-  {
-    wchar_t *line_buf = read_keymap_line(fp, tmp, "basic", y + 1);
-    if (line_buf == NULL) { free(tmp); return RC_INVALID; }
-
-    const size_t line_len = wcslen (line_buf);
-
-    if (check_keymap_line_width(line_len, y + 1, "basic", y + 1) != RC_OK)
-    {
-        free(tmp);
-        return RC_INVALID;
-    }
-
-    for (size_t x = 0; x < line_len; x++)
-    {
-      wchar_t c = line_buf[x];
-
-      if (c == ' ') continue;
-
-      keymap_basic[x][y] = c;
-    }
-  }
-
-  // next 4 lines are shift
-
-  for (int y = 0; y < 4; y++)
-  {
-    wchar_t *line_buf = read_keymap_line(fp, tmp, "shift", y + 1);
-    if (line_buf == NULL) { free(tmp); return RC_INVALID; }
-
-    const size_t line_len = wcslen (line_buf);
-
-    if (check_keymap_line_width(line_len, y + 5, "shift", y + 1) != RC_OK)
-    {
-        free(tmp);
-        return RC_INVALID;
-    }
-
-    for (size_t x = 0; x < line_len; x++)
-    {
-      wchar_t c = line_buf[x];
-
-      if (c == ' ') continue;
-
-      keymap_shift[x][y] = c;
-    }
-  }
-
-  // next 4 lines are altgr
-
-  for (int y = 0; y < 4; y++)
-  {
-    wchar_t *line_buf = read_keymap_line(fp, tmp, "altgr", y + 1);
-    if (line_buf == NULL) { free(tmp); return RC_INVALID; }
-
-    const size_t line_len = wcslen (line_buf);
-
-    if (check_keymap_line_width(line_len, y + 9, "altgr", y + 1) != RC_OK)
-    {
-        free(tmp);
-        return RC_INVALID;
-    }
-
-    for (size_t x = 0; x < line_len; x++)
-    {
-      wchar_t c = line_buf[x];
+  const char *name = strrchr (file, '/');
 
-      if (c == ' ') continue;
-
-      keymap_altgr[x][y] = c;
-    }
-  }
+  snprintf (buf, size, "%s", (name) ? name + 1 : file);
 
-  free (tmp);
+  char *ext = strrchr (buf, '.');
 
-  return RC_OK;
+  if ((ext) && (ext != buf)) *ext = 0;
 }
 
-int parse_basechars_file (FILE *fp, wchar_t *basechars_buf, int *basechars_cnt, const cs_t *css, const int user_mod_basic, const int user_mod_shift, const int user_mod_altgr)
+static void layouts_free (kwp_ctx_t **layouts_buf, const int keymaps_cnt)
 {
-  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
-
-  wchar_t *line_buf = fgetl (fp, tmp, BUFSIZ);
-
-  if (line_buf == NULL) return RC_INVALID;
-
-  int basechars_tmp = 0;
-
-  const size_t line_len = wcslen (line_buf);
-
-  if (line_len <    1) return RC_INVALID;
-  if (line_len > 1023) return RC_INVALID;
+  // the first layout holds the routes of the others
 
-  for (size_t line_pos = 0; line_pos < line_len; line_pos++)
-  {
-    wchar_t c = line_buf[line_pos];
-
-    if ((user_mod_basic == 0) && (css[c].is_basic == 1)) continue;
-    if ((user_mod_shift == 0) && (css[c].is_shift == 1)) continue;
-    if ((user_mod_altgr == 0) && (css[c].is_altgr == 1)) continue;
-
-    basechars_buf[basechars_tmp] = c;
-
-    basechars_tmp++;
-  }
-
-  *basechars_cnt = basechars_tmp;
+  for (int keymaps_pos = keymaps_cnt - 1; keymaps_pos >= 0; keymaps_pos--) kwp_free (layouts_buf[keymaps_pos]);
 
-  free (tmp);
-
-  return RC_OK;
+  free (layouts_buf);
 }
 
-int parse_routes_file (FILE *fp, route_t *routes_buf)
+static void benchmark_print (const kwp_stats_t *stats)
 {
-  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
-
-  int routes_cnt = 0;
-
-  while (!feof (fp))
-  {
-    wchar_t *line_buf = fgetl (fp, tmp, BUFSIZ);
-
-    if (line_buf == NULL) continue;
+  const double secs = stats->gen_ms / 1000;
 
-    const size_t line_len = wcslen (line_buf);
+  long rss_kb = 0;
 
-    if (line_len < ROUTE_LENGTH_MIN) continue;
-    if (line_len > ROUTE_LENGTH_MAX) continue;
+  #ifndef WINDOWS
+  struct rusage usage;
 
-    route_t *route = routes_buf + routes_cnt;
-
-    route->changes = 0;
-
-    for (size_t line_pos = 0; line_pos < line_len; line_pos++)
-    {
-      wchar_t c = line_buf[line_pos];
-
-      const int repeat = hex_convert (c);
-
-      if (repeat < ROUTE_REPEAT_MIN) continue;
-      if (repeat > ROUTE_REPEAT_MAX) continue;
+  if (getrusage (RUSAGE_SELF, &usage) == 0) rss_kb = usage.ru_maxrss;
+  #endif
 
-      route->repeat[route->changes] = repeat;
+  printf (": %llu candidates, %llu bytes in %.3f s | %.2f M/s | %.2f MB/s | rejected %s%.4f%% | tables %.3f ms | peak rss %ld kB\n",
+    (unsigned long long) stats->cnt,
+    (unsigned long long) stats->bytes,
+    secs,
+    (secs > 0) ? (double) stats->cnt   / secs / 1000000 : 0,
+    (secs > 0) ? (double) stats->bytes / secs / 1000000 : 0,
+    (stats->rejected_min) ? ">" : "",
+    stats->rejected,
+    stats->tables_ms,
+    rss_kb);
+}
 
-      route->changes++;
-    }
+static kwp_ctx_t *ctx_signal = NULL;
 
-    routes_cnt++;
-  }
+static void signal_handler (int sig)
+{
+  // stays installed, tools like timeout deliver the signal to the process and its group
 
-  free (tmp);
+  (void) sig;
 
-  return routes_cnt;
+  kwp_stop (ctx_signal);
 }
 
-int process_route (const cs_t *css, const wchar_t root, const u64 s, const u64 dist_cnt, const u64 mod_cnt, const u64 dir_cnt, const route_t *route_buf, wchar_t *out_buf, int *out_len)
+static void *restore_thread (void *p)
 {
-  const u64 selection_cnt = dist_cnt * mod_cnt * dir_cnt;
-
-  int out_pos = 0;
+  restore_t *restore = (restore_t *) p;
 
-  out_buf[out_pos] = root;
+  pthread_mutex_lock (&restore->mux);
 
-  out_pos++;
-
-  const cs_t *cs = css + root;
-
-  u64 left = s;
-
-  u64 prev_direction = -1;
-
-  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  while (restore->done == 0)
   {
-    const u64 m1 = left % selection_cnt;
-
-    if (prev_direction == m1) return RC_INVALID;
+    struct timespec ts;
 
-    prev_direction = m1;
+    clock_gettime (CLOCK_REALTIME, &ts);
 
-    const u64 m_distance  = m1 % dist_cnt; const u64 m2 = m1 / dist_cnt;
-    const u64 m_modifier  = m2 % mod_cnt;  const u64 m3 = m2 / mod_cnt;
-    const u64 m_direction = m3 % dir_cnt;
+    ts.tv_sec += restore->timer;
 
-    for (int r = 0; r < route_buf->repeat[route_pos]; r++)
-    {
-      const wchar_t c = cs->map[m_distance][m_modifier][m_direction];
+    pthread_cond_timedwait (&restore->cond, &restore->mux, &ts);
 
-      if (c == RC_INVALID) return RC_INVALID;
+    if (restore->done) break;
 
-      out_buf[out_pos] = c;
-
-      out_pos++;
-
-      cs = css + c;
-    }
-
-    left /= selection_cnt;
+    kwp_restore_write (restore->ctx, restore->file);
   }
 
-  *out_len = out_pos;
-
-  out_buf[out_pos] = 0;
+  pthread_mutex_unlock (&restore->mux);
 
-  return RC_OK;
+  return NULL;
 }
 
 int main (int argc, char *argv[])
@@ -610,23 +373,39 @@ int main (int argc, char *argv[])
   int   version               = 0;
   int   usage                 = 0;
   char *output_file           = NULL;
-  int   user_mod_basic       = USER_MOD_BASIC;
-  int   user_mod_shift       = USER_MOD_SHIFT;
-  int   user_mod_altgr       = USER_MOD_ALTGR;
+
+  kwp_conf_t conf;
+
+  kwp_conf_init (&conf);
+
   int   user_mod_all         = USER_MOD_ALL;
-  int   user_dir_south_west  = USER_DIR_SOUTH_WEST;
-  int   user_dir_south       = USER_DIR_SOUTH;
-  int   user_dir_south_east  = USER_DIR_SOUTH_EAST;
-  int   user_dir_west        = USER_DIR_WEST;
-  int   user_dir_repeat      = USER_DIR_REPEAT;
-  int   user_dir_east        = USER_DIR_EAST;
-  int   user_dir_north_west  = USER_DIR_NORTH_WEST;
-  int   user_dir_north       = USER_DIR_NORTH;
-  int   user_dir_north_east  = USER_DIR_NORTH_EAST;
   int   user_dir_cont        = USER_DIR_CONT;
   int   user_dir_all         = USER_DIR_ALL;
-  int   user_dist_min        = USER_DIST_MIN;
-  int   user_dist_max        = USER_DIST_MAX;
+  int   keyspace             = KEYSPACE;
+  u64   skip                 = SKIP;
+  u64   limit                = LIMIT;
+  int   skip_rc              = 0;
+  int   limit_rc             = 0;
+  int   timing               = TIMING;
+  int   benchmark            = BENCHMARK;
+  char *restore_file         = NULL;
+  int   restore_timer        = RESTORE_TIMER;
+  int   restore              = RESTORE;
+  int   route_stats          = STATS_NONE;
+  char *compile_file         = NULL;
+  char *cache_file           = NULL;
+  char *match_file           = NULL;
+  char *crack_file           = NULL;
+  char *rules_file           = NULL;
+  int   hash_type            = HASH_TYPE;
+  int   combinator           = COMBINATOR;
+  char *right_basechar_file  = NULL;
+  char *right_keymap_file    = NULL;
+  char *right_routes_file    = NULL;
+  char *separators           = NULL;
+  int   combined_length_max  = COMBINED_LENGTH_MAX;
+  int   layout_tag           = LAYOUT_TAG;
+  int   layout_split         = LAYOUT_SPLIT;
 
   #define IDX_VERSION              'V'
   #define IDX_USAGE                'h'
@@ -648,6 +427,42 @@ int main (int argc, char *argv[])
   #define IDX_USER_DIR_ALL         '0'
   #define IDX_USER_DIST_MIN        'n'
   #define IDX_USER_DIST_MAX        'x'
+  #define IDX_THREADS              't'
+  #define IDX_UNORDERED            'u'
+  #define IDX_RULES_FILE           'r'
+  #define IDX_KEYSPACE             0xff00
+  #define IDX_SKIP                 0xff01
+  #define IDX_LIMIT                0xff02
+  #define IDX_TIMING               0xff03
+  #define IDX_OUTPUT_ENCODING      0xff04
+  #define IDX_ROUTE_ORDER          0xff05
+  #define IDX_BENCHMARK            0xff06
+  #define IDX_WRITE_BUFFER         0xff07
+  #define IDX_OUTPUT_BACKEND       0xff08
+  #define IDX_RESTORE_FILE         0xff09
+  #define IDX_RESTORE_TIMER        0xff0a
+  #define IDX_RESTORE              0xff0b
+  #define IDX_UNIQUE               0xff0c
+  #define IDX_UNIQUE_MEMORY        0xff0d
+  #define IDX_STATS                0xff0e
+  #define IDX_COMPILE              0xff0f
+  #define IDX_CACHE                0xff10
+  #define IDX_POLICY_LENGTH_MIN    0xff11
+  #define IDX_POLICY_LENGTH_MAX    0xff12
+  #define IDX_POLICY_CLASSES       0xff13
+  #define IDX_POLICY_KEYBOARDS     0xff14
+  #define IDX_POLICY_RUN_MAX       0xff15
+  #define IDX_MATCH                0xff16
+  #define IDX_CRACK                0xff17
+  #define IDX_HASH_TYPE            0xff18
+  #define IDX_COMBINATOR           0xff19
+  #define IDX_RIGHT_BASECHARS      0xff1a
+  #define IDX_RIGHT_KEYMAP         0xff1b
+  #define IDX_RIGHT_ROUTES         0xff1c
+  #define IDX_SEPARATORS           0xff1d
+  #define IDX_COMBINED_LENGTH_MAX  0xff1e
+  #define IDX_LAYOUT_TAG           0xff1f
+  #define IDX_LAYOUT_SPLIT         0xff20
 
   struct option long_options[] =
   {
@@ -671,6 +486,42 @@ int main (int argc, char *argv[])
     {"keywalk-all",           no_argument,       0, IDX_USER_DIR_ALL},
     {"keywalk-distance-min",  required_argument, 0, IDX_USER_DIST_MIN},
     {"keywalk-distance-max",  required_argument, 0, IDX_USER_DIST_MAX},
+    {"threads",               required_argument, 0, IDX_THREADS},
+    {"unordered",             no_argument,       0, IDX_UNORDERED},
+    {"rules-file",            required_argument, 0, IDX_RULES_FILE},
+    {"keyspace",              no_argument,       0, IDX_KEYSPACE},
+    {"skip",                  required_argument, 0, IDX_SKIP},
+    {"limit",                 required_argument, 0, IDX_LIMIT},
+    {"timing",                no_argument,       0, IDX_TIMING},
+    {"output-encoding",       required_argument, 0, IDX_OUTPUT_ENCODING},
+    {"route-order",           no_argument,       0, IDX_ROUTE_ORDER},
+    {"benchmark",             no_argument,       0, IDX_BENCHMARK},
+    {"write-buffer",          required_argument, 0, IDX_WRITE_BUFFER},
+    {"output-backend",        required_argument, 0, IDX_OUTPUT_BACKEND},
+    {"restore-file",          required_argument, 0, IDX_RESTORE_FILE},
+    {"restore-timer",         required_argument, 0, IDX_RESTORE_TIMER},
+    {"restore",               no_argument,       0, IDX_RESTORE},
+    {"unique",                required_argument, 0, IDX_UNIQUE},
+    {"unique-memory",         required_argument, 0, IDX_UNIQUE_MEMORY},
+    {"stats",                 required_argument, 0, IDX_STATS},
+    {"compile",               required_argument, 0, IDX_COMPILE},
+    {"cache",                 required_argument, 0, IDX_CACHE},
+    {"policy-length-min",     required_argument, 0, IDX_POLICY_LENGTH_MIN},
+    {"policy-length-max",     required_argument, 0, IDX_POLICY_LENGTH_MAX},
+    {"policy-classes",        required_argument, 0, IDX_POLICY_CLASSES},
+    {"policy-keyboards",      required_argument, 0, IDX_POLICY_KEYBOARDS},
+    {"policy-run-max",        required_argument, 0, IDX_POLICY_RUN_MAX},
+    {"match",                 required_argument, 0, IDX_MATCH},
+    {"crack",                 required_argument, 0, IDX_CRACK},
+    {"hash-type",             required_argument, 0, IDX_HASH_TYPE},
+    {"combinator",            no_argument,       0, IDX_COMBINATOR},
+    {"right-basechars",       required_argument, 0, IDX_RIGHT_BASECHARS},
+    {"right-keymap",          required_argument, 0, IDX_RIGHT_KEYMAP},
+    {"right-routes",          required_argument, 0, IDX_RIGHT_ROUTES},
+    {"separators",            required_argument, 0, IDX_SEPARATORS},
+    {"combined-length-max",   required_argument, 0, IDX_COMBINED_LENGTH_MAX},
+    {"layout-tag",            no_argument,       0, IDX_LAYOUT_TAG},
+    {"layout-split",          no_argument,       0, IDX_LAYOUT_SPLIT},
     {0, 0, 0, 0}
   };
 
@@ -678,30 +529,66 @@ int main (int argc, char *argv[])
 
   int c;
 
-  while ((c = getopt_long (argc, argv, "Vho:b:s:a:z1:2:3:4:5:6:7:8:9:c:0n:x:", long_options, &option_index)) != -1)
+  while ((c = getopt_long (argc, argv, "Vho:b:s:a:z1:2:3:4:5:6:7:8:9:c:0n:x:t:ur:", long_options, &option_index)) != -1)
   {
     switch (c)
     {
-      case IDX_VERSION:             version             = 1;             break;
-      case IDX_USAGE:               usage               = 1;             break;
-      case IDX_OUTPUT_FILE:         output_file         = optarg;        break;
-      case IDX_USER_MOD_BASIC:      user_mod_basic      = atoi (optarg); break;
-      case IDX_USER_MOD_SHIFT:      user_mod_shift      = atoi (optarg); break;
-      case IDX_USER_MOD_ALTGR:      user_mod_altgr      = atoi (optarg); break;
-      case IDX_USER_MOD_ALL:        user_mod_all        = 1;             break;
-      case IDX_USER_DIR_SOUTH_WEST: user_dir_south_west = atoi (optarg); break;
-      case IDX_USER_DIR_SOUTH:      user_dir_south      = atoi (optarg); break;
-      case IDX_USER_DIR_SOUTH_EAST: user_dir_south_east = atoi (optarg); break;
-      case IDX_USER_DIR_WEST:       user_dir_west       = atoi (optarg); break;
-      case IDX_USER_DIR_REPEAT:     user_dir_repeat     = atoi (optarg); break;
-      case IDX_USER_DIR_EAST:       user_dir_east       = atoi (optarg); break;
-      case IDX_USER_DIR_NORTH_WEST: user_dir_north_west = atoi (optarg); break;
-      case IDX_USER_DIR_NORTH:      user_dir_north      = atoi (optarg); break;
-      case IDX_USER_DIR_NORTH_EAST: user_dir_north_east = atoi (optarg); break;
-      case IDX_USER_DIR_CONT:       user_dir_cont       = 1;             break;
-      case IDX_USER_DIR_ALL:        user_dir_all        = 1;             break;
-      case IDX_USER_DIST_MIN:       user_dist_min       = atoi (optarg); break;
-      case IDX_USER_DIST_MAX:       user_dist_max       = atoi (optarg); break;
+      case IDX_VERSION:             version                  = 1;                              break;
+      case IDX_USAGE:               usage                    = 1;                              break;
+      case IDX_OUTPUT_FILE:         output_file              = optarg;                         break;
+      case IDX_USER_MOD_BASIC:      conf.user_mod_basic      = atoi (optarg);                  break;
+      case IDX_USER_MOD_SHIFT:      conf.user_mod_shift      = atoi (optarg);                  break;
+      case IDX_USER_MOD_ALTGR:      conf.user_mod_altgr      = atoi (optarg);                  break;
+      case IDX_USER_MOD_ALL:        user_mod_all             = 1;                              break;
+      case IDX_USER_DIR_SOUTH_WEST: conf.user_dir_south_west = atoi (optarg);                  break;
+      case IDX_USER_DIR_SOUTH:      conf.user_dir_south      = atoi (optarg);                  break;
+      case IDX_USER_DIR_SOUTH_EAST: conf.user_dir_south_east = atoi (optarg);                  break;
+      case IDX_USER_DIR_WEST:       conf.user_dir_west       = atoi (optarg);                  break;
+      case IDX_USER_DIR_REPEAT:     conf.user_dir_repeat     = atoi (optarg);                  break;
+      case IDX_USER_DIR_EAST:       conf.user_dir_east       = atoi (optarg);                  break;
+      case IDX_USER_DIR_NORTH_WEST: conf.user_dir_north_west = atoi (optarg);                  break;
+      case IDX_USER_DIR_NORTH:      conf.user_dir_north      = atoi (optarg);                  break;
+      case IDX_USER_DIR_NORTH_EAST: conf.user_dir_north_east = atoi (optarg);                  break;
+      case IDX_USER_DIR_CONT:       user_dir_cont            = 1;                              break;
+      case IDX_USER_DIR_ALL:        user_dir_all             = 1;                              break;
+      case IDX_USER_DIST_MIN:       conf.user_dist_min       = atoi (optarg);                  break;
+      case IDX_USER_DIST_MAX:       conf.user_dist_max       = atoi (optarg);                  break;
+      case IDX_THREADS:             conf.threads             = atoi (optarg);                  break;
+      case IDX_UNORDERED:           conf.unordered           = 1;                              break;
+      case IDX_RULES_FILE:          rules_file               = optarg;                         break;
+      case IDX_KEYSPACE:            keyspace                 = 1;                              break;
+      case IDX_SKIP:                skip_rc                  = count_parse (optarg, &skip);    break;
+      case IDX_LIMIT:               limit_rc                 = count_parse (optarg, &limit);   break;
+      case IDX_TIMING:              timing                   = 1;                              break;
+      case IDX_OUTPUT_ENCODING:     conf.encoding            = kwp_parse_encoding (optarg);    break;
+      case IDX_ROUTE_ORDER:         conf.route_order         = 1;                              break;
+      case IDX_BENCHMARK:           benchmark                = 1;                              break;
+      case IDX_WRITE_BUFFER:        conf.write_buffer        = atoi (optarg);                  break;
+      case IDX_OUTPUT_BACKEND:      conf.output_backend      = kwp_parse_backend (optarg);     break;
+      case IDX_RESTORE_FILE:        restore_file             = optarg;                         break;
+      case IDX_RESTORE_TIMER:       restore_timer            = atoi (optarg);                  break;
+      case IDX_RESTORE:             restore                  = 1;                              break;
+      case IDX_UNIQUE:              conf.unique              = kwp_parse_unique (optarg);      break;
+      case IDX_UNIQUE_MEMORY:       conf.unique_memory       = atoi (optarg);                  break;
+      case IDX_STATS:               route_stats              = stats_parse (optarg);           break;
+      case IDX_COMPILE:             compile_file             = optarg;                         break;
+      case IDX_CACHE:               cache_file               = optarg;                         break;
+      case IDX_MATCH:               match_file               = optarg;                         break;
+      case IDX_CRACK:               crack_file               = optarg;                         break;
+      case IDX_HASH_TYPE:           hash_type                = kwp_parse_hash (optarg);        break;
+      case IDX_COMBINATOR:          combinator               = 1;                              break;
+      case IDX_RIGHT_BASECHARS:     right_basechar_file      = optarg;                         break;
+      case IDX_RIGHT_KEYMAP:        right_keymap_file        = optarg;                         break;
+      case IDX_RIGHT_ROUTES:        right_routes_file        = optarg;                         break;
+      case IDX_SEPARATORS:          separators               = optarg;                         break;
+      case IDX_COMBINED_LENGTH_MAX: combined_length_max      = atoi (optarg);                  break;
+      case IDX_LAYOUT_TAG:          layout_tag               = 1;                              break;
+      case IDX_LAYOUT_SPLIT:        layout_split             = 1;                              break;
+      case IDX_POLICY_LENGTH_MIN:   conf.policy_length_min   = atoi (optarg);                  break;
+      case IDX_POLICY_LENGTH_MAX:   conf.policy_length_max   = atoi (optarg);                  break;
+      case IDX_POLICY_CLASSES:      conf.policy_classes      = kwp_parse_classes (optarg);     break;
+      case IDX_POLICY_KEYBOARDS:    conf.policy_keyboards    = kwp_parse_keyboard (optarg);    break;
+      case IDX_POLICY_RUN_MAX:      conf.policy_run_max      = atoi (optarg);                  break;
 
       default: return (-1);
     }
@@ -709,37 +596,118 @@ int main (int argc, char *argv[])
 
   // some sanity checks
 
-  if (user_dist_min < 1)
+  if (skip_rc == -1)
   {
-    fprintf (stderr, "Keywalk distance minimum can not be smaller than than 1\n");
+    fprintf (stderr, "Skip must be a non-negative number\n");
 
     return (-1);
   }
 
-  if (user_dist_max < 1)
+  if (limit_rc == -1)
   {
-    fprintf (stderr, "Keywalk distance maximum can not be smaller than than 1\n");
+    fprintf (stderr, "Limit must be a non-negative number\n");
 
     return (-1);
   }
 
-  if (user_dist_min > DIST_CNT)
+  if (route_stats == -1)
   {
-    fprintf (stderr, "Keywalk distance minimum can not be greater than than %d\n", DIST_CNT);
+    fprintf (stderr, "Stats must be one of table or json\n");
 
     return (-1);
   }
 
-  if (user_dist_max > DIST_CNT)
+  if ((route_stats) && (conf.route_order == 0))
   {
-    fprintf (stderr, "Keywalk distance maximum can not be greater than than %d\n", DIST_CNT);
+    fprintf (stderr, "Stats require --route-order\n");
 
     return (-1);
   }
 
-  if (user_dist_min > user_dist_max)
+  conf.route_stats = (route_stats != STATS_NONE);
+
+  if (kwp_conf_check (&conf) == -1) return (-1);
+
+  if ((restore) && (restore_file == NULL))
   {
-    fprintf (stderr, "Keywalk distance minimum can not be greater than maximum\n");
+    fprintf (stderr, "Restore requires --restore-file\n");
+
+    return (-1);
+  }
+
+  if ((restore) && (skip))
+  {
+    fprintf (stderr, "Restore can not be combined with --skip\n");
+
+    return (-1);
+  }
+
+  if ((restore_file) && (conf.threads > 1) && (conf.unordered))
+  {
+    fprintf (stderr, "Restore file requires ordered output\n");
+
+    return (-1);
+  }
+
+  if (restore_timer < 1)
+  {
+    fprintf (stderr, "Restore timer can not be smaller than 1\n");
+
+    return (-1);
+  }
+
+  if ((compile_file) && (cache_file))
+  {
+    fprintf (stderr, "Compile can not be combined with --cache\n");
+
+    return (-1);
+  }
+
+  if ((compile_file) && (match_file))
+  {
+    fprintf (stderr, "Compile can not be combined with --match\n");
+
+    return (-1);
+  }
+
+  if ((combinator) && ((keyspace) || (skip) || (restore_file) || (route_stats) || (conf.policy_length_min) || (conf.policy_length_max) || (conf.policy_classes) || (conf.policy_keyboards) || (conf.policy_run_max)))
+  {
+    fprintf (stderr, "Combinator can not be combined with --keyspace, --skip, --restore-file, --stats or a policy\n");
+
+    return (-1);
+  }
+
+  if ((combinator) && (cache_file) && ((right_basechar_file == NULL) || (right_keymap_file == NULL) || (right_routes_file == NULL)))
+  {
+    fprintf (stderr, "Combinator with --cache requires --right-basechars, --right-keymap and --right-routes\n");
+
+    return (-1);
+  }
+
+  if (combined_length_max < 0)
+  {
+    fprintf (stderr, "Combined length max can not be negative\n");
+
+    return (-1);
+  }
+
+  if (hash_type == -1)
+  {
+    fprintf (stderr, "Hash type must be md5, sha1 or ntlm\n");
+
+    return (-1);
+  }
+
+  if ((layout_split) && (output_file == NULL) && (benchmark == 0))
+  {
+    fprintf (stderr, "Layout split requires --output-file\n");
+
+    return (-1);
+  }
+
+  if (((layout_tag) || (layout_split)) && ((combinator) || (compile_file) || (match_file)))
+  {
+    fprintf (stderr, "Layout tag and split can not be combined with --combinator, --compile or --match\n");
 
     return (-1);
   }
@@ -748,35 +716,35 @@ int main (int argc, char *argv[])
 
   if (user_mod_all)
   {
-    user_mod_basic      = 1;
-    user_mod_shift      = 1;
-    user_mod_altgr      = 1;
+    conf.user_mod_basic      = 1;
+    conf.user_mod_shift      = 1;
+    conf.user_mod_altgr      = 1;
   }
 
   if (user_dir_cont)
   {
-    user_dir_south_west = 1;
-    user_dir_south      = 1;
-    user_dir_south_east = 0;
-    user_dir_west       = 1;
-    user_dir_repeat     = 1;
-    user_dir_east       = 1;
-    user_dir_north_west = 0;
-    user_dir_north      = 1;
-    user_dir_north_east = 1;
+    conf.user_dir_south_west = 1;
+    conf.user_dir_south      = 1;
+    conf.user_dir_south_east = 0;
+    conf.user_dir_west       = 1;
+    conf.user_dir_repeat     = 1;
+    conf.user_dir_east       = 1;
+    conf.user_dir_north_west = 0;
+    conf.user_dir_north      = 1;
+    conf.user_dir_north_east = 1;
   }
 
   if (user_dir_all)
   {
-    user_dir_south_west = 1;
-    user_dir_south      = 1;
-    user_dir_south_east = 1;
-    user_dir_west       = 1;
-    user_dir_repeat     = 1;
-    user_dir_east       = 1;
-    user_dir_north_west = 1;
-    user_dir_north      = 1;
-    user_dir_north_east = 1;
+    conf.user_dir_south_west = 1;
+    conf.user_dir_south      = 1;
+    conf.user_dir_south_east = 1;
+    conf.user_dir_west       = 1;
+    conf.user_dir_repeat     = 1;
+    conf.user_dir_east       = 1;
+    conf.user_dir_north_west = 1;
+    conf.user_dir_north      = 1;
+    conf.user_dir_north_east = 1;
   }
 
   // version and usage
@@ -790,18 +758,29 @@ int main (int argc, char *argv[])
 
   if (version)
   {
-    printf ("v%4.02f\n", (double) VERSION_BIN / 100);
+    printf ("v%4.02f\n", (double) KWP_VERSION / 100);
 
     return (-1);
   }
 
-  if ((optind + 3) != argc)
+  // a cache replaces the input files, otherwise every keymap between basechars and routes is a layout of its own
+
+  if ((cache_file) ? (optind != argc) : (optind + 3 > argc))
   {
     usage_mini_print (argv[0]);
 
     return (-1);
   }
 
+  const int keymaps_cnt = (cache_file) ? 1 : argc - optind - 2;
+
+  if ((keymaps_cnt > 1) && ((skip) || (restore_file) || (route_stats) || (compile_file) || (match_file) || (crack_file) || (combinator)))
+  {
+    fprintf (stderr, "Several keymaps can not be combined with --skip, --restore-file, --stats, --compile, --match, --crack or --combinator\n");
+
+    return (-1);
+  }
+
   /* files out */
 
   #ifdef WINDOWS
@@ -813,7 +792,7 @@ int main (int argc, char *argv[])
 
   FILE *fp_out = stdout;
 
-  if (output_file)
+  if ((output_file) && (layout_split == 0))
   {
     if ((fp_out = fopen (output_file, "a")) == NULL)
     {
@@ -825,200 +804,373 @@ int main (int argc, char *argv[])
 
   setbuf (fp_out, NULL);
 
-  out_t *out = (out_t *) malloc (sizeof (out_t));
+  // some stuff
 
-  out->fp  = fp_out;
-  out->len = 0;
+  char *basechar_file = (cache_file) ? NULL : argv[optind + 0];
+  char *keymap_file   = (cache_file) ? NULL : argv[optind + 1];
+  char *routes_file   = (cache_file) ? NULL : argv[argc - 1];
 
-  // some stuff
+  kwp_ctx_t *ctx = (cache_file) ? kwp_init_cache (&conf, cache_file) : kwp_init (&conf, basechar_file, keymap_file, routes_file);
 
-  char *basechar_file = argv[optind + 0];
-  char *keymap_file   = argv[optind + 1];
-  char *routes_file   = argv[optind + 2];
+  if (ctx == NULL) return (-1);
 
-  // init keymaps
+  kwp_stats_t stats;
 
-  wchar_t keymap_basic[KEYMAP_WIDTH][KEYMAP_HEIGHT];
-  wchar_t keymap_shift[KEYMAP_WIDTH][KEYMAP_HEIGHT];
-  wchar_t keymap_altgr[KEYMAP_WIDTH][KEYMAP_HEIGHT];
+  char layout[LAYOUT_NAME_MAX];
 
-  for (int x = 0; x < KEYMAP_WIDTH; x++)
+  layout_name ((cache_file) ? cache_file : keymap_file, layout, sizeof (layout));
+
+  if (timing)
   {
-    for (int y = 0; y < KEYMAP_HEIGHT; y++)
-    {
-      keymap_basic[x][y] = RC_INVALID;
-      keymap_shift[x][y] = RC_INVALID;
-      keymap_altgr[x][y] = RC_INVALID;
-    }
+    kwp_stats (ctx, &stats);
+
+    if (keymaps_cnt > 1) fprintf (stderr, "%s: ", layout);
+
+    fprintf (stderr, "Startup: keymap %.3f ms, tables %.3f ms, basechars %.3f ms, routes %.3f ms, total %.3f ms\n",
+      stats.keymap_ms,
+      stats.tables_ms,
+      stats.basechars_ms,
+      stats.routes_ms,
+      stats.total_ms);
   }
 
-  FILE *fp = fopen (keymap_file, "r");
+  // compile
 
-  if (fp == NULL)
+  if (compile_file)
   {
-    fprintf (stderr, "%s: %s\n", keymap_file, strerror (errno));
+    const int rc = kwp_compile (ctx, compile_file);
+
+    kwp_free (ctx);
 
-    return -1;
+    return (rc == -1) ? -1 : 0;
   }
 
-  const int keymap_pot = count_lines (fp);
+  // match
 
-  if (keymap_pot != 12)
+  if (match_file)
   {
-    fprintf (stderr, "Invalid keymap, not exactly 12 lines\n");
+    u64 words   = 0;
+    u64 matched = 0;
+
+    const int rc = kwp_match (ctx, match_file, fp_out, &words, &matched);
+
+    if (rc == 0) fprintf (stderr, "Matched: %llu of %llu words\n", (unsigned long long) matched, (unsigned long long) words);
 
-    return -1;
+    kwp_free (ctx);
+
+    return (rc == -1) ? -1 : 0;
   }
 
-  rewind (fp);
+  // layouts, the ones after the first only read their keymap. split files are complete on their own, so duplicates are
+  // only removed across the layouts of a single output
+
+  kwp_ctx_t **layouts_buf = (kwp_ctx_t **) calloc (keymaps_cnt, sizeof (kwp_ctx_t *));
 
-  int rc = parse_keymap_file (fp, keymap_basic, keymap_shift, keymap_altgr);
+  layouts_buf[0] = ctx;
 
-  if (rc == -1)
+  for (int keymaps_pos = 1; keymaps_pos < keymaps_cnt; keymaps_pos++)
   {
-    fprintf (stderr, "%s: Invalid keymap\n", keymap_file);
+    const char *file = argv[optind + 1 + keymaps_pos];
 
-    return -1;
-  }
+    if ((layouts_buf[keymaps_pos] = kwp_init_keymap (ctx, file, layout_split == 0)) == NULL) return (-1);
 
-  fclose (fp);
+    if (timing)
+    {
+      kwp_stats (layouts_buf[keymaps_pos], &stats);
 
-  // init charset
+      layout_name (file, layout, sizeof (layout));
 
-  cs_t *css = (cs_t *) calloc (0x10000, sizeof (cs_t));
+      fprintf (stderr, "%s: Startup: keymap %.3f ms, tables %.3f ms, basechars %.3f ms, total %.3f ms\n",
+        layout,
+        stats.keymap_ms,
+        stats.tables_ms,
+        stats.basechars_ms,
+        stats.total_ms);
+    }
+  }
 
-  for (int c = 0; c < 0x10000; c++)
+  if (layout_tag)
   {
-    setup_cs (css + c, c, keymap_basic, keymap_shift, keymap_altgr, user_mod_basic, user_mod_shift, user_mod_altgr, user_dir_south_west, user_dir_south, user_dir_south_east, user_dir_west, user_dir_repeat, user_dir_east, user_dir_north_west, user_dir_north, user_dir_north_east, user_dist_min, user_dist_max);
+    for (int keymaps_pos = 0; keymaps_pos < keymaps_cnt; keymaps_pos++)
+    {
+      layout_name ((cache_file) ? cache_file : argv[optind + 1 + keymaps_pos], layout, sizeof (layout));
+
+      if (kwp_set_tag (layouts_buf[keymaps_pos], layout) == -1) return (-1);
+    }
   }
 
-  // init basechars
+  // keyspace
+
+  if (keyspace)
+  {
+    u64 total = 0;
+
+    for (int keymaps_pos = 0; keymaps_pos < keymaps_cnt; keymaps_pos++)
+    {
+      const kwp_ctx_t *layout_ctx = layouts_buf[keymaps_pos];
 
-  int basechars_cnt = 0;
+      const int routes_cnt = kwp_routes_cnt (layout_ctx);
 
-  wchar_t *basechars_buf = (wchar_t *) calloc (0x10000, sizeof (wchar_t));
+      u64 layout_total = 0;
 
-  fp = fopen (basechar_file, "r");
+      u64 *cnt_buf = (u64 *) calloc (routes_cnt, sizeof (u64));
 
-  if (fp == NULL)
-  {
-    fprintf (stderr, "%s: %s\n", basechar_file, strerror (errno));
+      if ((kwp_keyspace (layout_ctx, &layout_total, cnt_buf) == -1) || (total + layout_total < total))
+      {
+        fprintf (stderr, "Keyspace does not fit into 64 bit\n");
+
+        return (-1);
+      }
+
+      total += layout_total;
+
+      if (keymaps_cnt > 1) layout_name (argv[optind + 1 + keymaps_pos], layout, sizeof (layout));
+
+      for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+      {
+        char route_str[KWP_ROUTE_STR_SIZE];
+
+        kwp_route_str (layout_ctx, routes_pos, route_str);
 
-    return -1;
+        if (keymaps_cnt > 1) fprintf (stderr, "%s: ", layout);
+
+        fprintf (stderr, "%s: %llu\n", route_str, (unsigned long long) cnt_buf[routes_pos]);
+      }
+
+      free (cnt_buf);
+    }
+
+    printf ("%llu\n", (unsigned long long) total);
+
+    layouts_free (layouts_buf, keymaps_cnt);
+
+    return 0;
   }
 
-  const int basechars_pot = count_lines (fp);
+  // rules
 
-  if (basechars_pot != 1)
+  if (rules_file)
   {
-    fprintf (stderr, "Invalid basechars, not exactly 1 line\n");
-
-    return -1;
+    for (int keymaps_pos = 0; keymaps_pos < keymaps_cnt; keymaps_pos++)
+    {
+      if (kwp_rules (layouts_buf[keymaps_pos], rules_file) == -1) return (-1);
+    }
   }
 
-  rewind (fp);
+  // crack
 
-  rc = parse_basechars_file (fp, basechars_buf, &basechars_cnt, css, user_mod_basic, user_mod_shift, user_mod_altgr);
+  int hashes_cnt = 0;
 
-  if (rc == -1)
+  if (crack_file)
   {
-    fprintf (stderr, "%s: Invalid basechars\n", basechar_file);
+    if ((hashes_cnt = kwp_crack (ctx, hash_type, crack_file)) == -1) return (-1);
+  }
 
-    return -1;
+  // skip and limit
+
+  if (restore)
+  {
+    if (kwp_restore_read (ctx, restore_file, &skip) == -1) return (-1);
   }
 
-  fclose (fp);
+  if ((skip) && (kwp_seek (ctx, skip) == -1))
+  {
+    u64 total = 0;
 
-  // init routes
+    if ((kwp_keyspace (ctx, &total, NULL) == -1) || (skip > total))
+    {
+      fprintf (stderr, "Skip is greater than keyspace\n");
 
-  fp = fopen (routes_file, "r");
+      return (-1);
+    }
 
-  if (fp == NULL)
-  {
-    fprintf (stderr, "%s: %s\n", routes_file, strerror (errno));
+    // skipping the whole keyspace, e.g. restoring a finished run, leaves nothing to write or restore
+
+    if (restore_file) remove (restore_file);
+
+    layouts_free (layouts_buf, keymaps_cnt);
 
-    return -1;
+    return 0;
   }
 
-  const int routes_pot = count_lines (fp);
+  if (limit == 0) limit = UINT64_MAX;
 
-  rewind (fp);
+  // main loop
 
-  route_t *routes_buf = (route_t *) calloc (routes_pot, sizeof (route_t));
+  restore_t restore_ctx;
 
-  int routes_cnt = parse_routes_file (fp, routes_buf);
+  pthread_t restore_thread_id;
 
-  if (routes_cnt == 0)
+  if (restore_file)
   {
-    fprintf (stderr, "%s: no routes load\n", routes_file);
+    ctx_signal = ctx;
+
+    signal (SIGINT,  signal_handler);
+    signal (SIGTERM, signal_handler);
 
-    return -1;
+    restore_ctx.ctx   = ctx;
+    restore_ctx.file  = restore_file;
+    restore_ctx.timer = restore_timer;
+    restore_ctx.done  = 0;
+
+    pthread_mutex_init (&restore_ctx.mux, NULL);
+    pthread_cond_init  (&restore_ctx.cond, NULL);
+
+    pthread_create (&restore_thread_id, NULL, restore_thread, &restore_ctx);
   }
 
-  fclose (fp);
+  if (combinator)
+  {
+    // the right side only generates, duplicates are removed from the joined candidates
+
+    kwp_conf_t conf_right = conf;
 
-  // main loop
+    conf_right.unique = UNIQUE_NONE;
 
-  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+    kwp_ctx_t *right = kwp_init (&conf_right, (right_basechar_file) ? right_basechar_file : basechar_file, (right_keymap_file) ? right_keymap_file : keymap_file, (right_routes_file) ? right_routes_file : routes_file);
+
+    if (right == NULL) return (-1);
+
+    const int rc = kwp_combinator (ctx, right, separators, combined_length_max, (benchmark) ? NULL : fp_out, limit);
+
+    kwp_free (right);
+
+    if (rc == -1) return (-1);
+  }
+  else
   {
-    route_t *route_buf = routes_buf + routes_pos;
-
-    // from here we're going to bf "a route".
-    // there's a total number of "direction changes" (which is like a length for a bf algorithm)
-    // but the real password length is the sum of all repeats of all "direction changes"
-    // anyway, we brute-force all direction types for each change here to produce something like (route 313):
-    // - Iteration 1: "3*North, 1* West, 3*South"
-    // - Iteration 2: "3*North, 1* East, 3*South"
-    // - Iteration N: "3*South-East-Shifted, 1*North, 3*South-East-Alt"
-
-    const u64 dist_cnt = 1 + (user_dist_max - user_dist_min);
-
-    const u64 mod_cnt  = user_mod_basic
-                       + user_mod_shift
-                       + user_mod_altgr;
-
-    const u64 dir_cnt  = user_dir_south_west
-                       + user_dir_south
-                       + user_dir_south_east
-                       + user_dir_west
-                       + user_dir_repeat
-                       + user_dir_east
-                       + user_dir_north_west
-                       + user_dir_north
-                       + user_dir_north_east;
-
-    u64 keyspace = basechars_cnt;
-
-    for (int i = 0; i < route_buf->changes; i++)
+    // the layouts run one after the other and share the limit
+
+    u64 left = limit;
+
+    for (int keymaps_pos = 0; (keymaps_pos < keymaps_cnt) && (left); keymaps_pos++)
     {
-      keyspace *= dist_cnt * mod_cnt * dir_cnt;
+      kwp_ctx_t *layout_ctx = layouts_buf[keymaps_pos];
+
+      const char *file = (cache_file) ? cache_file : argv[optind + 1 + keymaps_pos];
+
+      FILE *fp = (benchmark) ? NULL : fp_out;
+
+      if ((layout_split) && (fp))
+      {
+        layout_name (file, layout, sizeof (layout));
+
+        char split_file[LAYOUT_NAME_MAX + BUFSIZ];
+
+        snprintf (split_file, sizeof (split_file), "%s.%s", output_file, layout);
+
+        if ((fp = fopen (split_file, "a")) == NULL)
+        {
+          fprintf (stderr, "ERROR: %s: %s\n", split_file, strerror (errno));
+
+          return (-1);
+        }
+
+        setbuf (fp, NULL);
+      }
+
+      kwp_run (layout_ctx, fp, left);
+
+      if ((layout_split) && (fp)) fclose (fp);
+
+      // a single layout is read like the combinator below, several are summed up as they finish
+
+      if (keymaps_cnt == 1) break;
+
+      kwp_stats_t layout_stats;
+
+      kwp_stats (layout_ctx, &layout_stats);
+
+      if (benchmark)
+      {
+        printf ("%s %s %s", basechar_file, file, routes_file);
+
+        benchmark_print (&layout_stats);
+      }
+
+      if (keymaps_pos == 0)
+      {
+        stats = layout_stats;
+      }
+      else
+      {
+        stats.cnt             += layout_stats.cnt;
+        stats.bytes           += layout_stats.bytes;
+        stats.gen_ms          += layout_stats.gen_ms;
+        stats.dups            += layout_stats.dups;
+        stats.rejected_policy += layout_stats.rejected_policy;
+        stats.backend          = layout_stats.backend;
+      }
+
+      if (left != UINT64_MAX) left -= (layout_stats.cnt < left) ? layout_stats.cnt : left;
     }
+  }
 
-    for (u64 k = 0; k < keyspace; k++)
-    {
-      const u64 km = k % basechars_cnt;
-      const u64 kd = k / basechars_cnt;
+  // kwp_stats() counts the whole keyspace for the rejected share, only pay for it when something is printed
+
+  const int policy = (conf.policy_classes) || (conf.policy_keyboards) || (conf.policy_run_max);
 
-      const wchar_t c = basechars_buf[km];
+  if ((keymaps_cnt == 1) && ((timing) || (benchmark) || (conf.unique != UNIQUE_NONE) || (policy) || (crack_file))) kwp_stats (ctx, &stats);
 
-      wchar_t pw_buf[100];
+  if (conf.unique != UNIQUE_NONE) fprintf (stderr, "Duplicates removed: %llu\n", (unsigned long long) stats.dups);
 
-      int pw_len = 0;
+  if (policy) fprintf (stderr, "Policy rejected: %llu\n", (unsigned long long) stats.rejected_policy);
 
-      const int rc = process_route (css, c, kd, dist_cnt, mod_cnt, dir_cnt, route_buf, pw_buf, &pw_len);
+  if (crack_file) fprintf (stderr, "Cracked: %llu of %d hashes\n", (unsigned long long) stats.cracked, hashes_cnt);
 
-      if (rc == RC_INVALID) continue;
+  if (route_stats) stats_print (ctx, route_stats);
+
+  if (restore_file)
+  {
+    pthread_mutex_lock (&restore_ctx.mux);
 
-      out_push (out, pw_buf, pw_len);
+    restore_ctx.done = 1;
+
+    pthread_cond_broadcast (&restore_ctx.cond);
+
+    pthread_mutex_unlock (&restore_ctx.mux);
+
+    pthread_join (restore_thread_id, NULL);
+
+    pthread_cond_destroy  (&restore_ctx.cond);
+    pthread_mutex_destroy (&restore_ctx.mux);
+
+    // a finished keyspace leaves nothing to restore, a stopped or limited run keeps the position of the next candidate
+
+    u64 total = 0;
+
+    const int finished = (kwp_keyspace (ctx, &total, NULL) == 0) && (kwp_pos (ctx) >= total);
+
+    if ((finished == 0) && ((kwp_stopped (ctx)) || (limit != UINT64_MAX)))
+    {
+      if (kwp_restore_write (ctx, restore_file) == -1) return (-1);
+    }
+    else
+    {
+      remove (restore_file);
+    }
+
+    if (kwp_stopped (ctx))
+    {
+      fprintf (stderr, "Stopped at candidate %llu, continue with --restore\n", (unsigned long long) kwp_pos (ctx));
+
+      kwp_free (ctx);
+
+      return (-1);
     }
   }
 
-  out_flush (out);
+  if (timing) fprintf (stderr, "Output: %s\n", kwp_backend_name (stats.backend));
+
+  if ((benchmark) && (keymaps_cnt == 1))
+  {
+    if (cache_file) printf ("%s", cache_file);
+    else            printf ("%s %s %s", basechar_file, keymap_file, routes_file);
+
+    benchmark_print (&stats);
+  }
 
-  free (routes_buf);
-  free(basechars_buf);
-  free (css);
-  free (out);
+  layouts_free (layouts_buf, keymaps_cnt);
 
   return 0;
 }
@@ -0,0 +1,236 @@
+#ifndef _KWP_H
+#define _KWP_H
+
+/**
+ * Name........: keyboard-walk-processor (kwp)
+ * Description.: Advanced keyboard-walk generator with configureable basechars, keymap and routes
+ * Autor.......: Jens Steube <jens.steube@gmail.com>
+ * License.....: MIT
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define KWP_VERSION           100
+
+#define ENCODING_LOCALE       0
+#define ENCODING_UTF8         1
+#define ENCODING_LATIN1       2
+#define ENCODING_UTF16LE      3
+
+#define BACKEND_AUTO          0
+#define BACKEND_FWRITE        1
+#define BACKEND_VMSPLICE      2
+#define BACKEND_DISCARD       3
+
+#define UNIQUE_NONE           0
+#define UNIQUE_EXACT          1
+#define UNIQUE_BLOOM          2
+
+#define POLICY_LOWER          (1 << 0)
+#define POLICY_UPPER          (1 << 1)
+#define POLICY_DIGIT          (1 << 2)
+#define POLICY_SPECIAL        (1 << 3)
+#define POLICY_BASIC          (1 << 4)
+#define POLICY_SHIFT          (1 << 5)
+#define POLICY_ALTGR          (1 << 6)
+
+#define HASH_MD5              0
+#define HASH_SHA1             1
+#define HASH_NTLM             2
+
+#define KWP_ROUTE_STR_SIZE    33          // longest route plus the terminating zero
+#define KWP_BATCH_MIN         (64 << 10)  // smallest buffer kwp_next_batch() accepts
+
+typedef struct kwp_conf
+{
+  int user_mod_basic;
+  int user_mod_shift;
+  int user_mod_altgr;
+
+  int user_dir_south_west;
+  int user_dir_south;
+  int user_dir_south_east;
+  int user_dir_west;
+  int user_dir_repeat;
+  int user_dir_east;
+  int user_dir_north_west;
+  int user_dir_north;
+  int user_dir_north_east;
+
+  int user_dist_min;
+  int user_dist_max;
+
+  int encoding;         // ENCODING_*
+  int route_order;      // keep the per-route output order
+
+  // duplicates are tracked for the lifetime of the context. positions, kwp_seek() and limits still count them
+
+  int unique;           // UNIQUE_*
+  int unique_memory;    // MB for UNIQUE_BLOOM
+
+  int route_stats;      // collect kwp_route_stats() during kwp_run(), needs route_order
+
+  // password policy. routes that can not fit the length are left out of the keyspace, candidates that break one of
+  // the other rules are not written but still count for positions, kwp_seek() and limits like duplicates. 0 is off
+
+  int policy_length_min;
+  int policy_length_max;
+  int policy_classes;   // POLICY_LOWER .. POLICY_SPECIAL, each has to be in the candidate
+  int policy_keyboards; // POLICY_BASIC .. POLICY_ALTGR, a key of each keymap has to be in the candidate
+  int policy_run_max;   // longest run of the same character
+
+  // kwp_run() only, batches are always generated by a single thread
+
+  int threads;
+  int unordered;
+  int write_buffer;     // MB per output buffer
+  int output_backend;   // BACKEND_*
+
+} kwp_conf_t;
+
+typedef struct kwp_stats
+{
+  // startup, filled by kwp_init()
+
+  double   keymap_ms;
+  double   tables_ms;
+  double   basechars_ms;
+  double   routes_ms;
+  double   total_ms;
+
+  // last kwp_run()
+
+  uint64_t cnt;          // generated, duplicates included
+  uint64_t bytes;
+  double   gen_ms;
+  int      backend;
+  uint64_t dups;         // removed by conf.unique
+  uint64_t rejected_policy;   // not written because of the conf.policy_* rules, included in cnt
+  uint64_t cracked;           // hashes of kwp_crack() cracked for the first time
+
+  // share of the plain mixed-radix enumeration that is not a valid walk, a lower bound if rejected_min is set
+
+  double   rejected;
+  int      rejected_min;
+
+} kwp_stats_t;
+
+typedef struct kwp_route_stats
+{
+  // the loop of the original generator, basechars times selections to the power of direction changes. the rejected
+  // part of it is split by the first check that failed, in the order the original process_route() ran them
+
+  double   keyspace;
+  double   rejected_keymap;   // walk leaves the keymap
+  double   rejected_repeat;   // same selection for two direction changes in a row
+
+  // last kwp_run(), with threads ms is the sum over all workers
+
+  uint64_t emitted;
+  uint64_t bytes;             // before duplicates are removed
+  double   ms;
+
+} kwp_route_stats_t;
+
+typedef struct kwp_ctx kwp_ctx_t;
+
+// configuration, kwp_conf_check() prints the reason to stderr
+
+void        kwp_conf_init      (kwp_conf_t *conf);
+int         kwp_conf_check     (const kwp_conf_t *conf);
+int         kwp_parse_encoding (const char *name);
+int         kwp_parse_backend  (const char *name);
+int         kwp_parse_unique   (const char *name);
+int         kwp_parse_classes  (const char *str);
+int         kwp_parse_keyboard (const char *str);
+int         kwp_parse_hash     (const char *name);
+const char *kwp_backend_name   (const int backend);
+
+// loads the files and builds all tables, NULL on error with the reason on stderr
+
+kwp_ctx_t  *kwp_init           (const kwp_conf_t *conf, const char *basechar_file, const char *keymap_file, const char *routes_file);
+void        kwp_free           (kwp_ctx_t *ctx);
+
+// another layout for the basechars and routes of base, which is not a kwp_init_cache() context and has to be freed last.
+// only the keymap is read and the tables of the walk are built. with unique_shared duplicates are removed across base and
+// every context sharing its unique, otherwise within the new context only
+
+kwp_ctx_t  *kwp_init_keymap    (const kwp_ctx_t *base, const char *keymap_file, const int unique_shared);
+
+// --compile, writes the parsed files and all tables of ctx to file. kwp_init_cache() maps it instead of calling
+// kwp_init(), conf has to use the same keyboard, keywalk and encoding options and the same platform
+
+int         kwp_compile        (kwp_ctx_t *ctx, const char *file);
+kwp_ctx_t  *kwp_init_cache     (const kwp_conf_t *conf, const char *file);
+
+// number of candidates in total and optionally per route, -1 if it does not fit into 64 bit
+
+int         kwp_keyspace       (const kwp_ctx_t *ctx, uint64_t *total, uint64_t *routes_cnt_buf);
+int         kwp_routes_cnt     (const kwp_ctx_t *ctx);
+void        kwp_route_str      (const kwp_ctx_t *ctx, const int routes_pos, char *buf);
+
+// moves generation to candidate pos, in the order in use. -1 if pos is outside of the keyspace
+
+int         kwp_seek           (kwp_ctx_t *ctx, const uint64_t pos);
+
+// index of the next candidate that has not been written yet. with unordered threads it is not tracked
+
+uint64_t    kwp_pos            (kwp_ctx_t *ctx);
+
+// ends generation at the next buffer boundary, safe to call from a signal handler. kwp_pos() is exact afterwards
+
+void        kwp_stop           (kwp_ctx_t *ctx);
+int         kwp_stopped        (const kwp_ctx_t *ctx);
+
+// the restore file holds kwp_pos() and a hash of the configuration, reading it fails if the hash does not match
+
+int         kwp_restore_write  (kwp_ctx_t *ctx, const char *file);
+int         kwp_restore_read   (const kwp_ctx_t *ctx, const char *file, uint64_t *pos);
+
+// fills buf with the next candidates, each followed by the encoded newline. returns the number of bytes, 0 once the
+// keyspace is done. a batch never splits a candidate, max_bytes must be at least KWP_BATCH_MIN. cnt does not include
+// removed duplicates
+
+int         kwp_next_batch     (kwp_ctx_t *ctx, char *buf, const int max_bytes, uint64_t *cnt);
+
+// writes up to limit candidates to fp (NULL discards them) using the configured threads and output backend
+
+void        kwp_run            (kwp_ctx_t *ctx, FILE *fp, const uint64_t limit);
+
+// --crack, loads a list of hex hashes of type HASH_*. kwp_run() then hashes every candidate in the generating threads
+// and writes hash:plain to fp for each hash cracked, instead of the candidates. returns the number of hashes loaded,
+// -1 on error with the reason on stderr
+
+int         kwp_crack          (kwp_ctx_t *ctx, const int hash, const char *file);
+
+// -r, loads a file of hashcat rules. every walk is then written once per rule by kwp_run() and kwp_next_batch(),
+// positions, kwp_seek(), limits and the keyspace still count walks. returns the number of rules loaded, -1 on error
+// with the reason on stderr
+
+int         kwp_rules          (kwp_ctx_t *ctx, const char *file);
+
+// writes name and a tab in front of every candidate of kwp_run(), kwp_next_batch() and kwp_combinator(), NULL removes
+// it. unique and kwp_crack() ignore the tag, -1 if it is too long or can not be written in the encoding
+
+int         kwp_set_tag        (kwp_ctx_t *ctx, const char *name);
+
+// --combinator, writes every walk of ctx joined with every walk of right, through each character of sep if it is set.
+// length_max caps the joined walks in characters, 0 is no limit. the side with fewer walks is generated into memory
+// first and joined to each walk of the other while that one is generated, so the output runs over the larger side.
+// unique, rules and kwp_crack() of ctx apply to the joined candidates, limit and kwp_stats() count them
+
+int         kwp_combinator     (kwp_ctx_t *ctx, kwp_ctx_t *right, const char *sep, const int length_max, FILE *fp, const uint64_t limit);
+
+void        kwp_stats          (const kwp_ctx_t *ctx, kwp_stats_t *stats);
+
+// fills kwp_routes_cnt() entries, the emitted part stays zero without conf.route_stats
+
+void        kwp_route_stats    (const kwp_ctx_t *ctx, kwp_route_stats_t *stats_buf);
+
+// --match, writes every line of file ("-" for stdin) that is a walk of ctx as route, basechar, directions and the line,
+// tab separated and in input order. conf.threads blocks of the file are matched at once
+
+int         kwp_match          (const kwp_ctx_t *ctx, const char *file, FILE *fp, uint64_t *words, uint64_t *matched);
+
+#endif // _KWP_H
@@ -0,0 +1,7422 @@
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <locale.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#include "kwp.h"
+
+/**
+ * Name........: keyboard-walk-processor (kwp)
+ * Description.: Advanced keyboard-walk generator with configureable basechars, keymap and routes
+ * Autor.......: Jens Steube <jens.steube@gmail.com>
+ * License.....: MIT
+ */
+
+#define DIST_CNT              16
+#define MOD_CNT               3
+#define DIR_CNT               9
+
+#define KEYMAP_WIDTH_MAX      64          // a row of a block is a single u64 of the bitboards
+#define KEYMAP_HEIGHT_MAX     16
+#define KEYMAP_BLOCKS_MAX     8
+#define KEYMAP_LEGACY_ROWS    4           // a keymap without blocks is one block of 4 rows
+
+#define RC_OK                 0
+#define RC_INVALID            -1
+#define RC_LIMIT              1
+
+#define ROUTE_LENGTH_MIN      1
+#define ROUTE_LENGTH_MAX      32
+
+#define ROUTE_REPEAT_MIN      1
+#define ROUTE_REPEAT_MAX      16
+
+#define PW_MAX                (1 + (ROUTE_LENGTH_MAX * ROUTE_REPEAT_MAX))
+
+#define BASECHARS_MAX         1024
+
+#define KEYS_MAX              512
+#define KEYSET_WORDS          ((KEYS_MAX + 63) / 64)
+
+#define KEYS_HASH_BITS        11
+#define KEYS_HASH_SIZE        (1 << KEYS_HASH_BITS)
+
+#define OUT_BUF_SIZE          BUFSIZ
+#define OUT_CHUNK_SIZE        (1 << 20)
+
+#define WRITER_BUFS           4
+#define RESTORE_VERSION       1
+#define CACHE_VERSION         3
+#define CACHE_ALIGN           64
+#define CACHE_SECTIONS        13
+#define CACHE_CONF            17
+#define CACHE_LOCALE          64
+#define ROUTES_ALLOC          1024
+#define WRITE_BUFFER_MIN      1
+#define WRITE_BUFFER_MAX      64
+#define UNIQUE_MEMORY_MIN     1
+#define UNIQUE_MEMORY_MAX     65536
+#define UNIQUE_GROUP          16
+#define UNIQUE_TABLE_MIN      (1 << 16)
+#define UNIQUE_ARENA_MIN      (1 << 20)
+#define BLOOM_BLOCK_WORDS     8
+#define BLOOM_PROBES          7
+#define CRACK_TABLE_MIN       (1 << 10)
+#define RULE_OPS_MAX          31
+#define RULE_PW_MAX           (PW_MAX * ENC_MAX)
+#define COMBINATOR_BATCH      (1 << 20)
+#define COMBINATOR_SEPS_MAX   64
+#define TAG_MAX               64
+#define ENC_MAX               4
+
+#define SEG_COPY              16
+
+#define OUT_RESERVE           (((PW_MAX + 1) * ENC_MAX) + SEG_COPY + TAG_MAX)
+
+#if (OUT_RESERVE * 2) > KWP_BATCH_MIN
+#error "KWP_BATCH_MIN must leave room for the reserve of out_push()"
+#endif
+
+#if KWP_ROUTE_STR_SIZE != (ROUTE_LENGTH_MAX + 1)
+#error "KWP_ROUTE_STR_SIZE does not match ROUTE_LENGTH_MAX"
+#endif
+
+#define PIPE_SIZE             (1 << 20)
+
+#define MATCH_BLOCK           (1 << 20)
+#define MATCH_HASH_BITS       11
+#define MATCH_HASH_SIZE       (1 << MATCH_HASH_BITS)
+#define MATCH_TOKEN_SIZE      16
+
+#define THREADS_MAX           256
+#define JOBS_PER_THREAD       16
+#define POOL_BYTES_MAX        (256 << 20)
+
+#define USER_MOD_BASIC        1
+#define USER_MOD_SHIFT        0
+#define USER_MOD_ALTGR        0
+
+#define USER_DIR_SOUTH_WEST   0
+#define USER_DIR_SOUTH        1
+#define USER_DIR_SOUTH_EAST   0
+#define USER_DIR_WEST         1
+#define USER_DIR_REPEAT       0
+#define USER_DIR_EAST         1
+#define USER_DIR_NORTH_WEST   0
+#define USER_DIR_NORTH        1
+#define USER_DIR_NORTH_EAST   0
+
+#define USER_DIST_MIN         1
+#define USER_DIST_MAX         1
+
+#define THREADS               1
+#define UNORDERED             0
+#define ENCODING              ENCODING_LOCALE
+#define ROUTE_ORDER           0
+#define WRITE_BUFFER          4
+#define OUTPUT_BACKEND        BACKEND_AUTO
+#define UNIQUE                UNIQUE_NONE
+#define UNIQUE_MEMORY         256
+#define ROUTE_STATS           0
+#define POLICY_LENGTH_MIN     0
+#define POLICY_LENGTH_MAX     0
+#define POLICY_CLASSES        0
+#define POLICY_KEYBOARDS      0
+#define POLICY_RUN_MAX        0
+
+#define POLICY_CHARS          (POLICY_LOWER | POLICY_UPPER | POLICY_DIGIT | POLICY_SPECIAL)
+#define POLICY_MODS           (POLICY_BASIC | POLICY_SHIFT | POLICY_ALTGR)
+#define POLICY_MASKS          ((POLICY_CHARS | POLICY_MODS) + 1)
+
+// types
+
+typedef uint8_t  u8;
+typedef uint64_t u64;
+
+struct pool;
+
+// candidates that reached the output, kwp_pos() reads it while the run is going on
+
+typedef struct
+{
+  pthread_mutex_t mux;
+  u64             cnt;
+
+} progress_t;
+
+// ring of large buffers drained by an i/o thread, the generator fills one while the others are written
+
+typedef struct
+{
+  FILE           *fp;
+  int             backend;
+
+  pthread_t       thread;
+  pthread_mutex_t mux;
+  pthread_cond_t  cond;
+
+  char           *bufs_buf[WRITER_BUFS];
+  int             lens_buf[WRITER_BUFS];   // bytes queued in a buffer, 0 if it is free
+  u64             cnts_buf[WRITER_BUFS];   // candidates in a queued buffer
+  int             maps_buf[WRITER_BUFS];   // buffer is mmap'ed pages for vmsplice
+  int             size;
+
+  int             fill;                    // buffer owned by the generator
+  int             drain;                   // next buffer the i/o thread writes
+  int             done;
+
+  progress_t     *progress;
+
+} writer_t;
+
+// duplicates across routes, the first occurrence in output order is kept. the exact set stores every encoded
+// candidate once, the bloom filter has a fixed size and might take a few unique candidates for duplicates
+
+typedef struct
+{
+  pthread_mutex_t mux;
+
+  int   type;
+  u64   dups;
+
+  char  eol_enc[ENC_MAX];
+  int   eol_enc_len;
+
+  u64  *table_buf;    // [table_mask + 1][2] -> hash and offset into arena_buf + 1, offset 0 marks a free slot
+  u64   table_mask;
+  u64   table_cnt;
+
+  char *arena_buf;    // u16 length followed by the candidate bytes
+  u64   arena_len;
+  u64   arena_size;
+
+  u64  *bloom_buf;    // [bloom_blocks][BLOOM_BLOCK_WORDS], all probes of a candidate hit one cache line
+  u64   bloom_blocks;
+
+  int   full;         // the exact set could not grow, candidates not in it yet pass without being added
+
+} unique_t;
+
+// --crack, the loaded hashes by the first 8 bytes of their digest. the bitmap has a bit per table slot times 8 and
+// answers most misses from the cache. a hash is written once, the first time a candidate cracks it
+
+typedef struct
+{
+  pthread_mutex_t mux;
+
+  int   type;         // HASH_*
+  int   digest_len;
+  int   encoding;
+
+  char  eol_enc[ENC_MAX];
+  int   eol_enc_len;
+
+  u8   *digests_buf;  // [digests_cnt][digest_len]
+  u8   *found_buf;    // [digests_cnt]
+  int   digests_cnt;
+
+  int  *table_buf;    // [table_mask + 1] -> index into digests_buf, RC_INVALID marks a free slot
+  u64   table_mask;
+
+  u64  *bitmap_buf;
+  u64   bitmap_mask;
+
+  FILE *fp;           // hash:plain lines of kwp_run()
+  u64   cracked;
+
+} crack_t;
+
+// -r, every walk is written once per rule instead of as it is
+
+typedef struct
+{
+  u8 op;        // function character
+  u8 a;         // first position or character
+  u8 b;         // second position or character
+
+} rule_op_t;
+
+typedef struct
+{
+  rule_op_t *ops_buf;   // [rules_cnt][RULE_OPS_MAX]
+  int       *ops_cnt;   // [rules_cnt]
+  int        rules_cnt;
+
+  char       eol_enc[ENC_MAX];
+  int        eol_enc_len;
+
+} rules_t;
+
+// --combinator, the smaller side packed one walk after the other as u16 bytes, u16 characters and the bytes
+
+typedef struct
+{
+  char *buf;
+  u64   len;
+  u64   size;
+  u64   cnt;
+
+} arena_t;
+
+// password policy, the classes of a candidate are the POLICY_* bits of its keys. a key has one character class and
+// the bit of the keymap it was found on. a run is a sequence of the same key
+
+typedef struct
+{
+  u8 classes;     // of all keys of the segment
+  u8 same;        // every key equals the key the segment starts from
+  u8 head;        // keys at the front that equal the key the segment starts from
+  u8 tail;        // keys at the end that equal each other
+  u8 run;         // longest run inside the segment
+
+} policy_seg_t;
+
+typedef struct policy
+{
+  int           run_max;                    // 0 for no limit
+
+  u8            missing_buf[POLICY_MASKS];  // classes -> keys it takes at least to add the required classes
+  u8            keys_class[KEYS_MAX];
+  u8            basechars_class[BASECHARS_MAX];
+
+  policy_seg_t *segs_buf;                   // [keys_cnt][sel_cnt][segs_repeat]
+  int          *reach_buf;                  // [nodes_cnt] most keys that can still follow a trie node
+
+} policy_t;
+
+typedef struct
+{
+  FILE *fp;
+
+  char *buf;
+  int   len;
+  int   size;
+
+  // set for workers in ordered threaded mode, out_flush() then hands the buffer to the merge stage
+
+  struct pool *pool;
+  u64          job_pos;
+
+  // set in single-threaded mode, out_flush() then queues the buffer and continues in the next one of the ring
+
+  writer_t    *writer;
+
+  // set when generating for kwp_next_batch(), out_flush() then hands the buffer back to the caller. a stopped batch
+  // zeroes the budget of the generator through left
+
+  struct batch *batch;
+  u64          *left;
+
+  // kwp_stop() sets stop, the next out_flush() then zeroes the budget the same way
+
+  const volatile sig_atomic_t *stop;
+
+  // out_flush() drops duplicates through unique, except for workers of an ordered pool which leave it to the merge
+  // stage
+
+  unique_t    *unique;
+  u64          dups;
+
+  // candidates that break the policy are counted as generated but never written
+
+  const policy_t *policy;
+  u64          rejected;
+
+  // candidates are hashed against crack before out_flush() hands them on, the run then discards them
+
+  crack_t     *crack;
+
+  // out_push() replaces each walk by its results of the rules, cnt still counts walks
+
+  const rules_t *rules;
+
+  // out_push() puts tag in front of each candidate, duplicates and hashes are checked without it
+
+  const char  *tag_enc;
+  int          tag_len;
+
+  // per-route totals for kwp_route_stats(), NULL unless they are collected
+
+  kwp_route_stats_t *route_stats;
+
+  // totals for --benchmark, a NULL fp discards the bytes
+
+  u64          cnt;         // candidates generated, duplicates included
+  u64          bytes;
+  u64          flushed;     // candidates handed on by out_flush()
+  u64          generated;   // bytes handed to out_flush(), duplicates included
+
+} out_t;
+
+typedef struct
+{
+  int x;
+  int y;
+  int block;
+
+} co_t;
+
+// a keymap is a list of independent blocks, like the main keys and the numpad. walks never leave their block
+
+typedef struct
+{
+  int     rows;
+  wchar_t keys[MOD_CNT][KEYMAP_HEIGHT_MAX][KEYMAP_WIDTH_MAX];   // RC_INVALID where there is no key
+
+} block_t;
+
+typedef struct
+{
+  block_t blocks_buf[KEYMAP_BLOCKS_MAX];
+  int     blocks_cnt;
+
+} keymap_t;
+
+typedef struct
+{
+  int repeat[ROUTE_LENGTH_MAX];
+  int changes;
+
+} route_t;
+
+typedef struct
+{
+  u64 bits[KEYSET_WORDS];
+
+} keyset_t;
+
+typedef struct
+{
+  int repeat;         // repeat of the direction change leading into the node, 0 for the root
+  int routes;         // routes ending here, a route listed twice emits its candidates twice
+  int child;          // first child, RC_INVALID if none
+  int sibling;        // next child of the same parent, RC_INVALID if none
+
+} node_t;
+
+typedef struct
+{
+  node_t *nodes_buf;
+  int     nodes_cnt;
+
+  int    *leaf_buf;     // [routes_cnt] node each route ends at
+
+} trie_t;
+
+
+typedef struct
+{
+  // dense index of all characters on the keymap, the walk works on these ids only
+
+  int      keys_cnt;
+  wchar_t  keys_buf[KEYS_MAX];
+  co_t     keys_co[KEYS_MAX];
+  int      keys_level[KEYS_MAX];   // keymap the key was found on first: 0 basic, 1 shift, 2 altgr
+  int      keys_twin[KEYS_MAX];    // key of the same character on a later block, RC_INVALID if none
+  int      keys_hash[KEYS_HASH_SIZE]; // open addressing character -> id on the first block, RC_INVALID marks a free slot
+
+  // output bytes of every key, candidates are assembled by copying ENC_MAX bytes and advancing by the length
+
+  int      encoding;
+  char     keys_enc[KEYS_MAX][ENC_MAX];
+  int      keys_enc_len[KEYS_MAX];  // RC_INVALID if the key can not be written in the encoding, it is never walked onto
+  char     eol_enc[ENC_MAX];
+  int      eol_enc_len;
+
+  int      sel_cnt;
+  int     *next_buf;      // [keys_cnt][sel_cnt] -> id of the neighbour key, RC_INVALID if off the keymap
+  int     *ends_buf;      // [ROUTE_REPEAT_MAX][keys_cnt][sel_cnt] -> id after repeating a selection, RC_INVALID if off the keymap
+
+  // a route segment repeats one selection, so the bytes of any repeat are a prefix of the longest straight run
+
+  int      segs_repeat;   // longest repeat used by the loaded routes
+  int      segs_size;     // segs_repeat * ENC_MAX rounded up to SEG_COPY, runs are copied in SEG_COPY blocks
+  char    *segs_buf;      // [keys_cnt][sel_cnt][segs_size] -> bytes of the straight run starting after the key
+  u8      *segs_len;      // [keys_cnt][sel_cnt][segs_repeat] -> length of the run after 1 .. segs_repeat steps
+
+  int     *steps_cnt;     // [segs_repeat][keys_cnt] -> number of selections that stay on the keymap
+  int     *steps_sel;     // [segs_repeat][keys_cnt][sel_cnt] -> those selections, ascending
+
+  int      basechars_cnt;
+  int     *basechars_ids;
+  char   (*basechars_enc)[ENC_MAX];
+  int     *basechars_enc_len;
+
+} walk_t;
+
+typedef struct
+{
+  int routes_pos;
+  int sel_buf[ROUTE_LENGTH_MAX];
+  int basechar_pos;
+
+  int part;           // trie order only, see process_trie_part()
+
+  u64 route_offset;   // route order only, index of the position inside its route
+
+  u64 part_offset;    // index of the position inside its part, see process_route_part() and process_trie_part()
+
+} pos_t;
+
+typedef struct
+{
+  int  changes;
+  u64  cnt;
+
+  u64 *ways_buf;      // [changes][keys_cnt][sel_cnt] ways to stand on a key in front of a direction change, by last selection
+  u64 *sums_buf;      // [changes][keys_cnt] same, summed over the last selection
+
+} count_t;
+
+typedef struct
+{
+  int *children_buf;  // [children_cnt] root children in sibling order
+  u64 *parts_buf;     // [children_cnt][keys_cnt][sel_cnt] size of a part by its root child and the key and selection it enters it with
+
+} trie_count_t;
+
+typedef struct
+{
+  const walk_t  *walk;
+  const route_t *route_buf;
+  out_t         *out;
+
+  int   sel_buf[ROUTE_LENGTH_MAX];
+
+  // generation starts at resume_pos, the flag is cleared once the first candidate is reached
+
+  int   resume;
+  pos_t resume_pos;
+
+  u64   left;         // candidates still to emit
+  u64   skip;         // trie order, candidates to walk without writing them before the resume position
+
+} gen_t;
+
+typedef struct chunk
+{
+  struct chunk *next;
+
+  int  len;
+  u64  cnt;
+  char buf[];
+
+} chunk_t;
+
+typedef struct
+{
+  int      routes_pos;
+  int      sel;
+  int      resume;
+  pos_t    resume_pos;
+  u64      left;
+
+  int      done;
+
+  chunk_t *chunks_head;
+  chunk_t *chunks_tail;
+
+} job_t;
+
+typedef struct pool
+{
+  pthread_mutex_t mux;
+  pthread_cond_t  cond;
+
+  const walk_t   *walk;
+  const route_t  *routes_buf;
+  int             routes_cnt;
+  const trie_t   *trie;
+
+  FILE           *fp;
+  int             ordered;
+
+  // jobs are (route, last direction change) pairs, handed out in the same order the single-threaded loop visits them.
+  // with a trie the cursor runs over (basechar, part) instead, see process_trie_part()
+
+  int             cursor_route;
+  int             cursor_sel;
+  count_t         cursor_count;
+  trie_count_t    cursor_trie_count;  // with a trie, instead of cursor_count
+
+  int             resume;
+  pos_t           resume_pos;
+
+  u64             left;
+  int             exhausted;
+
+  u64             jobs_next;
+  u64             jobs_write;
+
+  job_t          *jobs_buf;
+  int             jobs_window;
+
+  size_t          bytes_buffered;
+
+  u64             cnt;
+  u64             bytes;
+
+  // once stop is set no job is started anymore and the merge stage stops writing at the next chunk, so the output
+  // always ends at a known position
+
+  const volatile sig_atomic_t *stop;
+  int             stopped;
+
+  progress_t     *progress;
+
+  unique_t       *unique;
+  u64             dropped;    // bytes of the duplicates the merge stage removed
+
+  const policy_t *policy;
+  u64             rejected;
+
+  crack_t        *crack;
+  const rules_t  *rules;
+
+  const char     *tag_enc;
+  int             tag_len;
+
+  kwp_route_stats_t *route_stats;
+
+} pool_t;
+
+// whole input file in memory, mapped if possible. the parsers walk it once, line by line
+
+typedef struct
+{
+  char   *buf;
+  size_t  len;
+  size_t  pos;
+  int     mapped;   // buf is a mapping, otherwise it was read into the heap
+
+} map_t;
+
+// header of a --compile file. the tables follow as sections aligned to CACHE_ALIGN, pointers inside the walk_t image
+// are set up again when it is loaded
+
+typedef struct
+{
+  char magic[8];
+  int  version;
+  int  endian;
+  int  sizes_buf[6];              // wchar_t, int, pointer, walk_t, route_t, node_t
+  int  conf_buf[CACHE_CONF];      // options the tables were built with, see cache_conf()
+  char locale[CACHE_LOCALE];      // LC_CTYPE the keys were encoded in, checked for ENCODING_LOCALE only
+
+  int  basechars_cnt;
+  int  routes_cnt;
+  int  nodes_cnt;
+
+  u64  hash;
+  u64  size;                      // whole file
+
+  u64  walk_offset;
+  u64  offsets_buf[CACHE_SECTIONS];
+
+} cache_head_t;
+
+// functions
+
+static int map_open (map_t *map, const char *file)
+{
+  memset (map, 0, sizeof (map_t));
+
+  #ifdef __linux__
+  const int fd = open (file, O_RDONLY);
+
+  if (fd == -1) return RC_INVALID;
+
+  struct stat st;
+
+  if ((fstat (fd, &st) == 0) && (S_ISREG (st.st_mode)) && (st.st_size > 0))
+  {
+    void *buf = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (buf != MAP_FAILED)
+    {
+      close (fd);
+
+      map->buf    = (char *) buf;
+      map->len    = st.st_size;
+      map->mapped = 1;
+
+      return RC_OK;
+    }
+  }
+
+  close (fd);
+  #endif
+
+  // pipes and other systems are read into the heap
+
+  FILE *fp = fopen (file, "rb");
+
+  if (fp == NULL) return RC_INVALID;
+
+  size_t size = BUFSIZ;
+
+  map->buf = (char *) malloc (size);
+
+  size_t nread;
+
+  while ((nread = fread (map->buf + map->len, 1, size - map->len, fp)) > 0)
+  {
+    map->len += nread;
+
+    if (map->len < size) continue;
+
+    size *= 2;
+
+    map->buf = (char *) realloc (map->buf, size);
+  }
+
+  fclose (fp);
+
+  return RC_OK;
+}
+
+static void map_close (map_t *map)
+{
+  #ifdef __linux__
+  if (map->mapped)
+  {
+    munmap (map->buf, map->len);
+  }
+  else
+  #endif
+  {
+    free (map->buf);
+  }
+
+  memset (map, 0, sizeof (map_t));
+}
+
+// same count as reading line by line, a last line without newline counts as well
+
+static int map_lines (const map_t *map)
+{
+  int cnt = 0;
+
+  const char *ptr = map->buf;
+  const char *end = map->buf + map->len;
+
+  while ((ptr = (const char *) memchr (ptr, '\n', end - ptr)) != NULL)
+  {
+    ptr++;
+
+    cnt++;
+  }
+
+  if ((map->len) && (map->buf[map->len - 1] != '\n')) cnt++;
+
+  return cnt;
+}
+
+static int hex_convert (const wchar_t c)
+{
+  return (c & 15) + (c >> 6) * 9;
+}
+
+static void pool_push (pool_t *pool, const u64 job_pos, const char *buf, const int len, const u64 cnt);
+
+static void batch_swap (struct batch *batch, out_t *out);
+
+static double timer_ms (const struct timespec *start, const struct timespec *stop)
+{
+  return ((double) (stop->tv_sec - start->tv_sec) * 1000) + ((double) (stop->tv_nsec - start->tv_nsec) / 1000000);
+}
+
+static out_t *out_init (FILE *fp, const int size)
+{
+  out_t *out = (out_t *) malloc (sizeof (out_t));
+
+  out->fp      = fp;
+  out->buf     = (char *) malloc (size);
+  out->len     = 0;
+  out->size    = size;
+  out->pool    = NULL;
+  out->job_pos = 0;
+  out->writer  = NULL;
+  out->batch   = NULL;
+  out->left    = NULL;
+  out->stop    = NULL;
+  out->unique      = NULL;
+  out->dups        = 0;
+  out->policy      = NULL;
+  out->rejected    = 0;
+  out->crack       = NULL;
+  out->rules       = NULL;
+  out->tag_enc     = NULL;
+  out->tag_len     = 0;
+  out->route_stats = NULL;
+  out->cnt         = 0;
+  out->bytes       = 0;
+  out->flushed     = 0;
+  out->generated   = 0;
+
+  return out;
+}
+
+static void out_free (out_t *out)
+{
+  if (out->writer == NULL) free (out->buf);
+
+  free (out);
+}
+
+static const char *backend_names[] = { "auto", "fwrite", "vmsplice", "discard" };
+
+int kwp_parse_backend (const char *name)
+{
+  if (strcmp (name, "auto")     == 0) return BACKEND_AUTO;
+  if (strcmp (name, "fwrite")   == 0) return BACKEND_FWRITE;
+  if (strcmp (name, "vmsplice") == 0) return BACKEND_VMSPLICE;
+
+  return RC_INVALID;
+}
+
+// vmsplice() needs page-aligned buffers that are never touched again once they are in the pipe, the reader
+// might splice the pages on instead of copying them. every buffer is gifted and replaced by fresh pages
+
+static void writer_alloc (writer_t *writer, const int i)
+{
+  #ifdef __linux__
+  if (writer->backend == BACKEND_VMSPLICE)
+  {
+    void *buf = mmap (NULL, writer->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if (buf != MAP_FAILED)
+    {
+      writer->bufs_buf[i] = (char *) buf;
+      writer->maps_buf[i] = 1;
+
+      return;
+    }
+
+    // out of fresh pages, plain buffers and fwrite from here on
+
+    writer->backend = BACKEND_FWRITE;
+  }
+  #endif
+
+  writer->bufs_buf[i] = (char *) malloc (writer->size);
+  writer->maps_buf[i] = 0;
+}
+
+static void writer_release (writer_t *writer, const int i)
+{
+  #ifdef __linux__
+  if (writer->maps_buf[i])
+  {
+    munmap (writer->bufs_buf[i], writer->size);
+
+    return;
+  }
+  #endif
+
+  free (writer->bufs_buf[i]);
+}
+
+// picks the backend for the output stream, vmsplice is only used for pipes and falls back to fwrite
+
+static int writer_backend (FILE *fp, const int backend)
+{
+  if (fp == NULL) return BACKEND_DISCARD;
+
+  if (backend == BACKEND_FWRITE) return BACKEND_FWRITE;
+
+  #ifdef __linux__
+  struct stat st;
+
+  if (fstat (fileno (fp), &st) == -1) return BACKEND_FWRITE;
+
+  if (S_ISFIFO (st.st_mode) == 0) return BACKEND_FWRITE;
+
+  // a larger pipe means fewer wakeups of the reader, it is fine if the limit does not allow it
+
+  fcntl (fileno (fp), F_SETPIPE_SZ, PIPE_SIZE);
+
+  return BACKEND_VMSPLICE;
+  #else
+  return BACKEND_FWRITE;
+  #endif
+}
+
+// writes one buffer, returns the number of bytes that went out. a short count means the backend failed and the
+// caller continues the remainder with fwrite
+
+static int writer_write (writer_t *writer, const char *buf, const int len)
+{
+  #ifdef __linux__
+  if (writer->backend == BACKEND_VMSPLICE)
+  {
+    const int fd = fileno (writer->fp);
+
+    struct iovec iov;
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len  = len;
+
+    while (iov.iov_len)
+    {
+      const ssize_t rc = vmsplice (fd, &iov, 1, SPLICE_F_GIFT);
+
+      if (rc == -1)
+      {
+        if (errno == EINTR) continue;
+
+        break;
+      }
+
+      iov.iov_base  = (char *) iov.iov_base + rc;
+      iov.iov_len  -= rc;
+    }
+
+    return len - (int) iov.iov_len;
+  }
+  #endif
+
+  if (writer->backend == BACKEND_FWRITE) fwrite (buf, 1, len, writer->fp);
+
+  return len;
+}
+
+static void *writer_thread (void *p)
+{
+  writer_t *writer = (writer_t *) p;
+
+  pthread_mutex_lock (&writer->mux);
+
+  while (1)
+  {
+    const int len = writer->lens_buf[writer->drain];
+
+    if (len == 0)
+    {
+      if (writer->done) break;
+
+      pthread_cond_wait (&writer->cond, &writer->mux);
+
+      continue;
+    }
+
+    pthread_mutex_unlock (&writer->mux);
+
+    const char *buf = writer->bufs_buf[writer->drain];
+
+    const int sent = writer_write (writer, buf, len);
+
+    if (sent < len)
+    {
+      // the pipe went away or rejected the pages, stdio reports or raises the error from here on
+
+      fwrite (buf + sent, 1, len - sent, writer->fp);
+    }
+
+    if (writer->backend == BACKEND_VMSPLICE)
+    {
+      // the pages now belong to the pipe, continue in fresh ones. unmapping only drops our reference
+
+      if (sent < len) writer->backend = BACKEND_FWRITE;
+
+      writer_release (writer, writer->drain);
+
+      writer_alloc (writer, writer->drain);
+    }
+
+    if (writer->progress)
+    {
+      pthread_mutex_lock (&writer->progress->mux);
+
+      writer->progress->cnt += writer->cnts_buf[writer->drain];
+
+      pthread_mutex_unlock (&writer->progress->mux);
+    }
+
+    pthread_mutex_lock (&writer->mux);
+
+    writer->lens_buf[writer->drain] = 0;
+
+    writer->drain = (writer->drain + 1) % WRITER_BUFS;
+
+    pthread_cond_broadcast (&writer->cond);
+  }
+
+  pthread_mutex_unlock (&writer->mux);
+
+  return NULL;
+}
+
+static writer_t *writer_init (FILE *fp, const int size, const int backend, progress_t *progress)
+{
+  writer_t *writer = (writer_t *) malloc (sizeof (writer_t));
+
+  writer->fp       = fp;
+  writer->backend  = writer_backend (fp, backend);
+  writer->size     = size;
+  writer->fill     = 0;
+  writer->drain    = 0;
+  writer->done     = 0;
+  writer->progress = progress;
+
+  for (int i = 0; i < WRITER_BUFS; i++)
+  {
+    writer_alloc (writer, i);
+
+    writer->lens_buf[i] = 0;
+  }
+
+  pthread_mutex_init (&writer->mux, NULL);
+  pthread_cond_init  (&writer->cond, NULL);
+
+  pthread_create (&writer->thread, NULL, writer_thread, writer);
+
+  return writer;
+}
+
+// queues the filled buffer and returns the next one, waits while the i/o thread still has that one queued
+
+static char *writer_swap (writer_t *writer, const int len, const u64 cnt)
+{
+  pthread_mutex_lock (&writer->mux);
+
+  if (len == 0)
+  {
+    // only duplicates, the count still has to reach progress behind the buffers that are queued
+
+    while (writer->lens_buf[writer->drain]) pthread_cond_wait (&writer->cond, &writer->mux);
+
+    pthread_mutex_unlock (&writer->mux);
+
+    if (writer->progress)
+    {
+      pthread_mutex_lock (&writer->progress->mux);
+
+      writer->progress->cnt += cnt;
+
+      pthread_mutex_unlock (&writer->progress->mux);
+    }
+
+    return writer->bufs_buf[writer->fill];
+  }
+
+  writer->lens_buf[writer->fill] = len;
+  writer->cnts_buf[writer->fill] = cnt;
+
+  writer->fill = (writer->fill + 1) % WRITER_BUFS;
+
+  pthread_cond_broadcast (&writer->cond);
+
+  while (writer->lens_buf[writer->fill]) pthread_cond_wait (&writer->cond, &writer->mux);
+
+  pthread_mutex_unlock (&writer->mux);
+
+  return writer->bufs_buf[writer->fill];
+}
+
+static void writer_free (writer_t *writer)
+{
+  pthread_mutex_lock (&writer->mux);
+
+  writer->done = 1;
+
+  pthread_cond_broadcast (&writer->cond);
+
+  pthread_mutex_unlock (&writer->mux);
+
+  pthread_join (writer->thread, NULL);
+
+  pthread_cond_destroy  (&writer->cond);
+  pthread_mutex_destroy (&writer->mux);
+
+  for (int i = 0; i < WRITER_BUFS; i++) writer_release (writer, i);
+
+  free (writer);
+}
+
+// letters of the classes a policy requires, RC_INVALID for any other letter
+
+static int parse_letters (const char *str, const char *letters, const int *bits)
+{
+  int mask = 0;
+
+  for (const char *ptr = str; *ptr; ptr++)
+  {
+    const char *pos = strchr (letters, *ptr);
+
+    if (pos == NULL) return RC_INVALID;
+
+    mask |= bits[pos - letters];
+  }
+
+  return mask;
+}
+
+int kwp_parse_classes (const char *str)
+{
+  static const int bits[] = { POLICY_LOWER, POLICY_UPPER, POLICY_DIGIT, POLICY_SPECIAL };
+
+  return parse_letters (str, "luds", bits);
+}
+
+int kwp_parse_keyboard (const char *str)
+{
+  static const int bits[] = { POLICY_BASIC, POLICY_SHIFT, POLICY_ALTGR };
+
+  return parse_letters (str, "bsa", bits);
+}
+
+int kwp_parse_unique (const char *name)
+{
+  if (strcmp (name, "none")  == 0) return UNIQUE_NONE;
+  if (strcmp (name, "exact") == 0) return UNIQUE_EXACT;
+  if (strcmp (name, "bloom") == 0) return UNIQUE_BLOOM;
+
+  return RC_INVALID;
+}
+
+int kwp_parse_hash (const char *name)
+{
+  if (strcmp (name, "md5")  == 0) return HASH_MD5;
+  if (strcmp (name, "sha1") == 0) return HASH_SHA1;
+  if (strcmp (name, "ntlm") == 0) return HASH_NTLM;
+
+  return RC_INVALID;
+}
+
+static u64 mix_u64 (u64 h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static u64 hash_candidate (const char *buf, const int len)
+{
+  u64 h = 0x9e3779b97f4a7c15ULL ^ (u64) len;
+
+  for (int i = 0; i < len; i += 8)
+  {
+    u64 w = 0;
+
+    memcpy (&w, buf + i, ((len - i) < 8) ? (len - i) : 8);
+
+    h = (h ^ w) * 0x9fb21c651e98df25ULL;
+
+    h ^= h >> 29;
+  }
+
+  return mix_u64 (h);
+}
+
+// the table and the filter are hit at random, huge pages save most of the tlb misses. the memory comes zeroed
+
+static u64 *unique_alloc (const u64 size)
+{
+  #ifdef __linux__
+  void *buf = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (buf == MAP_FAILED) return NULL;
+
+  madvise (buf, size, MADV_HUGEPAGE);
+
+  return (u64 *) buf;
+  #else
+  return (u64 *) calloc (size, 1);
+  #endif
+}
+
+static void unique_release (u64 *buf, const u64 size)
+{
+  if (buf == NULL) return;
+
+  #ifdef __linux__
+  munmap (buf, size);
+  #else
+  free (buf);
+  (void) size;
+  #endif
+}
+
+static void unique_free (unique_t *unique)
+{
+  if (unique == NULL) return;
+
+  pthread_mutex_destroy (&unique->mux);
+
+  unique_release (unique->table_buf, (unique->table_mask + 1) * 2 * sizeof (u64));
+  unique_release (unique->bloom_buf, unique->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof (u64));
+
+  free (unique->arena_buf);
+  free (unique);
+}
+
+static unique_t *unique_init (const int type, const int memory, const walk_t *walk)
+{
+  unique_t *unique = (unique_t *) calloc (1, sizeof (unique_t));
+
+  unique->type = type;
+
+  memcpy (unique->eol_enc, walk->eol_enc, ENC_MAX);
+
+  unique->eol_enc_len = walk->eol_enc_len;
+
+  u64 size = 0;
+
+  if (type == UNIQUE_EXACT)
+  {
+    size = UNIQUE_TABLE_MIN * 2 * sizeof (u64);
+
+    unique->table_mask = UNIQUE_TABLE_MIN - 1;
+    unique->table_buf  = unique_alloc (size);
+    unique->arena_size = UNIQUE_ARENA_MIN;
+    unique->arena_buf  = (char *) malloc (UNIQUE_ARENA_MIN);
+  }
+  else
+  {
+    // untouched pages are not backed yet, a large filter only costs what the run actually sets
+
+    size = (u64) memory << 20;
+
+    unique->bloom_blocks = size / (BLOOM_BLOCK_WORDS * sizeof (u64));
+    unique->bloom_buf    = unique_alloc (unique->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof (u64));
+  }
+
+  pthread_mutex_init (&unique->mux, NULL);
+
+  const int failed = (type == UNIQUE_EXACT) ? ((unique->table_buf == NULL) || (unique->arena_buf == NULL)) : (unique->bloom_buf == NULL);
+
+  if (failed)
+  {
+    fprintf (stderr, "Unique: cannot allocate %llu MB\n", (unsigned long long) ((size + (1 << 20) - 1) >> 20));
+
+    unique_free (unique);
+
+    return NULL;
+  }
+
+  return unique;
+}
+
+// the slot holding the candidate, or the free slot it goes into. the full hash is kept so that growing the table
+// never has to look at the candidates again
+
+static u64 *unique_slot (const unique_t *unique, const char *buf, const int len, const u64 hash)
+{
+  for (u64 slot = hash & unique->table_mask;; slot = (slot + 1) & unique->table_mask)
+  {
+    u64 *entry = unique->table_buf + (slot * 2);
+
+    if (entry[1] == 0) return entry;
+
+    if (entry[0] != hash) continue;
+
+    const char *rec = unique->arena_buf + entry[1] - 1;
+
+    uint16_t rec_len;
+
+    memcpy (&rec_len, rec, sizeof (rec_len));
+
+    if ((rec_len == len) && (memcmp (rec + sizeof (rec_len), buf, len) == 0)) return entry;
+  }
+}
+
+// without the memory to grow the old table stays, it is only half full so lookups still end
+
+static int unique_grow (unique_t *unique)
+{
+  u64       *old_buf = unique->table_buf;
+  const u64  old_cnt = unique->table_mask + 1;
+
+  u64 *new_buf = unique_alloc (old_cnt * 4 * sizeof (u64));
+
+  if (new_buf == NULL)
+  {
+    fprintf (stderr, "Unique: cannot allocate %llu MB, duplicates of later candidates are no longer removed\n", (unsigned long long) ((old_cnt * 4 * sizeof (u64)) >> 20));
+
+    return RC_INVALID;
+  }
+
+  unique->table_mask = (old_cnt * 2) - 1;
+  unique->table_buf  = new_buf;
+
+  for (u64 i = 0; i < old_cnt; i++)
+  {
+    const u64 *entry = old_buf + (i * 2);
+
+    if (entry[1] == 0) continue;
+
+    u64 slot = entry[0] & unique->table_mask;
+
+    while (unique->table_buf[(slot * 2) + 1]) slot = (slot + 1) & unique->table_mask;
+
+    unique->table_buf[(slot * 2) + 0] = entry[0];
+    unique->table_buf[(slot * 2) + 1] = entry[1];
+  }
+
+  unique_release (old_buf, old_cnt * 2 * sizeof (u64));
+
+  return RC_OK;
+}
+
+// returns 1 if the candidate was seen before, otherwise it is added
+
+static int unique_exact (unique_t *unique, const char *buf, const int len, const u64 hash)
+{
+  u64 *entry = unique_slot (unique, buf, len, hash);
+
+  if (entry[1]) return 1;
+
+  if (unique->full) return 0;
+
+  const uint16_t rec_len = len;
+
+  if (unique->arena_len + sizeof (rec_len) + len > unique->arena_size)
+  {
+    char *arena_buf = (char *) realloc (unique->arena_buf, unique->arena_size * 2);
+
+    if (arena_buf == NULL)
+    {
+      fprintf (stderr, "Unique: cannot allocate %llu MB, duplicates of later candidates are no longer removed\n", (unsigned long long) ((unique->arena_size * 2) >> 20));
+
+      unique->full = 1;
+
+      return 0;
+    }
+
+    unique->arena_size *= 2;
+    unique->arena_buf   = arena_buf;
+  }
+
+  char *rec = unique->arena_buf + unique->arena_len;
+
+  memcpy (rec, &rec_len, sizeof (rec_len));
+  memcpy (rec + sizeof (rec_len), buf, len);
+
+  entry[0] = hash;
+  entry[1] = unique->arena_len + 1;
+
+  unique->arena_len += sizeof (rec_len) + len;
+
+  unique->table_cnt++;
+
+  if ((unique->table_cnt * 2) > unique->table_mask)
+  {
+    if (unique_grow (unique) == RC_INVALID) unique->full = 1;
+  }
+
+  return 0;
+}
+
+static u64 *unique_bloom_block (const unique_t *unique, const u64 hash)
+{
+  return unique->bloom_buf + (((hash >> 32) * unique->bloom_blocks) >> 32) * BLOOM_BLOCK_WORDS;
+}
+
+static int unique_bloom (unique_t *unique, const u64 hash)
+{
+  u64 *block = unique_bloom_block (unique, hash);
+
+  const u64 bits = mix_u64 (hash ^ 0x9e3779b97f4a7c15ULL);
+
+  // whether a probe was set is random, collecting the misses avoids a branch per probe
+
+  u64 miss = 0;
+
+  for (int i = 0; i < BLOOM_PROBES; i++)
+  {
+    const int bit = (bits >> (i * 9)) & ((BLOOM_BLOCK_WORDS * 64) - 1);
+
+    const u64 mask = 1ULL << (bit & 63);
+
+    miss |= ~block[bit >> 6] & mask;
+
+    block[bit >> 6] |= mask;
+  }
+
+  return miss == 0;
+}
+
+// drops the duplicates from a buffer of complete candidates and returns the new length. candidates are found by the
+// encoded newline, which can not be part of a key. the first skip bytes of each candidate are a tag and not compared
+
+static int unique_filter (unique_t *unique, char *buf, const int len, const int skip, u64 *dups)
+{
+  const char *eol_enc     = unique->eol_enc;
+  const int   eol_enc_len = unique->eol_enc_len;
+
+  int src = 0;
+  int dst = 0;
+
+  u64 cnt = 0;
+
+  pthread_mutex_lock (&unique->mux);
+
+  while (src < len)
+  {
+    // the lookups of a group are random accesses into a large table, the first pass prefetches all of them
+
+    int pw_pos[UNIQUE_GROUP];
+    int pw_len[UNIQUE_GROUP];
+    u64 hashes[UNIQUE_GROUP];
+
+    int group_cnt = 0;
+
+    for (; (group_cnt < UNIQUE_GROUP) && (src < len); group_cnt++)
+    {
+      int end = src;
+
+      if (eol_enc_len == 1)
+      {
+        end = (const char *) memchr (buf + src, eol_enc[0], len - src) - buf;
+      }
+      else
+      {
+        while (memcmp (buf + end, eol_enc, eol_enc_len)) end += eol_enc_len;
+      }
+
+      const u64 hash = hash_candidate (buf + src + skip, end - src - skip);
+
+      if (unique->type == UNIQUE_EXACT)
+      {
+        __builtin_prefetch (unique->table_buf + ((hash & unique->table_mask) * 2));
+      }
+      else
+      {
+        __builtin_prefetch (unique_bloom_block (unique, hash));
+      }
+
+      pw_pos[group_cnt] = src;
+      pw_len[group_cnt] = end - src;
+      hashes[group_cnt] = hash;
+
+      src = end + eol_enc_len;
+    }
+
+    for (int i = 0; i < group_cnt; i++)
+    {
+      const char *pw_buf = buf + pw_pos[i];
+
+      const int seen = (unique->type == UNIQUE_EXACT) ? unique_exact (unique, pw_buf + skip, pw_len[i] - skip, hashes[i]) : unique_bloom (unique, hashes[i]);
+
+      if (seen)
+      {
+        cnt++;
+
+        continue;
+      }
+
+      const int rec_len = pw_len[i] + eol_enc_len;
+
+      if (dst != pw_pos[i]) memmove (buf + dst, pw_buf, rec_len);
+
+      dst += rec_len;
+    }
+  }
+
+  unique->dups += cnt;
+
+  pthread_mutex_unlock (&unique->mux);
+
+  if (dups) *dups += cnt;
+
+  return dst;
+}
+
+// hash kernels, one block of 64 bytes. candidates are short, most of them take a single block
+
+#define ROTL32(x,n)           (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define MD4_F(x,y,z)          ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x,y,z)          (((x) & (y)) | ((z) & ((x) | (y))))
+#define MD4_H(x,y,z)          ((x) ^ (y) ^ (z))
+
+#define MD4_STEP(f,a,b,c,d,x,t,s) { (a) += f ((b), (c), (d)) + (x) + (t); (a) = ROTL32 ((a), (s)); }
+
+#define MD5_F(x,y,z)          ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x,y,z)          ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x,y,z)          ((x) ^ (y) ^ (z))
+#define MD5_I(x,y,z)          ((y) ^ ((x) | ~(z)))
+
+#define MD5_STEP(f,a,b,c,d,x,t,s) { (a) += f ((b), (c), (d)) + (x) + (t); (a) = ROTL32 ((a), (s)) + (b); }
+
+static void md4_block (uint32_t state[5], const u8 *block)
+{
+  uint32_t w[16];
+
+  for (int i = 0; i < 16; i++) w[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) | ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+
+  MD4_STEP (MD4_F, a, b, c, d, w[ 0], 0x00000000,  3);
+  MD4_STEP (MD4_F, d, a, b, c, w[ 1], 0x00000000,  7);
+  MD4_STEP (MD4_F, c, d, a, b, w[ 2], 0x00000000, 11);
+  MD4_STEP (MD4_F, b, c, d, a, w[ 3], 0x00000000, 19);
+  MD4_STEP (MD4_F, a, b, c, d, w[ 4], 0x00000000,  3);
+  MD4_STEP (MD4_F, d, a, b, c, w[ 5], 0x00000000,  7);
+  MD4_STEP (MD4_F, c, d, a, b, w[ 6], 0x00000000, 11);
+  MD4_STEP (MD4_F, b, c, d, a, w[ 7], 0x00000000, 19);
+  MD4_STEP (MD4_F, a, b, c, d, w[ 8], 0x00000000,  3);
+  MD4_STEP (MD4_F, d, a, b, c, w[ 9], 0x00000000,  7);
+  MD4_STEP (MD4_F, c, d, a, b, w[10], 0x00000000, 11);
+  MD4_STEP (MD4_F, b, c, d, a, w[11], 0x00000000, 19);
+  MD4_STEP (MD4_F, a, b, c, d, w[12], 0x00000000,  3);
+  MD4_STEP (MD4_F, d, a, b, c, w[13], 0x00000000,  7);
+  MD4_STEP (MD4_F, c, d, a, b, w[14], 0x00000000, 11);
+  MD4_STEP (MD4_F, b, c, d, a, w[15], 0x00000000, 19);
+
+  MD4_STEP (MD4_G, a, b, c, d, w[ 0], 0x5a827999,  3);
+  MD4_STEP (MD4_G, d, a, b, c, w[ 4], 0x5a827999,  5);
+  MD4_STEP (MD4_G, c, d, a, b, w[ 8], 0x5a827999,  9);
+  MD4_STEP (MD4_G, b, c, d, a, w[12], 0x5a827999, 13);
+  MD4_STEP (MD4_G, a, b, c, d, w[ 1], 0x5a827999,  3);
+  MD4_STEP (MD4_G, d, a, b, c, w[ 5], 0x5a827999,  5);
+  MD4_STEP (MD4_G, c, d, a, b, w[ 9], 0x5a827999,  9);
+  MD4_STEP (MD4_G, b, c, d, a, w[13], 0x5a827999, 13);
+  MD4_STEP (MD4_G, a, b, c, d, w[ 2], 0x5a827999,  3);
+  MD4_STEP (MD4_G, d, a, b, c, w[ 6], 0x5a827999,  5);
+  MD4_STEP (MD4_G, c, d, a, b, w[10], 0x5a827999,  9);
+  MD4_STEP (MD4_G, b, c, d, a, w[14], 0x5a827999, 13);
+  MD4_STEP (MD4_G, a, b, c, d, w[ 3], 0x5a827999,  3);
+  MD4_STEP (MD4_G, d, a, b, c, w[ 7], 0x5a827999,  5);
+  MD4_STEP (MD4_G, c, d, a, b, w[11], 0x5a827999,  9);
+  MD4_STEP (MD4_G, b, c, d, a, w[15], 0x5a827999, 13);
+
+  MD4_STEP (MD4_H, a, b, c, d, w[ 0], 0x6ed9eba1,  3);
+  MD4_STEP (MD4_H, d, a, b, c, w[ 8], 0x6ed9eba1,  9);
+  MD4_STEP (MD4_H, c, d, a, b, w[ 4], 0x6ed9eba1, 11);
+  MD4_STEP (MD4_H, b, c, d, a, w[12], 0x6ed9eba1, 15);
+  MD4_STEP (MD4_H, a, b, c, d, w[ 2], 0x6ed9eba1,  3);
+  MD4_STEP (MD4_H, d, a, b, c, w[10], 0x6ed9eba1,  9);
+  MD4_STEP (MD4_H, c, d, a, b, w[ 6], 0x6ed9eba1, 11);
+  MD4_STEP (MD4_H, b, c, d, a, w[14], 0x6ed9eba1, 15);
+  MD4_STEP (MD4_H, a, b, c, d, w[ 1], 0x6ed9eba1,  3);
+  MD4_STEP (MD4_H, d, a, b, c, w[ 9], 0x6ed9eba1,  9);
+  MD4_STEP (MD4_H, c, d, a, b, w[ 5], 0x6ed9eba1, 11);
+  MD4_STEP (MD4_H, b, c, d, a, w[13], 0x6ed9eba1, 15);
+  MD4_STEP (MD4_H, a, b, c, d, w[ 3], 0x6ed9eba1,  3);
+  MD4_STEP (MD4_H, d, a, b, c, w[11], 0x6ed9eba1,  9);
+  MD4_STEP (MD4_H, c, d, a, b, w[ 7], 0x6ed9eba1, 11);
+  MD4_STEP (MD4_H, b, c, d, a, w[15], 0x6ed9eba1, 15);
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+static void md5_block (uint32_t state[5], const u8 *block)
+{
+  uint32_t w[16];
+
+  for (int i = 0; i < 16; i++) w[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) | ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+
+  MD5_STEP (MD5_F, a, b, c, d, w[ 0], 0xd76aa478,  7);
+  MD5_STEP (MD5_F, d, a, b, c, w[ 1], 0xe8c7b756, 12);
+  MD5_STEP (MD5_F, c, d, a, b, w[ 2], 0x242070db, 17);
+  MD5_STEP (MD5_F, b, c, d, a, w[ 3], 0xc1bdceee, 22);
+  MD5_STEP (MD5_F, a, b, c, d, w[ 4], 0xf57c0faf,  7);
+  MD5_STEP (MD5_F, d, a, b, c, w[ 5], 0x4787c62a, 12);
+  MD5_STEP (MD5_F, c, d, a, b, w[ 6], 0xa8304613, 17);
+  MD5_STEP (MD5_F, b, c, d, a, w[ 7], 0xfd469501, 22);
+  MD5_STEP (MD5_F, a, b, c, d, w[ 8], 0x698098d8,  7);
+  MD5_STEP (MD5_F, d, a, b, c, w[ 9], 0x8b44f7af, 12);
+  MD5_STEP (MD5_F, c, d, a, b, w[10], 0xffff5bb1, 17);
+  MD5_STEP (MD5_F, b, c, d, a, w[11], 0x895cd7be, 22);
+  MD5_STEP (MD5_F, a, b, c, d, w[12], 0x6b901122,  7);
+  MD5_STEP (MD5_F, d, a, b, c, w[13], 0xfd987193, 12);
+  MD5_STEP (MD5_F, c, d, a, b, w[14], 0xa679438e, 17);
+  MD5_STEP (MD5_F, b, c, d, a, w[15], 0x49b40821, 22);
+
+  MD5_STEP (MD5_G, a, b, c, d, w[ 1], 0xf61e2562,  5);
+  MD5_STEP (MD5_G, d, a, b, c, w[ 6], 0xc040b340,  9);
+  MD5_STEP (MD5_G, c, d, a, b, w[11], 0x265e5a51, 14);
+  MD5_STEP (MD5_G, b, c, d, a, w[ 0], 0xe9b6c7aa, 20);
+  MD5_STEP (MD5_G, a, b, c, d, w[ 5], 0xd62f105d,  5);
+  MD5_STEP (MD5_G, d, a, b, c, w[10], 0x02441453,  9);
+  MD5_STEP (MD5_G, c, d, a, b, w[15], 0xd8a1e681, 14);
+  MD5_STEP (MD5_G, b, c, d, a, w[ 4], 0xe7d3fbc8, 20);
+  MD5_STEP (MD5_G, a, b, c, d, w[ 9], 0x21e1cde6,  5);
+  MD5_STEP (MD5_G, d, a, b, c, w[14], 0xc33707d6,  9);
+  MD5_STEP (MD5_G, c, d, a, b, w[ 3], 0xf4d50d87, 14);
+  MD5_STEP (MD5_G, b, c, d, a, w[ 8], 0x455a14ed, 20);
+  MD5_STEP (MD5_G, a, b, c, d, w[13], 0xa9e3e905,  5);
+  MD5_STEP (MD5_G, d, a, b, c, w[ 2], 0xfcefa3f8,  9);
+  MD5_STEP (MD5_G, c, d, a, b, w[ 7], 0x676f02d9, 14);
+  MD5_STEP (MD5_G, b, c, d, a, w[12], 0x8d2a4c8a, 20);
+
+  MD5_STEP (MD5_H, a, b, c, d, w[ 5], 0xfffa3942,  4);
+  MD5_STEP (MD5_H, d, a, b, c, w[ 8], 0x8771f681, 11);
+  MD5_STEP (MD5_H, c, d, a, b, w[11], 0x6d9d6122, 16);
+  MD5_STEP (MD5_H, b, c, d, a, w[14], 0xfde5380c, 23);
+  MD5_STEP (MD5_H, a, b, c, d, w[ 1], 0xa4beea44,  4);
+  MD5_STEP (MD5_H, d, a, b, c, w[ 4], 0x4bdecfa9, 11);
+  MD5_STEP (MD5_H, c, d, a, b, w[ 7], 0xf6bb4b60, 16);
+  MD5_STEP (MD5_H, b, c, d, a, w[10], 0xbebfbc70, 23);
+  MD5_STEP (MD5_H, a, b, c, d, w[13], 0x289b7ec6,  4);
+  MD5_STEP (MD5_H, d, a, b, c, w[ 0], 0xeaa127fa, 11);
+  MD5_STEP (MD5_H, c, d, a, b, w[ 3], 0xd4ef3085, 16);
+  MD5_STEP (MD5_H, b, c, d, a, w[ 6], 0x04881d05, 23);
+  MD5_STEP (MD5_H, a, b, c, d, w[ 9], 0xd9d4d039,  4);
+  MD5_STEP (MD5_H, d, a, b, c, w[12], 0xe6db99e5, 11);
+  MD5_STEP (MD5_H, c, d, a, b, w[15], 0x1fa27cf8, 16);
+  MD5_STEP (MD5_H, b, c, d, a, w[ 2], 0xc4ac5665, 23);
+
+  MD5_STEP (MD5_I, a, b, c, d, w[ 0], 0xf4292244,  6);
+  MD5_STEP (MD5_I, d, a, b, c, w[ 7], 0x432aff97, 10);
+  MD5_STEP (MD5_I, c, d, a, b, w[14], 0xab9423a7, 15);
+  MD5_STEP (MD5_I, b, c, d, a, w[ 5], 0xfc93a039, 21);
+  MD5_STEP (MD5_I, a, b, c, d, w[12], 0x655b59c3,  6);
+  MD5_STEP (MD5_I, d, a, b, c, w[ 3], 0x8f0ccc92, 10);
+  MD5_STEP (MD5_I, c, d, a, b, w[10], 0xffeff47d, 15);
+  MD5_STEP (MD5_I, b, c, d, a, w[ 1], 0x85845dd1, 21);
+  MD5_STEP (MD5_I, a, b, c, d, w[ 8], 0x6fa87e4f,  6);
+  MD5_STEP (MD5_I, d, a, b, c, w[15], 0xfe2ce6e0, 10);
+  MD5_STEP (MD5_I, c, d, a, b, w[ 6], 0xa3014314, 15);
+  MD5_STEP (MD5_I, b, c, d, a, w[13], 0x4e0811a1, 21);
+  MD5_STEP (MD5_I, a, b, c, d, w[ 4], 0xf7537e82,  6);
+  MD5_STEP (MD5_I, d, a, b, c, w[11], 0xbd3af235, 10);
+  MD5_STEP (MD5_I, c, d, a, b, w[ 2], 0x2ad7d2bb, 15);
+  MD5_STEP (MD5_I, b, c, d, a, w[ 9], 0xeb86d391, 21);
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+static void sha1_block (uint32_t state[5], const u8 *block)
+{
+  uint32_t w[80];
+
+  for (int i = 0; i < 16; i++) w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) | ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+
+  for (int i = 16; i < 80; i++) w[i] = ROTL32 (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+
+  for (int i = 0; i < 80; i++)
+  {
+    uint32_t f;
+
+    if      (i < 20) f = (d ^ (b & (c ^ d)))       + 0x5a827999;
+    else if (i < 40) f = (b ^ c ^ d)               + 0x6ed9eba1;
+    else if (i < 60) f = ((b & c) | (d & (b | c))) + 0x8f1bbcdc;
+    else             f = (b ^ c ^ d)               + 0xca62c1d6;
+
+    const uint32_t t = ROTL32 (a, 5) + f + e + w[i];
+
+    e = d;
+    d = c;
+    c = ROTL32 (b, 30);
+    b = a;
+    a = t;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+// digest of len bytes, the md4 family stores the length and the words little endian, sha1 big endian
+
+static void crack_digest (const int type, const u8 *buf, const int len, u8 *digest)
+{
+  uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+  void (*block) (uint32_t *, const u8 *) = (type == HASH_MD5) ? md5_block : (type == HASH_SHA1) ? sha1_block : md4_block;
+
+  const int big_endian = (type == HASH_SHA1);
+
+  int pos = 0;
+
+  for (; pos + 64 <= len; pos += 64) block (state, buf + pos);
+
+  u8 tail[128];
+
+  const int tail_len = len - pos;
+  const int tail_end = (tail_len < 56) ? 64 : 128;
+
+  memcpy (tail, buf + pos, tail_len);
+
+  tail[tail_len] = 0x80;
+
+  memset (tail + tail_len + 1, 0, tail_end - tail_len - 1);
+
+  const u64 bits = (u64) len * 8;
+
+  for (int i = 0; i < 8; i++) tail[tail_end - 8 + i] = (u8) (bits >> ((big_endian) ? (56 - (i * 8)) : (i * 8)));
+
+  block (state, tail);
+
+  if (tail_end == 128) block (state, tail + 64);
+
+  const int words = (big_endian) ? 5 : 4;
+
+  for (int i = 0; i < words * 4; i++) digest[i] = (u8) (state[i / 4] >> ((big_endian) ? (24 - ((i % 4) * 8)) : ((i % 4) * 8)));
+}
+
+// ntlm hashes the candidate as utf-16le, converted from the output encoding. RC_INVALID if it does not decode
+
+static int crack_utf16 (const int encoding, const char *buf, const int len, u8 *out)
+{
+  if (encoding == ENCODING_UTF16LE)
+  {
+    memcpy (out, buf, len);
+
+    return len;
+  }
+
+  mbstate_t state;
+
+  memset (&state, 0, sizeof (state));
+
+  int out_len = 0;
+
+  for (int pos = 0; pos < len;)
+  {
+    const u8 b = (u8) buf[pos];
+
+    uint32_t u;
+
+    if ((b < 0x80) || (encoding == ENCODING_LATIN1))
+    {
+      u = b;
+
+      pos++;
+    }
+    else if (encoding == ENCODING_UTF8)
+    {
+      const int n = (b >= 0xf0) ? 4 : (b >= 0xe0) ? 3 : 2;
+
+      if (pos + n > len) return RC_INVALID;
+
+      u = b & (0x3f >> (n - 1));
+
+      for (int i = 1; i < n; i++) u = (u << 6) | ((u8) buf[pos + i] & 0x3f);
+
+      pos += n;
+    }
+    else
+    {
+      wchar_t c;
+
+      const size_t n = mbrtowc (&c, buf + pos, len - pos, &state);
+
+      if ((n == (size_t) -1) || (n == (size_t) -2) || (n == 0)) return RC_INVALID;
+
+      u = (uint32_t) c;
+
+      pos += n;
+    }
+
+    if (u >= 0x10000)
+    {
+      u -= 0x10000;
+
+      const uint32_t hi = 0xd800 | (u >> 10);
+      const uint32_t lo = 0xdc00 | (u & 0x3ff);
+
+      out[out_len++] = (u8) hi; out[out_len++] = (u8) (hi >> 8);
+      out[out_len++] = (u8) lo; out[out_len++] = (u8) (lo >> 8);
+    }
+    else
+    {
+      out[out_len++] = (u8) u; out[out_len++] = (u8) (u >> 8);
+    }
+  }
+
+  return out_len;
+}
+
+static u64 crack_key (const u8 *digest)
+{
+  u64 key;
+
+  memcpy (&key, digest, sizeof (key));
+
+  return key;
+}
+
+// the slot holding the digest, or the free slot it goes into
+
+static int *crack_slot (const crack_t *crack, const u8 *digest)
+{
+  const u64 key = crack_key (digest);
+
+  for (u64 slot = key & crack->table_mask;; slot = (slot + 1) & crack->table_mask)
+  {
+    int *entry = crack->table_buf + slot;
+
+    if (*entry == RC_INVALID) return entry;
+
+    if (memcmp (crack->digests_buf + ((size_t) *entry * crack->digest_len), digest, crack->digest_len) == 0) return entry;
+  }
+}
+
+static int crack_hex (const char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+
+  return RC_INVALID;
+}
+
+static void crack_free (crack_t *crack)
+{
+  if (crack == NULL) return;
+
+  pthread_mutex_destroy (&crack->mux);
+
+  free (crack->table_buf);
+  free (crack->bitmap_buf);
+  free (crack->digests_buf);
+  free (crack->found_buf);
+  free (crack);
+}
+
+// one hex hash per line, anything else is skipped. a hash listed twice is loaded once
+
+static crack_t *crack_init (const int type, const walk_t *walk, const char *file)
+{
+  map_t map;
+
+  if (map_open (&map, file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return NULL;
+  }
+
+  crack_t *crack = (crack_t *) calloc (1, sizeof (crack_t));
+
+  crack->type        = type;
+  crack->digest_len  = (type == HASH_SHA1) ? 20 : 16;
+  crack->encoding    = walk->encoding;
+  crack->eol_enc_len = walk->eol_enc_len;
+
+  memcpy (crack->eol_enc, walk->eol_enc, ENC_MAX);
+
+  pthread_mutex_init (&crack->mux, NULL);
+
+  const int lines_cnt = map_lines (&map);
+
+  u64 table_size = CRACK_TABLE_MIN;
+
+  while (table_size < (u64) lines_cnt * 2) table_size *= 2;
+
+  crack->table_mask  = table_size - 1;
+  crack->table_buf   = (int *) malloc (table_size * sizeof (int));
+  crack->bitmap_mask = (table_size * 8) - 1;
+  crack->bitmap_buf  = (u64 *) calloc (table_size / 8, sizeof (u64));
+  crack->digests_buf = (u8 *) malloc (((size_t) lines_cnt + 1) * crack->digest_len);
+
+  for (u64 slot = 0; slot < table_size; slot++) crack->table_buf[slot] = RC_INVALID;
+
+  int skipped = 0;
+
+  while (map.pos < map.len)
+  {
+    const char *line_buf = map.buf + map.pos;
+    const char *eol      = (const char *) memchr (line_buf, '\n', map.len - map.pos);
+
+    int line_len = (eol) ? eol - line_buf : (int) (map.len - map.pos);
+
+    map.pos += line_len + ((eol) ? 1 : 0);
+
+    while ((line_len) && ((line_buf[line_len - 1] == '\r') || (line_buf[line_len - 1] == ' ') || (line_buf[line_len - 1] == '\t'))) line_len--;
+
+    if (line_len == 0) continue;
+
+    u8 *digest = crack->digests_buf + ((size_t) crack->digests_cnt * crack->digest_len);
+
+    int valid = (line_len == crack->digest_len * 2);
+
+    for (int i = 0; (valid) && (i < crack->digest_len); i++)
+    {
+      const int hi = crack_hex (line_buf[i * 2 + 0]);
+      const int lo = crack_hex (line_buf[i * 2 + 1]);
+
+      if ((hi == RC_INVALID) || (lo == RC_INVALID))
+      {
+        valid = 0;
+
+        break;
+      }
+
+      digest[i] = (u8) ((hi << 4) | lo);
+    }
+
+    if (valid == 0)
+    {
+      skipped++;
+
+      continue;
+    }
+
+    int *entry = crack_slot (crack, digest);
+
+    if (*entry != RC_INVALID) continue;
+
+    *entry = crack->digests_cnt++;
+
+    const u64 bit = crack_key (digest) >> 32 & crack->bitmap_mask;
+
+    crack->bitmap_buf[bit / 64] |= 1ULL << (bit % 64);
+  }
+
+  map_close (&map);
+
+  if (skipped) fprintf (stderr, "%s: skipped %d lines that are no %s hashes\n", file, skipped, (type == HASH_MD5) ? "md5" : (type == HASH_SHA1) ? "sha1" : "ntlm");
+
+  if (crack->digests_cnt == 0)
+  {
+    fprintf (stderr, "%s: no hashes loaded\n", file);
+
+    crack_free (crack);
+
+    return NULL;
+  }
+
+  crack->found_buf = (u8 *) calloc (crack->digests_cnt, 1);
+
+  return crack;
+}
+
+// hashes a buffer of complete candidates and writes hash:plain for each hash cracked the first time. a plain in
+// utf-16le is written as $HEX[], the line would not be readable otherwise
+
+static void crack_buffer (crack_t *crack, const char *buf, const int len, const int skip)
+{
+  const char *eol_enc     = crack->eol_enc;
+  const int   eol_enc_len = crack->eol_enc_len;
+
+  u8 tmp[(PW_MAX + 1) * ENC_MAX];
+
+  for (int src = 0; src < len;)
+  {
+    int end = src;
+
+    if (eol_enc_len == 1)
+    {
+      end = (const char *) memchr (buf + src, eol_enc[0], len - src) - buf;
+    }
+    else
+    {
+      while (memcmp (buf + end, eol_enc, eol_enc_len)) end += eol_enc_len;
+    }
+
+    const char *pw_buf = buf + src + skip;
+    const int   pw_len = end - src - skip;
+
+    src = end + eol_enc_len;
+
+    const u8 *in_buf = (const u8 *) pw_buf;
+    int       in_len = pw_len;
+
+    if (crack->type == HASH_NTLM)
+    {
+      in_len = crack_utf16 (crack->encoding, pw_buf, pw_len, tmp);
+      in_buf = tmp;
+
+      if (in_len == RC_INVALID) continue;
+    }
+
+    u8 digest[20];
+
+    crack_digest (crack->type, in_buf, in_len, digest);
+
+    const u64 bit = crack_key (digest) >> 32 & crack->bitmap_mask;
+
+    if ((crack->bitmap_buf[bit / 64] & (1ULL << (bit % 64))) == 0) continue;
+
+    const int *entry = crack_slot (crack, digest);
+
+    if (*entry == RC_INVALID) continue;
+
+    pthread_mutex_lock (&crack->mux);
+
+    if (crack->found_buf[*entry] == 0)
+    {
+      crack->found_buf[*entry] = 1;
+
+      crack->cracked++;
+
+      if (crack->fp)
+      {
+        for (int i = 0; i < crack->digest_len; i++) fprintf (crack->fp, "%02x", digest[i]);
+
+        fputc (':', crack->fp);
+
+        if (crack->encoding == ENCODING_UTF16LE)
+        {
+          fputs ("$HEX[", crack->fp);
+
+          for (int i = 0; i < pw_len; i++) fprintf (crack->fp, "%02x", (u8) pw_buf[i]);
+
+          fputc (']', crack->fp);
+        }
+        else
+        {
+          fwrite (pw_buf, 1, pw_len, crack->fp);
+        }
+
+        fputc ('\n', crack->fp);
+      }
+    }
+
+    pthread_mutex_unlock (&crack->mux);
+  }
+}
+
+// rules, a subset of the hashcat rule functions. a rule is compiled once into ops, the function character with its
+// positions already decoded. ops work on the encoded bytes, the case functions only touch ascii letters
+
+static int rule_pos (const char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'A') && (c <= 'Z')) return c - 'A' + 10;
+
+  return RC_INVALID;
+}
+
+// number of ops, RC_INVALID for an unknown function or a missing parameter
+
+static int rule_compile (const char *line_buf, const int line_len, rule_op_t *ops_buf)
+{
+  int ops_cnt = 0;
+
+  for (int pos = 0; pos < line_len;)
+  {
+    const char c = line_buf[pos++];
+
+    if (c == ' ') continue;
+
+    if (ops_cnt == RULE_OPS_MAX) return RC_INVALID;
+
+    rule_op_t *op = ops_buf + ops_cnt++;
+
+    op->op = (u8) c;
+    op->a  = 0;
+    op->b  = 0;
+
+    // parameters: P position, C character
+
+    const char *params;
+
+    switch (c)
+    {
+      case ':': case 'l': case 'u': case 'c': case 'C': case 't': case 'r': case 'd': case 'f':
+      case '{': case '}': case '[': case ']': case 'q': case 'k': case 'K':
+        params = "";   break;
+      case 'T': case 'D': case 'p': case 'z': case 'Z': case '\'':
+        params = "P";  break;
+      case '$': case '^': case '@':
+        params = "C";  break;
+      case 'x': case 'O': case '*':
+        params = "PP"; break;
+      case 'i': case 'o':
+        params = "PC"; break;
+      case 's':
+        params = "CC"; break;
+      default:
+        return RC_INVALID;
+    }
+
+    for (int i = 0; params[i]; i++)
+    {
+      if (pos == line_len) return RC_INVALID;
+
+      int v = (u8) line_buf[pos++];
+
+      if ((params[i] == 'P') && ((v = rule_pos ((char) v)) == RC_INVALID)) return RC_INVALID;
+
+      if (i == 0) op->a = (u8) v;
+      else        op->b = (u8) v;
+    }
+  }
+
+  return ops_cnt;
+}
+
+static u8 rule_lower  (const u8 c) { return ((c >= 'A') && (c <= 'Z')) ? c | 0x20 : c; }
+static u8 rule_upper  (const u8 c) { return ((c >= 'a') && (c <= 'z')) ? c & ~0x20 : c; }
+static u8 rule_toggle (const u8 c) { return (((c | 0x20) >= 'a') && ((c | 0x20) <= 'z')) ? c ^ 0x20 : c; }
+
+// applies the ops to the len bytes in buf, in place. a position outside of the word leaves it as it is like in
+// hashcat, a word growing past RULE_PW_MAX or ending up empty is rejected with RC_INVALID
+
+static int rule_apply (const rule_op_t *ops_buf, const int ops_cnt, u8 *buf, int len)
+{
+  for (int ops_pos = 0; ops_pos < ops_cnt; ops_pos++)
+  {
+    const rule_op_t *op = ops_buf + ops_pos;
+
+    const int a = op->a;
+    const int b = op->b;
+
+    switch (op->op)
+    {
+      case ':':
+        break;
+
+      case 'l': for (int i = 0; i < len; i++) buf[i] = rule_lower  (buf[i]); break;
+      case 'u': for (int i = 0; i < len; i++) buf[i] = rule_upper  (buf[i]); break;
+      case 't': for (int i = 0; i < len; i++) buf[i] = rule_toggle (buf[i]); break;
+
+      case 'c':
+        for (int i = 0; i < len; i++) buf[i] = (i) ? rule_lower (buf[i]) : rule_upper (buf[i]);
+        break;
+
+      case 'C':
+        for (int i = 0; i < len; i++) buf[i] = (i) ? rule_upper (buf[i]) : rule_lower (buf[i]);
+        break;
+
+      case 'T':
+        if (a < len) buf[a] = rule_toggle (buf[a]);
+        break;
+
+      case 'r':
+        for (int i = 0, j = len - 1; i < j; i++, j--) { const u8 c = buf[i]; buf[i] = buf[j]; buf[j] = c; }
+        break;
+
+      case 'd':
+        if (len * 2 > RULE_PW_MAX) return RC_INVALID;
+        memcpy (buf + len, buf, len);
+        len *= 2;
+        break;
+
+      case 'p':
+        if (len * (a + 1) > RULE_PW_MAX) return RC_INVALID;
+        for (int i = 1; i <= a; i++) memcpy (buf + (len * i), buf, len);
+        len *= a + 1;
+        break;
+
+      case 'f':
+        if (len * 2 > RULE_PW_MAX) return RC_INVALID;
+        for (int i = 0; i < len; i++) buf[len + i] = buf[len - 1 - i];
+        len *= 2;
+        break;
+
+      case '{':
+        if (len) { const u8 c = buf[0]; memmove (buf, buf + 1, len - 1); buf[len - 1] = c; }
+        break;
+
+      case '}':
+        if (len) { const u8 c = buf[len - 1]; memmove (buf + 1, buf, len - 1); buf[0] = c; }
+        break;
+
+      case '$':
+        if (len + 1 > RULE_PW_MAX) return RC_INVALID;
+        buf[len++] = (u8) a;
+        break;
+
+      case '^':
+        if (len + 1 > RULE_PW_MAX) return RC_INVALID;
+        memmove (buf + 1, buf, len);
+        buf[0] = (u8) a;
+        len++;
+        break;
+
+      case '[':
+        if (len) memmove (buf, buf + 1, --len);
+        break;
+
+      case ']':
+        if (len) len--;
+        break;
+
+      case 'D':
+        if (a < len) { memmove (buf + a, buf + a + 1, len - a - 1); len--; }
+        break;
+
+      case 'x':
+        if (a + b <= len) { memmove (buf, buf + a, b); len = b; }
+        break;
+
+      case 'O':
+        if (a + b <= len) { memmove (buf + a, buf + a + b, len - a - b); len -= b; }
+        break;
+
+      case 'i':
+        if (len + 1 > RULE_PW_MAX) return RC_INVALID;
+        if (a <= len) { memmove (buf + a + 1, buf + a, len - a); buf[a] = (u8) b; len++; }
+        break;
+
+      case 'o':
+        if (a < len) buf[a] = (u8) b;
+        break;
+
+      case '\'':
+        if (a < len) len = a;
+        break;
+
+      case 's':
+        for (int i = 0; i < len; i++) if (buf[i] == a) buf[i] = (u8) b;
+        break;
+
+      case '@':
+      {
+        int dst = 0;
+
+        for (int i = 0; i < len; i++) if (buf[i] != a) buf[dst++] = buf[i];
+
+        len = dst;
+
+        break;
+      }
+
+      case 'z':
+        if (len + a > RULE_PW_MAX) return RC_INVALID;
+        if (len) { memmove (buf + a, buf, len); memset (buf, buf[a], a); len += a; }
+        break;
+
+      case 'Z':
+        if (len + a > RULE_PW_MAX) return RC_INVALID;
+        if (len) { memset (buf + len, buf[len - 1], a); len += a; }
+        break;
+
+      case 'q':
+        if (len * 2 > RULE_PW_MAX) return RC_INVALID;
+        for (int i = len - 1; i >= 0; i--) buf[(i * 2) + 1] = buf[(i * 2) + 0] = buf[i];
+        len *= 2;
+        break;
+
+      case 'k':
+        if (len >= 2) { const u8 c = buf[0]; buf[0] = buf[1]; buf[1] = c; }
+        break;
+
+      case 'K':
+        if (len >= 2) { const u8 c = buf[len - 1]; buf[len - 1] = buf[len - 2]; buf[len - 2] = c; }
+        break;
+
+      case '*':
+        if ((a < len) && (b < len)) { const u8 c = buf[a]; buf[a] = buf[b]; buf[b] = c; }
+        break;
+    }
+  }
+
+  return (len) ? len : RC_INVALID;
+}
+
+static void rules_free (rules_t *rules)
+{
+  if (rules == NULL) return;
+
+  free (rules->ops_buf);
+  free (rules->ops_cnt);
+  free (rules);
+}
+
+// one rule per line like a hashcat rule file, empty lines and # comments are skipped. a line using a function that
+// is not supported is skipped with a warning
+
+static rules_t *rules_init (const walk_t *walk, const char *file)
+{
+  map_t map;
+
+  if (map_open (&map, file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return NULL;
+  }
+
+  rules_t *rules = (rules_t *) calloc (1, sizeof (rules_t));
+
+  rules->eol_enc_len = walk->eol_enc_len;
+
+  memcpy (rules->eol_enc, walk->eol_enc, ENC_MAX);
+
+  const int lines_cnt = map_lines (&map);
+
+  rules->ops_buf = (rule_op_t *) malloc (((size_t) lines_cnt + 1) * RULE_OPS_MAX * sizeof (rule_op_t));
+  rules->ops_cnt = (int *) malloc (((size_t) lines_cnt + 1) * sizeof (int));
+
+  int skipped = 0;
+
+  while (map.pos < map.len)
+  {
+    const char *line_buf = map.buf + map.pos;
+    const char *eol      = (const char *) memchr (line_buf, '\n', map.len - map.pos);
+
+    int line_len = (eol) ? eol - line_buf : (int) (map.len - map.pos);
+
+    map.pos += line_len + ((eol) ? 1 : 0);
+
+    if ((line_len) && (line_buf[line_len - 1] == '\r')) line_len--;
+
+    if ((line_len == 0) || (line_buf[0] == '#')) continue;
+
+    const int ops_cnt = rule_compile (line_buf, line_len, rules->ops_buf + (rules->rules_cnt * RULE_OPS_MAX));
+
+    if (ops_cnt == RC_INVALID)
+    {
+      skipped++;
+
+      continue;
+    }
+
+    rules->ops_cnt[rules->rules_cnt++] = ops_cnt;
+  }
+
+  map_close (&map);
+
+  if (skipped) fprintf (stderr, "%s: skipped %d rules with unsupported functions\n", file, skipped);
+
+  if (rules->rules_cnt == 0)
+  {
+    fprintf (stderr, "%s: no rules loaded\n", file);
+
+    rules_free (rules);
+
+    return NULL;
+  }
+
+  return rules;
+}
+
+static void out_set_writer (out_t *out, writer_t *writer)
+{
+  free (out->buf);
+
+  out->writer = writer;
+  out->buf    = writer->bufs_buf[writer->fill];
+  out->len    = 0;
+  out->size   = writer->size;
+}
+
+static void out_flush (out_t *out)
+{
+  // rejected candidates still have to reach the position
+
+  if ((out->len == 0) && (out->cnt == out->flushed)) return;
+
+  out->generated += out->len;
+
+  if ((out->unique) && (out->pool == NULL)) out->len = unique_filter (out->unique, out->buf, out->len, out->tag_len, &out->dups);
+
+  // a batch of nothing but duplicates would look like the end of the keyspace, it keeps filling the same buffer
+
+  if ((out->len == 0) && (out->batch)) return;
+
+  if (out->crack) crack_buffer (out->crack, out->buf, out->len, out->tag_len);
+
+  const u64 cnt = out->cnt - out->flushed;
+
+  out->bytes   += out->len;
+  out->flushed  = out->cnt;
+
+  if (out->pool)
+  {
+    pool_push (out->pool, out->job_pos, out->buf, out->len, cnt);
+  }
+  else if (out->writer)
+  {
+    out->buf = writer_swap (out->writer, out->len, cnt);
+  }
+  else if (out->batch)
+  {
+    batch_swap (out->batch, out);
+  }
+  else if (out->fp)
+  {
+    fwrite (out->buf, 1, out->len, out->fp);
+  }
+
+  out->len = 0;
+
+  if ((out->stop) && (*out->stop) && (out->left)) *out->left = 0;
+}
+
+static void out_reject (out_t *out, const u64 cnt)
+{
+  out->cnt      += cnt;
+  out->rejected += cnt;
+}
+
+// adds what the out has generated since cnt, bytes and start to the totals of a route
+
+static void out_route_stats (const out_t *out, kwp_route_stats_t *stats, const u64 cnt, const u64 bytes, const struct timespec *start)
+{
+  struct timespec stop;
+
+  clock_gettime (CLOCK_MONOTONIC, &stop);
+
+  stats->emitted += out->cnt - cnt;
+  stats->bytes   += (out->generated + out->len) - bytes;
+  stats->ms      += timer_ms (start, &stop);
+}
+
+// the walk at out->len is copied aside and written again once per rule, after the tag. a full buffer is flushed between
+// two results, so the results of one walk can be split over two buffers
+
+static void out_rules (out_t *out, const int pw_len)
+{
+  const rules_t *rules = out->rules;
+
+  const int base_len = pw_len - rules->eol_enc_len;
+
+  u8 base_buf[RULE_PW_MAX];
+
+  memcpy (base_buf, out->buf + out->len, base_len);
+
+  for (int rules_pos = 0; rules_pos < rules->rules_cnt; rules_pos++)
+  {
+    u8 *buf = (u8 *) out->buf + out->len + out->tag_len;
+
+    memcpy (buf, base_buf, base_len);
+
+    const int len = rule_apply (rules->ops_buf + (rules_pos * RULE_OPS_MAX), rules->ops_cnt[rules_pos], buf, base_len);
+
+    if (len == RC_INVALID) continue;
+
+    memcpy (buf - out->tag_len, out->tag_enc, out->tag_len);
+
+    memcpy (buf + len, rules->eol_enc, ENC_MAX);
+
+    out->len += out->tag_len + len + rules->eol_enc_len;
+
+    if ((out->len >= out->size - OUT_RESERVE) && (rules_pos + 1 < rules->rules_cnt))
+    {
+      out_flush (out);
+
+      // a stopped batch takes the buffer away
+
+      if (out->buf == NULL) return;
+    }
+  }
+
+  out->cnt++;
+
+  if (out->len >= out->size - OUT_RESERVE)
+  {
+    out_flush (out);
+  }
+}
+
+static void out_push (out_t *out, const int pw_len)
+{
+  if (out->rules)
+  {
+    out_rules (out, pw_len);
+
+    return;
+  }
+
+  // the candidate has been written straight into the buffer at out->len, OUT_RESERVE bytes are always free there
+
+  if (out->tag_len)
+  {
+    char *buf = out->buf + out->len;
+
+    memmove (buf + out->tag_len, buf, pw_len);
+    memcpy  (buf, out->tag_enc, out->tag_len);
+
+    out->len += out->tag_len;
+  }
+
+  out->len += pw_len;
+
+  out->cnt++;
+
+  if (out->len >= out->size - OUT_RESERVE)
+  {
+    out_flush (out);
+  }
+}
+
+static int encode_chr (const int encoding, const wchar_t c, char *buf)
+{
+  if (encoding == ENCODING_LOCALE)
+  {
+    char tmp[MB_LEN_MAX];
+
+    mbstate_t ps;
+
+    memset (&ps, 0, sizeof (ps));
+
+    const size_t len = wcrtomb (tmp, c, &ps);
+
+    if (len == (size_t) -1) return RC_INVALID;
+    if (len > ENC_MAX)      return RC_INVALID;
+
+    memcpy (buf, tmp, len);
+
+    return (int) len;
+  }
+
+  const uint32_t u = (uint32_t) c;
+
+  if ((u >= 0xd800) && (u <= 0xdfff)) return RC_INVALID;
+
+  if (encoding == ENCODING_UTF8)
+  {
+    if (u < 0x80)
+    {
+      buf[0] = (char) u;
+
+      return 1;
+    }
+
+    if (u < 0x800)
+    {
+      buf[0] = (char) (0xc0 | (u >> 6));
+      buf[1] = (char) (0x80 | (u & 0x3f));
+
+      return 2;
+    }
+
+    if (u < 0x10000)
+    {
+      buf[0] = (char) (0xe0 | (u >> 12));
+      buf[1] = (char) (0x80 | ((u >> 6) & 0x3f));
+      buf[2] = (char) (0x80 | (u & 0x3f));
+
+      return 3;
+    }
+
+    if (u < 0x110000)
+    {
+      buf[0] = (char) (0xf0 | (u >> 18));
+      buf[1] = (char) (0x80 | ((u >> 12) & 0x3f));
+      buf[2] = (char) (0x80 | ((u >> 6) & 0x3f));
+      buf[3] = (char) (0x80 | (u & 0x3f));
+
+      return 4;
+    }
+
+    return RC_INVALID;
+  }
+
+  if (encoding == ENCODING_LATIN1)
+  {
+    if (u > 0xff) return RC_INVALID;
+
+    buf[0] = (char) u;
+
+    return 1;
+  }
+
+  if (encoding == ENCODING_UTF16LE)
+  {
+    if (u < 0x10000)
+    {
+      buf[0] = (char) (u & 0xff);
+      buf[1] = (char) (u >> 8);
+
+      return 2;
+    }
+
+    if (u < 0x110000)
+    {
+      const uint32_t v = u - 0x10000;
+
+      const uint32_t hi = 0xd800 | (v >> 10);
+      const uint32_t lo = 0xdc00 | (v & 0x3ff);
+
+      buf[0] = (char) (hi & 0xff);
+      buf[1] = (char) (hi >> 8);
+      buf[2] = (char) (lo & 0xff);
+      buf[3] = (char) (lo >> 8);
+
+      return 4;
+    }
+
+    return RC_INVALID;
+  }
+
+  return RC_INVALID;
+}
+
+int kwp_parse_encoding (const char *name)
+{
+  if (strcmp (name, "locale")  == 0) return ENCODING_LOCALE;
+  if (strcmp (name, "utf8")    == 0) return ENCODING_UTF8;
+  if (strcmp (name, "utf-8")   == 0) return ENCODING_UTF8;
+  if (strcmp (name, "latin1")  == 0) return ENCODING_LATIN1;
+  if (strcmp (name, "utf16le") == 0) return ENCODING_UTF16LE;
+
+  return RC_INVALID;
+}
+
+// next line decoded in the current locale without the line break, at most size - 1 characters are stored but line_len
+// is the full length. returns NULL once all lines are read and for a line that does not decode, it is skipped then
+
+static wchar_t *map_getl (map_t *map, wchar_t *buf, const int size, int *line_len)
+{
+  if (map->pos >= map->len) return NULL;
+
+  const char *ptr = map->buf + map->pos;
+  const char *end = map->buf + map->len;
+
+  const char *eol = (const char *) memchr (ptr, '\n', end - ptr);
+
+  if (eol == NULL) eol = end;
+
+  map->pos = (eol - map->buf) + ((eol < end) ? 1 : 0);
+
+  while ((eol > ptr) && (eol[-1] == '\r')) eol--;
+
+  mbstate_t state;
+
+  memset (&state, 0, sizeof (state));
+
+  int len = 0;
+
+  while (ptr < eol)
+  {
+    wchar_t c;
+
+    if ((u8) *ptr < 0x80)
+    {
+      c = (u8) *ptr++;
+    }
+    else
+    {
+      const size_t n = mbrtowc (&c, ptr, eol - ptr, &state);
+
+      if ((n == (size_t) -1) || (n == (size_t) -2)) return NULL;
+
+      ptr += (n) ? n : 1;
+    }
+
+    if (len < (size - 1)) buf[len] = c;
+
+    len++;
+  }
+
+  buf[(len < (size - 1)) ? len : (size - 1)] = 0;
+
+  *line_len = len;
+
+  return buf;
+}
+
+static int check_keymap_line_width(int line_len, int total_line_num, const char *section_name, int section_row)
+{
+  if (line_len > KEYMAP_WIDTH_MAX)
+  {
+    fprintf(stderr, "ERROR: Keymap file format error.\n");
+    fprintf(stderr, "       Line %d (%s map, row %d) is too long.\n", total_line_num, section_name, section_row);
+    fprintf(stderr, "       Maximum allowed width is %d characters, but this line has %d.\n", KEYMAP_WIDTH_MAX, line_len);
+    return RC_INVALID;
+  }
+  return RC_OK;
+}
+
+static wchar_t* read_keymap_line(map_t *map, wchar_t *tmp_buf, int *line_len, const char *section_name, int section_row)
+{
+  wchar_t *line_buf = map_getl(map, tmp_buf, BUFSIZ, line_len);
+
+  if (line_buf == NULL)
+  {
+    fprintf(stderr, "ERROR: Keymap file is incomplete. Expected line for %s map, row %d.\n", section_name, section_row);
+  }
+
+  return line_buf;
+}
+
+// rows lines each of basic, shift and altgr. line_num counts the lines of the file read so far
+
+static int parse_keymap_block (map_t *map, wchar_t *tmp, block_t *block, int *line_num)
+{
+  static const char *sections_name[MOD_CNT] = { "basic", "shift", "altgr" };
+
+  for (int m = 0; m < MOD_CNT; m++)
+  {
+    for (int y = 0; y < block->rows; y++)
+    {
+      int line_len;
+
+      (*line_num)++;
+
+      wchar_t *line_buf = read_keymap_line(map, tmp, &line_len, sections_name[m], y + 1);
+
+      if (line_buf == NULL) return RC_INVALID;
+
+      if (check_keymap_line_width(line_len, *line_num, sections_name[m], y + 1) != RC_OK) return RC_INVALID;
+
+      for (int x = 0; x < line_len; x++)
+      {
+        wchar_t c = line_buf[x];
+
+        if (c == ' ') continue;
+
+        block->keys[m][y][x] = c;
+      }
+    }
+  }
+
+  return RC_OK;
+}
+
+// the rows of a block follow a line "block NAME ROWS", the name is only there for the reader. a file without block
+// lines is the original format, exactly 12 lines making up a single block of 4 rows
+
+static int parse_keymap_file (map_t *map, keymap_t *keymap)
+{
+  for (int b = 0; b < KEYMAP_BLOCKS_MAX; b++)
+  {
+    for (int m = 0; m < MOD_CNT; m++)
+    {
+      for (int y = 0; y < KEYMAP_HEIGHT_MAX; y++)
+      {
+        for (int x = 0; x < KEYMAP_WIDTH_MAX; x++) keymap->blocks_buf[b].keys[m][y][x] = RC_INVALID;
+      }
+    }
+  }
+
+  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
+
+  keymap->blocks_cnt = 0;
+
+  int line_num = 0;
+
+  while (map->pos < map->len)
+  {
+    const u64 line_pos = map->pos;
+
+    int line_len;
+
+    const wchar_t *line_buf = map_getl (map, tmp, BUFSIZ, &line_len);
+
+    if ((line_buf != NULL) && (line_len == 0) && (keymap->blocks_cnt)) continue;
+
+    const int is_block = (line_buf != NULL) && (wcsncmp (line_buf, L"block ", 6) == 0);
+
+    if ((is_block == 0) && (keymap->blocks_cnt == 0))
+    {
+      // original format, the line is read again as the first row
+
+      map->pos = line_pos;
+
+      if (map_lines (map) != MOD_CNT * KEYMAP_LEGACY_ROWS)
+      {
+        fprintf (stderr, "Invalid keymap, not exactly %d lines\n", MOD_CNT * KEYMAP_LEGACY_ROWS);
+
+        free (tmp);
+
+        return RC_INVALID;
+      }
+
+      keymap->blocks_buf[0].rows = KEYMAP_LEGACY_ROWS;
+
+      const int rc = parse_keymap_block (map, tmp, keymap->blocks_buf, &line_num);
+
+      if (rc == RC_OK) keymap->blocks_cnt = 1;
+
+      free (tmp);
+
+      return rc;
+    }
+
+    line_num++;
+
+    // NAME is a single word, ROWS the rest of the line
+
+    const wchar_t *rows_buf = (is_block) ? wcschr (line_buf + 6, L' ') : NULL;
+
+    const long rows = (rows_buf) ? wcstol (rows_buf, NULL, 10) : 0;
+
+    if ((is_block == 0) || (rows < 1) || (rows > KEYMAP_HEIGHT_MAX) || (keymap->blocks_cnt == KEYMAP_BLOCKS_MAX))
+    {
+      fprintf (stderr, "Invalid keymap block in line %d, expected \"block NAME ROWS\" with 1 to %d rows and at most %d blocks\n", line_num, KEYMAP_HEIGHT_MAX, KEYMAP_BLOCKS_MAX);
+
+      free (tmp);
+
+      return RC_INVALID;
+    }
+
+    block_t *block = keymap->blocks_buf + keymap->blocks_cnt;
+
+    block->rows = (int) rows;
+
+    if (parse_keymap_block (map, tmp, block, &line_num) == RC_INVALID)
+    {
+      free (tmp);
+
+      return RC_INVALID;
+    }
+
+    keymap->blocks_cnt++;
+  }
+
+  free (tmp);
+
+  if (keymap->blocks_cnt == 0)
+  {
+    fprintf (stderr, "Invalid keymap, no keys\n");
+
+    return RC_INVALID;
+  }
+
+  return RC_OK;
+}
+
+static int key_hash (const wchar_t c)
+{
+  return (int) (((uint32_t) c * 0x9e3779b1u) >> (32 - KEYS_HASH_BITS));
+}
+
+static int key_to_id (const walk_t *walk, const wchar_t c)
+{
+  // KEYS_HASH_SIZE is more than twice KEYS_MAX, there is always a free slot to stop at
+
+  for (int slot = key_hash (c); walk->keys_hash[slot] != RC_INVALID; slot = (slot + 1) & (KEYS_HASH_SIZE - 1))
+  {
+    const int id = walk->keys_hash[slot];
+
+    if (walk->keys_buf[id] == c) return id;
+  }
+
+  return RC_INVALID;
+}
+
+// blocks are inserted in order, so the hash leads to the key of the first block and keys_twin on to the later ones.
+// RC_INVALID once KEYS_MAX keys are taken
+
+static int key_insert (walk_t *walk, const wchar_t c, const int block)
+{
+  int slot = key_hash (c);
+
+  for (; walk->keys_hash[slot] != RC_INVALID; slot = (slot + 1) & (KEYS_HASH_SIZE - 1))
+  {
+    int id = walk->keys_hash[slot];
+
+    if (walk->keys_buf[id] != c) continue;
+
+    while ((walk->keys_co[id].block != block) && (walk->keys_twin[id] != RC_INVALID)) id = walk->keys_twin[id];
+
+    if (walk->keys_co[id].block == block) return id;
+
+    if (walk->keys_cnt == KEYS_MAX) return RC_INVALID;
+
+    walk->keys_twin[id] = walk->keys_cnt;
+
+    break;
+  }
+
+  if (walk->keys_cnt == KEYS_MAX) return RC_INVALID;
+
+  const int id = walk->keys_cnt++;
+
+  walk->keys_buf[id]      = c;
+  walk->keys_co[id].block = block;
+  walk->keys_twin[id]     = RC_INVALID;
+
+  if (walk->keys_hash[slot] == RC_INVALID) walk->keys_hash[slot] = id;
+
+  return id;
+}
+
+// key of c on the nth block that has it, counting starts over after the last one
+
+static int key_nth (const walk_t *walk, const wchar_t c, const int nth)
+{
+  const int first = key_to_id (walk, c);
+
+  int id = first;
+
+  for (int i = 0; (i < nth) && (id != RC_INVALID); i++) id = (walk->keys_twin[id] == RC_INVALID) ? first : walk->keys_twin[id];
+
+  return id;
+}
+
+// the line is kept as it is, filter_basechars() picks the characters for a keymap
+
+static int parse_basechars_file (map_t *map, wchar_t *line_buf, int *line_len)
+{
+  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
+
+  int len;
+
+  const wchar_t *buf = map_getl (map, tmp, BUFSIZ, &len);
+
+  if ((buf == NULL) || (len < 1) || (len > BASECHARS_MAX - 1))
+  {
+    free (tmp);
+
+    return RC_INVALID;
+  }
+
+  memcpy (line_buf, buf, len * sizeof (wchar_t));
+
+  *line_len = len;
+
+  free (tmp);
+
+  return RC_OK;
+}
+
+static void filter_basechars (const walk_t *walk, const wchar_t *line_buf, const int line_len, wchar_t *basechars_buf, int *basechars_cnt, const int user_mod_basic, const int user_mod_shift, const int user_mod_altgr)
+{
+  int basechars_tmp = 0;
+
+  for (int line_pos = 0; line_pos < line_len; line_pos++)
+  {
+    wchar_t c = line_buf[line_pos];
+
+    // a character counts as basic, shift and altgr up to the keymap it is found on, one off the keymap counts as all
+
+    const int id = key_to_id (walk, c);
+
+    const int level = (id == RC_INVALID) ? MOD_CNT : walk->keys_level[id];
+
+    const int is_basic = 1;
+    const int is_shift = (level >= 1);
+    const int is_altgr = (level >= 2);
+
+    if ((user_mod_basic == 0) && (is_basic == 1)) continue;
+    if ((user_mod_shift == 0) && (is_shift == 1)) continue;
+    if ((user_mod_altgr == 0) && (is_altgr == 1)) continue;
+
+    char enc[ENC_MAX];
+
+    if (encode_chr (walk->encoding, c, enc) == RC_INVALID) continue;
+
+    // a character on several blocks starts a walk on each of them, setup_basechars() hands the copies the blocks in order
+
+    int blocks = 1;
+
+    for (int twin = (id == RC_INVALID) ? RC_INVALID : walk->keys_twin[id]; twin != RC_INVALID; twin = walk->keys_twin[twin]) blocks++;
+
+    for (int i = 0; i < blocks; i++)
+    {
+      basechars_buf[basechars_tmp] = c;
+
+      basechars_tmp++;
+    }
+  }
+
+  *basechars_cnt = basechars_tmp;
+}
+
+// single pass, routes_buf grows as lines come in
+
+static int parse_routes_file (map_t *map, route_t **routes_buf)
+{
+  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
+
+  int routes_cnt  = 0;
+  int routes_size = 0;
+
+  while (map->pos < map->len)
+  {
+    int line_len;
+
+    wchar_t *line_buf = map_getl (map, tmp, BUFSIZ, &line_len);
+
+    if (line_buf == NULL) continue;
+
+    if (line_len < ROUTE_LENGTH_MIN) continue;
+    if (line_len > ROUTE_LENGTH_MAX) continue;
+
+    if (routes_cnt == routes_size)
+    {
+      routes_size = (routes_size) ? routes_size * 2 : ROUTES_ALLOC;
+
+      *routes_buf = (route_t *) realloc (*routes_buf, routes_size * sizeof (route_t));
+    }
+
+    route_t *route = *routes_buf + routes_cnt;
+
+    memset (route, 0, sizeof (route_t));
+
+    for (int line_pos = 0; line_pos < line_len; line_pos++)
+    {
+      wchar_t c = line_buf[line_pos];
+
+      const int repeat = hex_convert (c);
+
+      if (repeat < ROUTE_REPEAT_MIN) continue;
+      if (repeat > ROUTE_REPEAT_MAX) continue;
+
+      route->repeat[route->changes] = repeat;
+
+      route->changes++;
+    }
+
+    routes_cnt++;
+  }
+
+  free (tmp);
+
+  return routes_cnt;
+}
+
+// a route always makes candidates of 1 + the sum of its repeats keys, routes outside of the policy length are dropped.
+// a length of 0 is no limit
+
+static int filter_routes (route_t *routes_buf, const int routes_cnt, const int len_min, const int len_max)
+{
+  int cnt = 0;
+
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+  {
+    const route_t *route_buf = routes_buf + routes_pos;
+
+    int len = 1;
+
+    for (int route_pos = 0; route_pos < route_buf->changes; route_pos++) len += route_buf->repeat[route_pos];
+
+    if ((len_min) && (len < len_min)) continue;
+    if ((len_max) && (len > len_max)) continue;
+
+    routes_buf[cnt++] = *route_buf;
+  }
+
+  return cnt;
+}
+
+static void keyset_set (keyset_t *keyset, const int id)
+{
+  keyset->bits[id / 64] |= 1ull << (id % 64);
+}
+
+static int keyset_test (const keyset_t *keyset, const int id)
+{
+  return (keyset->bits[id / 64] >> (id % 64)) & 1;
+}
+
+static int keyset_empty (const keyset_t *keyset)
+{
+  for (int i = 0; i < KEYSET_WORDS; i++)
+  {
+    if (keyset->bits[i]) return 0;
+  }
+
+  return 1;
+}
+
+// one bitboard row has a bit per column. the neighbours at (dx, dy) * dist of all keys of a row are a single shift of
+// the row they land on, keys moved off the block or onto an empty cell are simply gone
+
+static u64 bitboard_shift (const u64 row, const int dx)
+{
+  if ((dx >= KEYMAP_WIDTH_MAX) || (dx <= -KEYMAP_WIDTH_MAX)) return 0;
+
+  return (dx >= 0) ? row >> dx : row << -dx;
+}
+
+static int setup_walk (walk_t *walk, const keymap_t *keymap, const int user_mod_basic, const int user_mod_shift, const int user_mod_altgr, const int user_dir_south_west, const int user_dir_south, const int user_dir_south_east, const int user_dir_west, const int user_dir_repeat, const int user_dir_east, const int user_dir_north_west, const int user_dir_north, const int user_dir_north_east, const int user_dist_min, const int user_dist_max, const int encoding)
+{
+  static const int dirs_dx[DIR_CNT] = { -1,  0,  1, -1,  0,  1, -1,  0,  1 };
+  static const int dirs_dy[DIR_CNT] = {  1,  1,  1,  0,  0,  0, -1, -1, -1 };
+
+  const int user_mods[MOD_CNT] = { user_mod_basic, user_mod_shift, user_mod_altgr };
+  const int user_dirs[DIR_CNT] = { user_dir_south_west, user_dir_south, user_dir_south_east, user_dir_west, user_dir_repeat, user_dir_east, user_dir_north_west, user_dir_north, user_dir_north_east };
+
+  // every distinct character of a block becomes a key. blocks are scanned column by column, a character found twice
+  // keeps its first position, just like the per-character lookup that used to fill the 65536 entry table. the same pass
+  // records the id sitting on each cell and sets its bit in the row of the bitboard
+
+  int (*cells)[MOD_CNT][KEYMAP_HEIGHT_MAX][KEYMAP_WIDTH_MAX] = (int (*)[MOD_CNT][KEYMAP_HEIGHT_MAX][KEYMAP_WIDTH_MAX]) malloc (keymap->blocks_cnt * sizeof (*cells));
+
+  u64 (*rows)[MOD_CNT][KEYMAP_HEIGHT_MAX] = (u64 (*)[MOD_CNT][KEYMAP_HEIGHT_MAX]) calloc (keymap->blocks_cnt, sizeof (*rows));
+
+  walk->keys_cnt = 0;
+
+  walk->encoding = encoding;
+
+  walk->eol_enc_len = encode_chr (encoding, L'\n', walk->eol_enc);
+
+  for (int slot = 0; slot < KEYS_HASH_SIZE; slot++) walk->keys_hash[slot] = RC_INVALID;
+
+  for (int b = 0; b < keymap->blocks_cnt; b++)
+  {
+    const block_t *block = keymap->blocks_buf + b;
+
+    for (int m = 0; m < MOD_CNT; m++)
+    {
+      for (int x = 0; x < KEYMAP_WIDTH_MAX; x++)
+      {
+        for (int y = 0; y < KEYMAP_HEIGHT_MAX; y++)
+        {
+          const wchar_t c = block->keys[m][y][x];
+
+          cells[b][m][y][x] = RC_INVALID;
+
+          if (c == RC_INVALID) continue;
+
+          const int keys_cnt = walk->keys_cnt;
+
+          const int id = key_insert (walk, c, b);
+
+          if (id == RC_INVALID)
+          {
+            free (cells);
+            free (rows);
+
+            return RC_INVALID;
+          }
+
+          if (id == keys_cnt)
+          {
+            walk->keys_co[id].x     = x;
+            walk->keys_co[id].y     = y;
+            walk->keys_level[id]    = m;
+            walk->keys_enc_len[id]  = encode_chr (encoding, c, walk->keys_enc[id]);
+          }
+
+          if (walk->keys_enc_len[id] == RC_INVALID) continue;
+
+          cells[b][m][y][x] = id;
+
+          rows[b][m][y] |= 1ull << x;
+        }
+      }
+    }
+  }
+
+  const int dist_cnt = 1 + (user_dist_max - user_dist_min);
+
+  int mods_buf[MOD_CNT];
+  int dirs_buf[DIR_CNT];
+
+  int mod_cnt = 0;
+  int dir_cnt = 0;
+
+  for (int m = 0; m < MOD_CNT; m++) if (user_mods[m] == 1) mods_buf[mod_cnt++] = m;
+  for (int d = 0; d < DIR_CNT; d++) if (user_dirs[d] == 1) dirs_buf[dir_cnt++] = d;
+
+  // same selection index decoding as the original mixed-radix loop: distance first, then modifier, then direction
+
+  walk->sel_cnt = dist_cnt * mod_cnt * dir_cnt;
+
+  walk->next_buf = (int *) malloc (walk->keys_cnt * walk->sel_cnt * sizeof (int));
+
+  // adjacency of one distance, bit x of row y is set if the key at x, y has a neighbour in that direction and keymap
+
+  u64 (*adj)[MOD_CNT][DIR_CNT][KEYMAP_HEIGHT_MAX] = (u64 (*)[MOD_CNT][DIR_CNT][KEYMAP_HEIGHT_MAX]) calloc (keymap->blocks_cnt, sizeof (*adj));
+
+  for (int dist_pos = 0; dist_pos < dist_cnt; dist_pos++)
+  {
+    const int user_dist = user_dist_min + dist_pos;
+
+    for (int b = 0; b < keymap->blocks_cnt; b++)
+    {
+      for (int mod_pos = 0; mod_pos < mod_cnt; mod_pos++)
+      {
+        const int m = mods_buf[mod_pos];
+
+        for (int dir_pos = 0; dir_pos < dir_cnt; dir_pos++)
+        {
+          const int d = dirs_buf[dir_pos];
+
+          for (int y = 0; y < KEYMAP_HEIGHT_MAX; y++)
+          {
+            const int to_y = y + (dirs_dy[d] * user_dist);
+
+            const u64 to_row = ((to_y >= 0) && (to_y < KEYMAP_HEIGHT_MAX)) ? rows[b][m][to_y] : 0;
+
+            adj[b][m][d][y] = bitboard_shift (to_row, dirs_dx[d] * user_dist);
+          }
+        }
+      }
+    }
+
+    for (int id = 0; id < walk->keys_cnt; id++)
+    {
+      int *next = walk->next_buf + (id * walk->sel_cnt);
+
+      const co_t *co = walk->keys_co + id;
+
+      for (int mod_pos = 0; mod_pos < mod_cnt; mod_pos++)
+      {
+        const int m = mods_buf[mod_pos];
+
+        for (int dir_pos = 0; dir_pos < dir_cnt; dir_pos++)
+        {
+          const int d = dirs_buf[dir_pos];
+
+          const int sel = dist_pos + (dist_cnt * (mod_pos + (mod_cnt * dir_pos)));
+
+          if (((adj[co->block][m][d][co->y] >> co->x) & 1) == 0)
+          {
+            next[sel] = RC_INVALID;
+
+            continue;
+          }
+
+          next[sel] = cells[co->block][m][co->y + (dirs_dy[d] * user_dist)][co->x + (dirs_dx[d] * user_dist)];
+        }
+      }
+    }
+  }
+
+  free (adj);
+  free (rows);
+  free (cells);
+
+  walk->ends_buf = (int *) malloc (ROUTE_REPEAT_MAX * walk->keys_cnt * walk->sel_cnt * sizeof (int));
+
+  memcpy (walk->ends_buf, walk->next_buf, walk->keys_cnt * walk->sel_cnt * sizeof (int));
+
+  for (int repeat = 2; repeat <= ROUTE_REPEAT_MAX; repeat++)
+  {
+    const int *prev = walk->ends_buf + ((repeat - 2) * walk->keys_cnt * walk->sel_cnt);
+    int       *ends = walk->ends_buf + ((repeat - 1) * walk->keys_cnt * walk->sel_cnt);
+
+    for (int id = 0; id < walk->keys_cnt; id++)
+    {
+      for (int sel = 0; sel < walk->sel_cnt; sel++)
+      {
+        const int end = prev[(id * walk->sel_cnt) + sel];
+
+        ends[(id * walk->sel_cnt) + sel] = (end == RC_INVALID) ? RC_INVALID : walk->next_buf[(end * walk->sel_cnt) + sel];
+      }
+    }
+  }
+
+  walk->segs_repeat       = 0;
+  walk->segs_size         = 0;
+  walk->steps_cnt         = NULL;
+  walk->steps_sel         = NULL;
+  walk->segs_buf          = NULL;
+  walk->segs_len          = NULL;
+
+  walk->basechars_cnt     = 0;
+  walk->basechars_ids     = NULL;
+  walk->basechars_enc     = NULL;
+  walk->basechars_enc_len = NULL;
+
+  return RC_OK;
+}
+
+static void setup_basechars (walk_t *walk, const wchar_t *basechars_buf, const int basechars_cnt)
+{
+  walk->basechars_cnt     = basechars_cnt;
+  walk->basechars_ids     = (int *) malloc (basechars_cnt * sizeof (int));
+  walk->basechars_enc     = (char (*)[ENC_MAX]) malloc (basechars_cnt * ENC_MAX);
+  walk->basechars_enc_len = (int *) malloc (basechars_cnt * sizeof (int));
+
+  for (int i = 0, nth = 0; i < basechars_cnt; i++)
+  {
+    nth = ((i) && (basechars_buf[i] == basechars_buf[i - 1])) ? nth + 1 : 0;
+
+    walk->basechars_ids[i]     = key_nth (walk, basechars_buf[i], nth);
+    walk->basechars_enc_len[i] = encode_chr (walk->encoding, basechars_buf[i], walk->basechars_enc[i]);
+  }
+}
+
+static const int *walk_ends (const walk_t *walk, const int repeat)
+{
+  return walk->ends_buf + ((repeat - 1) * walk->keys_cnt * walk->sel_cnt);
+}
+
+static void setup_segments (walk_t *walk, const route_t *routes_buf, const int routes_cnt)
+{
+  int segs_repeat = 1;
+
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+  {
+    for (int route_pos = 0; route_pos < routes_buf[routes_pos].changes; route_pos++)
+    {
+      if (routes_buf[routes_pos].repeat[route_pos] > segs_repeat) segs_repeat = routes_buf[routes_pos].repeat[route_pos];
+    }
+  }
+
+  const int segs_cnt = walk->keys_cnt * walk->sel_cnt;
+
+  const int segs_size = (((segs_repeat * ENC_MAX) + SEG_COPY - 1) / SEG_COPY) * SEG_COPY;
+
+  walk->segs_repeat = segs_repeat;
+  walk->segs_size   = segs_size;
+  walk->segs_buf    = (char *) calloc (segs_cnt, segs_size);
+  walk->segs_len    = (u8 *)   calloc (segs_cnt * segs_repeat, sizeof (u8));
+
+  for (int seg = 0; seg < segs_cnt; seg++)
+  {
+    char *seg_buf = walk->segs_buf + (seg * segs_size);
+    u8   *seg_len = walk->segs_len + (seg * segs_repeat);
+
+    const int sel = seg % walk->sel_cnt;
+
+    int id  = seg / walk->sel_cnt;
+    int len = 0;
+
+    for (int r = 0; r < segs_repeat; r++)
+    {
+      id = walk->next_buf[(id * walk->sel_cnt) + sel];
+
+      if (id == RC_INVALID) break;
+
+      memcpy (seg_buf + len, walk->keys_enc[id], walk->keys_enc_len[id]);
+
+      len += walk->keys_enc_len[id];
+
+      seg_len[r] = (u8) len;
+    }
+  }
+
+  walk->steps_cnt = (int *) calloc (segs_repeat * walk->keys_cnt,                 sizeof (int));
+  walk->steps_sel = (int *) calloc (segs_repeat * walk->keys_cnt * walk->sel_cnt, sizeof (int));
+
+  for (int repeat = 1; repeat <= segs_repeat; repeat++)
+  {
+    const int *ends = walk_ends (walk, repeat);
+
+    for (int id = 0; id < walk->keys_cnt; id++)
+    {
+      int *steps_cnt = walk->steps_cnt + (((repeat - 1) * walk->keys_cnt) + id);
+      int *steps_sel = walk->steps_sel + (((repeat - 1) * walk->keys_cnt) + id) * walk->sel_cnt;
+
+      for (int sel = 0; sel < walk->sel_cnt; sel++)
+      {
+        if (ends[(id * walk->sel_cnt) + sel] == RC_INVALID) continue;
+
+        steps_sel[(*steps_cnt)++] = sel;
+      }
+    }
+  }
+}
+
+static void free_walk (walk_t *walk)
+{
+  free (walk->next_buf);
+  free (walk->ends_buf);
+  free (walk->segs_buf);
+  free (walk->segs_len);
+  free (walk->steps_cnt);
+  free (walk->steps_sel);
+  free (walk->basechars_ids);
+  free (walk->basechars_enc);
+  free (walk->basechars_enc_len);
+}
+
+// policy
+
+static int policy_class (const wchar_t c)
+{
+  if (iswdigit (c)) return POLICY_DIGIT;
+  if (iswlower (c)) return POLICY_LOWER;
+  if (iswupper (c)) return POLICY_UPPER;
+
+  return POLICY_SPECIAL;
+}
+
+static int policy_bits (const int bits)
+{
+  int cnt = 0;
+
+  for (int i = 0; i < 8; i++) cnt += (bits >> i) & 1;
+
+  return cnt;
+}
+
+static policy_t *policy_init (const walk_t *walk, const wchar_t *basechars_buf, const trie_t *trie, const int classes, const int keyboards, const int run_max)
+{
+  policy_t *policy = (policy_t *) calloc (1, sizeof (policy_t));
+
+  policy->run_max = run_max;
+
+  // one key adds at most one character class and one keymap
+
+  const int required = classes | keyboards;
+
+  for (int mask = 0; mask < POLICY_MASKS; mask++)
+  {
+    const int chars = policy_bits (required & ~mask & POLICY_CHARS);
+    const int mods  = policy_bits (required & ~mask & POLICY_MODS);
+
+    policy->missing_buf[mask] = (chars > mods) ? chars : mods;
+  }
+
+  for (int id = 0; id < walk->keys_cnt; id++)
+  {
+    policy->keys_class[id] = policy_class (walk->keys_buf[id]) | (POLICY_BASIC << walk->keys_level[id]);
+  }
+
+  // a basechar off the keymap has no keymap bit
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const int id = walk->basechars_ids[basechar_pos];
+
+    policy->basechars_class[basechar_pos] = (id == RC_INVALID) ? policy_class (basechars_buf[basechar_pos]) : policy->keys_class[id];
+  }
+
+  const int segs_cnt = walk->keys_cnt * walk->sel_cnt;
+
+  policy->segs_buf = (policy_seg_t *) calloc (segs_cnt * walk->segs_repeat, sizeof (policy_seg_t));
+
+  for (int seg = 0; seg < segs_cnt; seg++)
+  {
+    policy_seg_t *segs = policy->segs_buf + (seg * walk->segs_repeat);
+
+    const int sel   = seg % walk->sel_cnt;
+    const int first = seg / walk->sel_cnt;
+
+    policy_seg_t cur;
+
+    memset (&cur, 0, sizeof (cur));
+
+    cur.same = 1;
+
+    for (int r = 0, prev = first, id = first; r < walk->segs_repeat; r++, prev = id)
+    {
+      id = walk->next_buf[(id * walk->sel_cnt) + sel];
+
+      if (id == RC_INVALID) break;
+
+      cur.classes |= policy->keys_class[id];
+      cur.same    &= (id == first);
+
+      if (cur.same) cur.head++;
+
+      cur.tail = ((r > 0) && (id == prev)) ? cur.tail + 1 : 1;
+
+      if (cur.tail > cur.run) cur.run = cur.tail;
+
+      segs[r] = cur;
+    }
+  }
+
+  // children are always added after their parent
+
+  policy->reach_buf = (int *) calloc (trie->nodes_cnt, sizeof (int));
+
+  for (int node_pos = trie->nodes_cnt - 1; node_pos >= 0; node_pos--)
+  {
+    for (int child_pos = trie->nodes_buf[node_pos].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+    {
+      const int reach = trie->nodes_buf[child_pos].repeat + policy->reach_buf[child_pos];
+
+      if (reach > policy->reach_buf[node_pos]) policy->reach_buf[node_pos] = reach;
+    }
+  }
+
+  return policy;
+}
+
+static void policy_free (policy_t *policy)
+{
+  if (policy == NULL) return;
+
+  free (policy->segs_buf);
+  free (policy->reach_buf);
+
+  free (policy);
+}
+
+static const policy_seg_t *policy_seg (const walk_t *walk, const policy_t *policy, const int seg, const int repeat)
+{
+  return policy->segs_buf + (seg * walk->segs_repeat) + repeat - 1;
+}
+
+// run at the end of the walk after a segment, RC_INVALID if the segment makes a run longer than allowed
+
+static int policy_run (const policy_t *policy, const policy_seg_t *policy_seg, const int repeat, const int run)
+{
+  if (policy->run_max == 0) return 0;
+
+  if (policy_seg->same) return ((run + repeat) > policy->run_max) ? RC_INVALID : run + repeat;
+
+  if ((run + policy_seg->head) > policy->run_max) return RC_INVALID;
+
+  if (policy_seg->run > policy->run_max) return RC_INVALID;
+
+  return policy_seg->tail;
+}
+
+static int policy_route (const gen_t *gen, const int basechar_pos)
+{
+  const walk_t   *walk      = gen->walk;
+  const route_t  *route_buf = gen->route_buf;
+  const policy_t *policy    = gen->out->policy;
+
+  int classes = policy->basechars_class[basechar_pos];
+  int run     = 1;
+
+  int id = walk->basechars_ids[basechar_pos];
+
+  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  {
+    const int repeat = route_buf->repeat[route_pos];
+
+    const int seg = (id * walk->sel_cnt) + gen->sel_buf[route_pos];
+
+    const policy_seg_t *seg_policy = policy_seg (walk, policy, seg, repeat);
+
+    run = policy_run (policy, seg_policy, repeat, run);
+
+    if (run == RC_INVALID) return RC_INVALID;
+
+    classes |= seg_policy->classes;
+
+    id = walk_ends (walk, repeat)[seg];
+  }
+
+  return (policy->missing_buf[classes]) ? RC_INVALID : RC_OK;
+}
+
+static void emit_route (gen_t *gen, const int basechar_pos)
+{
+  const walk_t  *walk      = gen->walk;
+  const route_t *route_buf = gen->route_buf;
+
+  char *pw_buf = gen->out->buf + gen->out->len;
+
+  int pw_len = 0;
+
+  memcpy (pw_buf + pw_len, walk->basechars_enc[basechar_pos], ENC_MAX);
+
+  pw_len += walk->basechars_enc_len[basechar_pos];
+
+  int id = walk->basechars_ids[basechar_pos];
+
+  // route order has no shared prefixes to cut, every candidate is checked on its own
+
+  if ((gen->out->policy) && (policy_route (gen, basechar_pos) == RC_INVALID))
+  {
+    out_reject (gen->out, 1);
+
+    return;
+  }
+
+  // the keyset pruning only lets walks through that stay on the keymap, each segment is a single copy
+
+  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  {
+    const int repeat = route_buf->repeat[route_pos];
+
+    const int seg = (id * walk->sel_cnt) + gen->sel_buf[route_pos];
+
+    const int seg_len = walk->segs_len[(seg * walk->segs_repeat) + repeat - 1];
+
+    const char *seg_buf = walk->segs_buf + (seg * walk->segs_size);
+
+    for (int i = 0; i < seg_len; i += SEG_COPY)
+    {
+      memcpy (pw_buf + pw_len + i, seg_buf + i, SEG_COPY);
+    }
+
+    pw_len += seg_len;
+
+    id = walk_ends (walk, repeat)[seg];
+  }
+
+  memcpy (pw_buf + pw_len, walk->eol_enc, ENC_MAX);
+
+  pw_len += walk->eol_enc_len;
+
+  out_push (gen->out, pw_len);
+}
+
+// the original generator enumerated k = basechar + basechars_cnt * (sel_0 + sel_cnt * (sel_1 + ...)) and rejected
+// invalid k afterwards. to keep exactly that order we fix the selections from the most significant one (the last
+// direction change) downwards and carry the set of keys from which the already fixed tail of the route can be
+// walked. as soon as that set is empty the whole subtree is cut, without looking at a single basechar.
+
+static int process_route_level (gen_t *gen, const int route_pos, const keyset_t *tail, const int sel_start, const int sel_stop)
+{
+  const walk_t  *walk      = gen->walk;
+  const route_t *route_buf = gen->route_buf;
+
+  const int repeat = route_buf->repeat[route_pos];
+
+  const int *ends = walk_ends (walk, repeat);
+
+  const int prev_sel = (route_pos + 1 < route_buf->changes) ? gen->sel_buf[route_pos + 1] : RC_INVALID;
+
+  const int sel_first = (gen->resume) ? gen->resume_pos.sel_buf[route_pos] : sel_start;
+
+  for (int sel = sel_first; sel < sel_stop; sel++)
+  {
+    if (sel == prev_sel) continue;
+
+    gen->sel_buf[route_pos] = sel;
+
+    if (route_pos == 0)
+    {
+      int basechar_first = 0;
+
+      if (gen->resume)
+      {
+        basechar_first = gen->resume_pos.basechar_pos;
+
+        gen->resume = 0;
+      }
+
+      for (int basechar_pos = basechar_first; basechar_pos < walk->basechars_cnt; basechar_pos++)
+      {
+        const int id = walk->basechars_ids[basechar_pos];
+
+        if (id == RC_INVALID) continue;
+
+        const int end = ends[(id * walk->sel_cnt) + sel];
+
+        if (end == RC_INVALID) continue;
+
+        if ((tail != NULL) && (keyset_test (tail, end) == 0)) continue;
+
+        if (gen->left == 0) return RC_LIMIT;
+
+        gen->left--;
+
+        emit_route (gen, basechar_pos);
+      }
+
+      continue;
+    }
+
+    keyset_t head;
+
+    memset (&head, 0, sizeof (head));
+
+    for (int id = 0; id < walk->keys_cnt; id++)
+    {
+      const int end = ends[(id * walk->sel_cnt) + sel];
+
+      if (end == RC_INVALID) continue;
+
+      if ((tail != NULL) && (keyset_test (tail, end) == 0)) continue;
+
+      keyset_set (&head, id);
+    }
+
+    if (keyset_empty (&head))
+    {
+      gen->resume = 0;
+
+      continue;
+    }
+
+    if (process_route_level (gen, route_pos - 1, &head, 0, walk->sel_cnt) == RC_LIMIT) return RC_LIMIT;
+  }
+
+  return RC_OK;
+}
+
+static int route_parts (const walk_t *walk, const route_t *route_buf)
+{
+  if (route_buf->changes == 0) return 1;
+
+  return walk->sel_cnt;
+}
+
+// a part is everything below one selection of the last direction change, parts of a route are contiguous in the output
+
+static int process_route_part (gen_t *gen, const int sel)
+{
+  const walk_t  *walk      = gen->walk;
+  const route_t *route_buf = gen->route_buf;
+
+  if (route_buf->changes == 0)
+  {
+    int basechar_first = 0;
+
+    if (gen->resume)
+    {
+      basechar_first = gen->resume_pos.basechar_pos;
+
+      gen->resume = 0;
+    }
+
+    for (int basechar_pos = basechar_first; basechar_pos < walk->basechars_cnt; basechar_pos++)
+    {
+      if (gen->left == 0) return RC_LIMIT;
+
+      gen->left--;
+
+      emit_route (gen, basechar_pos);
+    }
+
+    return RC_OK;
+  }
+
+  return process_route_level (gen, route_buf->changes - 1, NULL, sel, sel + 1);
+}
+
+static int process_route (gen_t *gen)
+{
+  const int parts = route_parts (gen->walk, gen->route_buf);
+
+  const int sel_first = (gen->resume) ? gen->resume_pos.sel_buf[gen->route_buf->changes - 1] : 0;
+
+  for (int sel = sel_first; sel < parts; sel++)
+  {
+    if (process_route_part (gen, sel) == RC_LIMIT) return RC_LIMIT;
+  }
+
+  return RC_OK;
+}
+
+static void process_routes (const walk_t *walk, const route_t *routes_buf, const int routes_cnt, const pos_t *start, const u64 limit, out_t *out)
+{
+  gen_t gen;
+
+  gen.walk   = walk;
+  gen.out    = out;
+  gen.resume = 0;
+  gen.left   = limit;
+
+  out->left = &gen.left;
+
+  int routes_first = 0;
+
+  if (start)
+  {
+    gen.resume     = 1;
+    gen.resume_pos = *start;
+
+    routes_first = start->routes_pos;
+  }
+
+  for (int routes_pos = routes_first; routes_pos < routes_cnt; routes_pos++)
+  {
+    // from here we're going to bf "a route".
+    // there's a total number of "direction changes" (which is like a length for a bf algorithm)
+    // but the real password length is the sum of all repeats of all "direction changes"
+    // anyway, we brute-force all direction types for each change here to produce something like (route 313):
+    // - Iteration 1: "3*North, 1* West, 3*South"
+    // - Iteration 2: "3*North, 1* East, 3*South"
+    // - Iteration N: "3*South-East-Shifted, 1*North, 3*South-East-Alt"
+    // invalid walks are pruned as early as possible, see process_route_level()
+
+    gen.route_buf = routes_buf + routes_pos;
+
+    struct timespec start;
+
+    const u64 cnt   = out->cnt;
+    const u64 bytes = out->generated + out->len;
+
+    if (out->route_stats) clock_gettime (CLOCK_MONOTONIC, &start);
+
+    const int rc = process_route (&gen);
+
+    if (out->route_stats) out_route_stats (out, out->route_stats + routes_pos, cnt, bytes, &start);
+
+    if (rc == RC_LIMIT) break;
+  }
+
+  out->left = NULL;
+}
+
+// routes sharing leading direction changes share a trie path, every partial walk is extended into all routes that
+// continue it. candidates come out grouped by basechar and prefix instead of by route, the set stays the same
+
+static void setup_trie (trie_t *trie, const route_t *routes_buf, const int routes_cnt)
+{
+  int nodes_max = 1;
+
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++) nodes_max += routes_buf[routes_pos].changes;
+
+  trie->nodes_buf = (node_t *) malloc (nodes_max * sizeof (node_t));
+  trie->nodes_cnt = 1;
+  trie->leaf_buf  = (int *) malloc (routes_cnt * sizeof (int));
+
+  trie->nodes_buf[0].repeat  = 0;
+  trie->nodes_buf[0].routes  = 0;
+  trie->nodes_buf[0].child   = RC_INVALID;
+  trie->nodes_buf[0].sibling = RC_INVALID;
+
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+  {
+    const route_t *route_buf = routes_buf + routes_pos;
+
+    int node_pos = 0;
+
+    for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+    {
+      const int repeat = route_buf->repeat[route_pos];
+
+      // children keep the order their routes appear in
+
+      int *link = &trie->nodes_buf[node_pos].child;
+
+      while ((*link != RC_INVALID) && (trie->nodes_buf[*link].repeat != repeat)) link = &trie->nodes_buf[*link].sibling;
+
+      if (*link == RC_INVALID)
+      {
+        node_t *node = trie->nodes_buf + trie->nodes_cnt;
+
+        node->repeat  = repeat;
+        node->routes  = 0;
+        node->child   = RC_INVALID;
+        node->sibling = RC_INVALID;
+
+        *link = trie->nodes_cnt++;
+      }
+
+      node_pos = *link;
+    }
+
+    trie->nodes_buf[node_pos].routes++;
+
+    trie->leaf_buf[routes_pos] = node_pos;
+  }
+}
+
+static void free_trie (trie_t *trie)
+{
+  free (trie->nodes_buf);
+  free (trie->leaf_buf);
+}
+
+static void emit_trie (gen_t *gen, const char *pw_buf, const int pw_len)
+{
+  const walk_t *walk = gen->walk;
+
+  char *buf = gen->out->buf + gen->out->len;
+
+  for (int i = 0; i < pw_len; i += SEG_COPY)
+  {
+    memcpy (buf + i, pw_buf + i, SEG_COPY);
+  }
+
+  memcpy (buf + pw_len, walk->eol_enc, ENC_MAX);
+
+  out_push (gen->out, pw_len + walk->eol_enc_len);
+}
+
+static int emit_trie_node (gen_t *gen, const node_t *node, const char *pw_buf, const int pw_len)
+{
+  for (int i = 0; i < node->routes; i++)
+  {
+    if (gen->left == 0) return RC_LIMIT;
+
+    if (gen->skip)
+    {
+      gen->skip--;
+
+      continue;
+    }
+
+    gen->left--;
+
+    emit_trie (gen, pw_buf, pw_len);
+  }
+
+  return RC_OK;
+}
+
+// generation kernel, a depth first walk below one node that only visits the selections staying on the keymap. it is
+// instantiated with the selection count as a compile time constant for the common flag combinations, which turns the
+// index arithmetic into shifts and adds. anything else runs the instance reading walk->sel_cnt
+
+#define TRIE_KERNEL(name,SEL_CNT)                                                                                   \
+static int name (gen_t *gen, const trie_t *trie, const int node_pos, const int id, const int prev_sel, char *pw_buf, const int pw_len) \
+{                                                                                                                   \
+  const walk_t *walk = gen->walk;                                                                                   \
+                                                                                                                    \
+  const node_t *node = trie->nodes_buf + node_pos;                                                                  \
+                                                                                                                    \
+  if (emit_trie_node (gen, node, pw_buf, pw_len) == RC_LIMIT) return RC_LIMIT;                                      \
+                                                                                                                    \
+  for (int child_pos = node->child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)        \
+  {                                                                                                                 \
+    const int repeat = trie->nodes_buf[child_pos].repeat;                                                           \
+                                                                                                                    \
+    const int *ends = walk_ends (walk, repeat);                                                                     \
+                                                                                                                    \
+    const int steps = ((repeat - 1) * walk->keys_cnt) + id;                                                         \
+                                                                                                                    \
+    const int  steps_cnt = walk->steps_cnt[steps];                                                                  \
+    const int *steps_sel = walk->steps_sel + (steps * (SEL_CNT));                                                   \
+                                                                                                                    \
+    for (int steps_pos = 0; steps_pos < steps_cnt; steps_pos++)                                                     \
+    {                                                                                                               \
+      const int sel = steps_sel[steps_pos];                                                                         \
+                                                                                                                    \
+      if (sel == prev_sel) continue;                                                                                \
+                                                                                                                    \
+      const int seg = (id * (SEL_CNT)) + sel;                                                                       \
+                                                                                                                    \
+      const int seg_len = walk->segs_len[(seg * walk->segs_repeat) + repeat - 1];                                   \
+                                                                                                                    \
+      const char *seg_buf = walk->segs_buf + (seg * walk->segs_size);                                               \
+                                                                                                                    \
+      for (int i = 0; i < seg_len; i += SEG_COPY)                                                                   \
+      {                                                                                                             \
+        memcpy (pw_buf + pw_len + i, seg_buf + i, SEG_COPY);                                                        \
+      }                                                                                                             \
+                                                                                                                    \
+      if (name (gen, trie, child_pos, ends[seg], sel, pw_buf, pw_len + seg_len) == RC_LIMIT) return RC_LIMIT;       \
+    }                                                                                                               \
+  }                                                                                                                 \
+                                                                                                                    \
+  return RC_OK;                                                                                                     \
+}
+
+TRIE_KERNEL (process_trie_4,   4)   // default directions
+TRIE_KERNEL (process_trie_7,   7)   // -c
+TRIE_KERNEL (process_trie_9,   9)   // -0
+TRIE_KERNEL (process_trie_12, 12)   // -z
+TRIE_KERNEL (process_trie_21, 21)   // -z -c
+TRIE_KERNEL (process_trie_27, 27)   // -z -0
+TRIE_KERNEL (process_trie_n,  walk->sel_cnt)
+
+static int process_trie_node (gen_t *gen, const trie_t *trie, const int node_pos, const int id, const int prev_sel, char *pw_buf, const int pw_len)
+{
+  switch (gen->walk->sel_cnt)
+  {
+    case  4: return process_trie_4  (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+    case  7: return process_trie_7  (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+    case  9: return process_trie_9  (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+    case 12: return process_trie_12 (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+    case 21: return process_trie_21 (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+    case 27: return process_trie_27 (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+  }
+
+  return process_trie_n (gen, trie, node_pos, id, prev_sel, pw_buf, pw_len);
+}
+
+// candidates below a node reached on key id, walked without writing anything. leaves only add up their steps
+
+static u64 count_trie_below (const walk_t *walk, const trie_t *trie, const int node_pos, const int id, const int prev_sel)
+{
+  const node_t *node = trie->nodes_buf + node_pos;
+
+  u64 cnt = node->routes;
+
+  for (int child_pos = node->child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    const node_t *child = trie->nodes_buf + child_pos;
+
+    const int *ends = walk_ends (walk, child->repeat);
+
+    const int steps = ((child->repeat - 1) * walk->keys_cnt) + id;
+
+    const int  steps_cnt = walk->steps_cnt[steps];
+    const int *steps_sel = walk->steps_sel + (steps * walk->sel_cnt);
+
+    if (child->child == RC_INVALID)
+    {
+      const int prev_step = (prev_sel != RC_INVALID) && (ends[(id * walk->sel_cnt) + prev_sel] != RC_INVALID);
+
+      cnt += (u64) (steps_cnt - prev_step) * child->routes;
+
+      continue;
+    }
+
+    for (int steps_pos = 0; steps_pos < steps_cnt; steps_pos++)
+    {
+      const int sel = steps_sel[steps_pos];
+
+      if (sel == prev_sel) continue;
+
+      cnt += count_trie_below (walk, trie, child_pos, ends[(id * walk->sel_cnt) + sel], sel);
+    }
+  }
+
+  return cnt;
+}
+
+// cnt candidates that break the policy, they take their share of the resume skip and of the budget like written ones
+
+static int reject_trie (gen_t *gen, u64 cnt)
+{
+  const u64 skip = (gen->skip < cnt) ? gen->skip : cnt;
+
+  gen->skip -= skip;
+
+  cnt -= skip;
+
+  if (cnt > gen->left) cnt = gen->left;
+
+  gen->left -= cnt;
+
+  out_reject (gen->out, cnt);
+
+  return (gen->left == 0) ? RC_LIMIT : RC_OK;
+}
+
+// the kernel with a policy, it carries the classes and the run of the walk so far. a node is cut as soon as the keys
+// below it can not add the missing classes anymore, a segment as soon as it makes a run too long
+
+static int process_trie_policy (gen_t *gen, const trie_t *trie, const int node_pos, const int id, const int prev_sel, char *pw_buf, const int pw_len, const int classes, const int run)
+{
+  const walk_t   *walk   = gen->walk;
+  const policy_t *policy = gen->out->policy;
+
+  const node_t *node = trie->nodes_buf + node_pos;
+
+  const int missing = policy->missing_buf[classes];
+
+  if (missing > policy->reach_buf[node_pos]) return reject_trie (gen, count_trie_below (walk, trie, node_pos, id, prev_sel));
+
+  if (missing)
+  {
+    if (reject_trie (gen, node->routes) == RC_LIMIT) return RC_LIMIT;
+  }
+  else
+  {
+    if (emit_trie_node (gen, node, pw_buf, pw_len) == RC_LIMIT) return RC_LIMIT;
+  }
+
+  for (int child_pos = node->child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    const int repeat = trie->nodes_buf[child_pos].repeat;
+
+    const int *ends = walk_ends (walk, repeat);
+
+    const int steps = ((repeat - 1) * walk->keys_cnt) + id;
+
+    const int  steps_cnt = walk->steps_cnt[steps];
+    const int *steps_sel = walk->steps_sel + (steps * walk->sel_cnt);
+
+    for (int steps_pos = 0; steps_pos < steps_cnt; steps_pos++)
+    {
+      const int sel = steps_sel[steps_pos];
+
+      if (sel == prev_sel) continue;
+
+      const int seg = (id * walk->sel_cnt) + sel;
+
+      const policy_seg_t *seg_policy = policy_seg (walk, policy, seg, repeat);
+
+      const int seg_run = policy_run (policy, seg_policy, repeat, run);
+
+      if (seg_run == RC_INVALID)
+      {
+        if (reject_trie (gen, count_trie_below (walk, trie, child_pos, ends[seg], sel)) == RC_LIMIT) return RC_LIMIT;
+
+        continue;
+      }
+
+      const int seg_len = walk->segs_len[(seg * walk->segs_repeat) + repeat - 1];
+
+      const char *seg_buf = walk->segs_buf + (seg * walk->segs_size);
+
+      for (int i = 0; i < seg_len; i += SEG_COPY)
+      {
+        memcpy (pw_buf + pw_len + i, seg_buf + i, SEG_COPY);
+      }
+
+      if (process_trie_policy (gen, trie, child_pos, ends[seg], sel, pw_buf, pw_len + seg_len, classes | seg_policy->classes, seg_run) == RC_LIMIT) return RC_LIMIT;
+    }
+  }
+
+  return RC_OK;
+}
+
+// a part is one basechar with one selection into one child of the root, part 0 are the routes without a direction
+// change. parts of a basechar in order give the same output as walking the whole trie from it
+
+static int trie_parts (const walk_t *walk, const trie_t *trie)
+{
+  int parts = 1;
+
+  for (int child_pos = trie->nodes_buf[0].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    parts += walk->sel_cnt;
+  }
+
+  return parts;
+}
+
+static int process_trie_part (gen_t *gen, const trie_t *trie, const int basechar_pos, const int part)
+{
+  const walk_t *walk = gen->walk;
+
+  // resuming inside this part, the candidates in front of the position are walked but not written
+
+  if (gen->resume)
+  {
+    gen->skip   = gen->resume_pos.part_offset;
+    gen->resume = 0;
+  }
+
+  const int id = walk->basechars_ids[basechar_pos];
+
+  char pw_buf[OUT_RESERVE];
+
+  memcpy (pw_buf, walk->basechars_enc[basechar_pos], ENC_MAX);
+
+  const int pw_len = walk->basechars_enc_len[basechar_pos];
+
+  const policy_t *policy = gen->out->policy;
+
+  if (part == 0)
+  {
+    if ((policy) && (policy->missing_buf[policy->basechars_class[basechar_pos]])) return reject_trie (gen, trie->nodes_buf[0].routes);
+
+    return emit_trie_node (gen, trie->nodes_buf, pw_buf, pw_len);
+  }
+
+  if (id == RC_INVALID) return RC_OK;
+
+  int child_pos = trie->nodes_buf[0].child;
+
+  for (int i = 0; i < (part - 1) / walk->sel_cnt; i++) child_pos = trie->nodes_buf[child_pos].sibling;
+
+  const int sel    = (part - 1) % walk->sel_cnt;
+  const int repeat = trie->nodes_buf[child_pos].repeat;
+
+  const int seg = (id * walk->sel_cnt) + sel;
+
+  const int end = walk_ends (walk, repeat)[seg];
+
+  if (end == RC_INVALID) return RC_OK;
+
+  const int seg_len = walk->segs_len[(seg * walk->segs_repeat) + repeat - 1];
+
+  memcpy (pw_buf + pw_len, walk->segs_buf + (seg * walk->segs_size), seg_len);
+
+  if (policy)
+  {
+    const policy_seg_t *seg_policy = policy_seg (walk, policy, seg, repeat);
+
+    const int run = policy_run (policy, seg_policy, repeat, 1);
+
+    if (run == RC_INVALID) return reject_trie (gen, count_trie_below (walk, trie, child_pos, end, sel));
+
+    return process_trie_policy (gen, trie, child_pos, end, sel, pw_buf, pw_len + seg_len, policy->basechars_class[basechar_pos] | seg_policy->classes, run);
+  }
+
+  return process_trie_node (gen, trie, child_pos, end, sel, pw_buf, pw_len + seg_len);
+}
+
+static void process_trie (const walk_t *walk, const trie_t *trie, const pos_t *start, const u64 limit, out_t *out)
+{
+  gen_t gen;
+
+  gen.walk      = walk;
+  gen.route_buf = NULL;
+  gen.out       = out;
+  gen.resume    = 0;
+  gen.left      = limit;
+  gen.skip      = 0;
+
+  out->left = &gen.left;
+
+  const int parts = trie_parts (walk, trie);
+
+  int basechar_first = 0;
+  int part_first     = 0;
+
+  if (start)
+  {
+    gen.resume     = 1;
+    gen.resume_pos = *start;
+
+    basechar_first = start->basechar_pos;
+    part_first     = start->part;
+  }
+
+  int rc = RC_OK;
+
+  for (int basechar_pos = basechar_first; (basechar_pos < walk->basechars_cnt) && (rc == RC_OK); basechar_pos++)
+  {
+    for (int part = (basechar_pos == basechar_first) ? part_first : 0; (part < parts) && (rc == RC_OK); part++)
+    {
+      rc = process_trie_part (&gen, trie, basechar_pos, part);
+    }
+  }
+
+  out->left = NULL;
+}
+
+// keyspace
+
+static int add_u64 (u64 *a, const u64 b)
+{
+  if (*a > UINT64_MAX - b) return RC_INVALID;
+
+  *a += b;
+
+  return RC_OK;
+}
+
+// replays the rejections of the original mixed-radix loop without enumerating it. the state is the number of walks
+// still alive on a key by the selection they arrived with, a rejection at a direction change stands for all values
+// of the selections behind it
+
+static void reject_route (const walk_t *walk, const route_t *route_buf, double *keyspace, double *rejected_keymap, double *rejected_repeat)
+{
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  double *cur_buf  = (double *) calloc (keys_cnt * sel_cnt, sizeof (double));
+  double *next_buf = (double *) calloc (keys_cnt * sel_cnt, sizeof (double));
+  double *sums_buf = (double *) calloc (keys_cnt, sizeof (double));
+
+  *keyspace        = walk->basechars_cnt;
+  *rejected_keymap = 0;
+  *rejected_repeat = 0;
+
+  // a basechar that is not on the keymap leaves it at the first direction change, whatever the selections are
+
+  double missing = 0;
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const int id = walk->basechars_ids[basechar_pos];
+
+    if (id == RC_INVALID)
+    {
+      missing++;
+
+      continue;
+    }
+
+    sums_buf[id] += 1;
+  }
+
+  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  {
+    *keyspace *= sel_cnt;
+
+    double tail = 1;
+
+    for (int i = route_pos + 1; i < route_buf->changes; i++) tail *= sel_cnt;
+
+    const int *ends = walk_ends (walk, route_buf->repeat[route_pos]);
+
+    memset (next_buf, 0, keys_cnt * sel_cnt * sizeof (double));
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      if (sums_buf[id] == 0) continue;
+
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        const double same = cur_buf[(id * sel_cnt) + sel];
+        const double diff = sums_buf[id] - same;
+
+        *rejected_repeat += same * tail;
+
+        const int end = ends[(id * sel_cnt) + sel];
+
+        if (end == RC_INVALID)
+        {
+          *rejected_keymap += diff * tail;
+        }
+        else
+        {
+          next_buf[(end * sel_cnt) + sel] += diff;
+        }
+      }
+    }
+
+    double *tmp_buf = cur_buf;
+
+    cur_buf  = next_buf;
+    next_buf = tmp_buf;
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      sums_buf[id] = 0;
+
+      for (int sel = 0; sel < sel_cnt; sel++) sums_buf[id] += cur_buf[(id * sel_cnt) + sel];
+    }
+  }
+
+  if (route_buf->changes > 0)
+  {
+    double tail = 1;
+
+    for (int i = 0; i < route_buf->changes; i++) tail *= sel_cnt;
+
+    *rejected_keymap += missing * tail;
+  }
+
+  free (cur_buf);
+  free (next_buf);
+  free (sums_buf);
+}
+
+// counts the valid candidates of a route without building them. the state is (key, last selection), the number of
+// ways to reach key e with selection s is the number of ways to stand on its predecessor with any other selection.
+// the state in front of every direction change is kept, seek_route() needs it to unrank.
+
+static int count_route (const walk_t *walk, const route_t *route_buf, count_t *count)
+{
+  count->changes  = route_buf->changes;
+  count->cnt      = 0;
+  count->ways_buf = NULL;
+  count->sums_buf = NULL;
+
+  if (route_buf->changes == 0)
+  {
+    count->cnt = walk->basechars_cnt;
+
+    return RC_OK;
+  }
+
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  count->ways_buf = (u64 *) calloc (route_buf->changes * keys_cnt * sel_cnt, sizeof (u64));
+  count->sums_buf = (u64 *) calloc (route_buf->changes * keys_cnt,           sizeof (u64));
+
+  u64 *ways_next = (u64 *) calloc (keys_cnt * sel_cnt, sizeof (u64));
+  u64 *sums_next = (u64 *) calloc (keys_cnt,           sizeof (u64));
+
+  int rc = RC_OK;
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const int id = walk->basechars_ids[basechar_pos];
+
+    if (id == RC_INVALID) continue;
+
+    count->sums_buf[id]++;
+  }
+
+  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  {
+    const int *ends = walk_ends (walk, route_buf->repeat[route_pos]);
+
+    const u64 *ways = count->ways_buf + (route_pos * keys_cnt * sel_cnt);
+    const u64 *sums = count->sums_buf + (route_pos * keys_cnt);
+
+    u64 *ways_to = (route_pos + 1 < route_buf->changes) ? count->ways_buf + ((route_pos + 1) * keys_cnt * sel_cnt) : ways_next;
+    u64 *sums_to = (route_pos + 1 < route_buf->changes) ? count->sums_buf + ((route_pos + 1) * keys_cnt)           : sums_next;
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      if (sums[id] == 0) continue;
+
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        const int end = ends[(id * sel_cnt) + sel];
+
+        if (end == RC_INVALID) continue;
+
+        if (add_u64 (ways_to + (end * sel_cnt) + sel, sums[id] - ways[(id * sel_cnt) + sel]) == RC_INVALID) rc = RC_INVALID;
+      }
+    }
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        if (add_u64 (sums_to + id, ways_to[(id * sel_cnt) + sel]) == RC_INVALID) rc = RC_INVALID;
+      }
+    }
+  }
+
+  for (int id = 0; id < keys_cnt; id++)
+  {
+    if (add_u64 (&count->cnt, sums_next[id]) == RC_INVALID) rc = RC_INVALID;
+  }
+
+  free (ways_next);
+  free (sums_next);
+
+  return rc;
+}
+
+static void free_count (count_t *count)
+{
+  free (count->ways_buf);
+  free (count->sums_buf);
+
+  count->ways_buf = NULL;
+  count->sums_buf = NULL;
+}
+
+// same recurrence as count_route(), run over the trie so shared route prefixes are counted once. cnt_buf gets the
+// candidates of a single route ending at each node
+
+static int count_trie_node (const walk_t *walk, const trie_t *trie, const int node_pos, const int depth, u64 *ways_buf, u64 *sums_buf, u64 *cnt_buf)
+{
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  const u64 *ways = ways_buf + (depth * keys_cnt * sel_cnt);
+  const u64 *sums = sums_buf + (depth * keys_cnt);
+
+  u64 *ways_to = ways_buf + ((depth + 1) * keys_cnt * sel_cnt);
+  u64 *sums_to = sums_buf + ((depth + 1) * keys_cnt);
+
+  int rc = RC_OK;
+
+  for (int child_pos = trie->nodes_buf[node_pos].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    const int *ends = walk_ends (walk, trie->nodes_buf[child_pos].repeat);
+
+    memset (ways_to, 0, keys_cnt * sel_cnt * sizeof (u64));
+    memset (sums_to, 0, keys_cnt *           sizeof (u64));
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      if (sums[id] == 0) continue;
+
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        const int end = ends[(id * sel_cnt) + sel];
+
+        if (end == RC_INVALID) continue;
+
+        if (add_u64 (ways_to + (end * sel_cnt) + sel, sums[id] - ways[(id * sel_cnt) + sel]) == RC_INVALID) rc = RC_INVALID;
+      }
+    }
+
+    cnt_buf[child_pos] = 0;
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        if (add_u64 (sums_to + id, ways_to[(id * sel_cnt) + sel]) == RC_INVALID) rc = RC_INVALID;
+      }
+
+      if (add_u64 (cnt_buf + child_pos, sums_to[id]) == RC_INVALID) rc = RC_INVALID;
+    }
+
+    if (count_trie_node (walk, trie, child_pos, depth + 1, ways_buf, sums_buf, cnt_buf) == RC_INVALID) rc = RC_INVALID;
+  }
+
+  return rc;
+}
+
+static int count_trie (const walk_t *walk, const trie_t *trie, u64 *cnt_buf)
+{
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  u64 *ways_buf = (u64 *) calloc ((ROUTE_LENGTH_MAX + 1) * keys_cnt * sel_cnt, sizeof (u64));
+  u64 *sums_buf = (u64 *) calloc ((ROUTE_LENGTH_MAX + 1) * keys_cnt,           sizeof (u64));
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const int id = walk->basechars_ids[basechar_pos];
+
+    if (id == RC_INVALID) continue;
+
+    sums_buf[id]++;
+  }
+
+  cnt_buf[0] = walk->basechars_cnt;
+
+  const int rc = count_trie_node (walk, trie, 0, 0, ways_buf, sums_buf, cnt_buf);
+
+  free (ways_buf);
+  free (sums_buf);
+
+  return rc;
+}
+
+// number of candidates once the selections from route_pos upwards are fixed. tail is the set of keys the fixed part
+// above route_pos can be walked from, head receives the same for the part starting at route_pos.
+
+static u64 count_route_level (const walk_t *walk, const route_t *route_buf, const count_t *count, const int route_pos, const int sel, const keyset_t *tail, keyset_t *head)
+{
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  const int *ends = walk_ends (walk, route_buf->repeat[route_pos]);
+
+  const u64 *ways = count->ways_buf + (route_pos * keys_cnt * sel_cnt);
+  const u64 *sums = count->sums_buf + (route_pos * keys_cnt);
+
+  memset (head, 0, sizeof (keyset_t));
+
+  u64 cnt = 0;
+
+  for (int id = 0; id < keys_cnt; id++)
+  {
+    const int end = ends[(id * sel_cnt) + sel];
+
+    if (end == RC_INVALID) continue;
+
+    if ((tail != NULL) && (keyset_test (tail, end) == 0)) continue;
+
+    keyset_set (head, id);
+
+    cnt += sums[id] - ways[(id * sel_cnt) + sel];
+  }
+
+  return cnt;
+}
+
+// finds the position of the idx-th valid candidate of a route, in output order
+
+static int seek_route (const walk_t *walk, const route_t *route_buf, const count_t *count, u64 idx, pos_t *pos)
+{
+  if (idx >= count->cnt) return RC_INVALID;
+
+  pos->part_offset = idx;
+
+  if (route_buf->changes == 0)
+  {
+    pos->basechar_pos = (int) idx;
+
+    return RC_OK;
+  }
+
+  keyset_t sets[2];
+
+  const keyset_t *tail = NULL;
+
+  int prev_sel = RC_INVALID;
+
+  for (int route_pos = route_buf->changes - 1; route_pos >= 0; route_pos--)
+  {
+    keyset_t *head = sets + (route_pos & 1);
+
+    int sel;
+
+    for (sel = 0; sel < walk->sel_cnt; sel++)
+    {
+      if (sel == prev_sel) continue;
+
+      const u64 cnt = count_route_level (walk, route_buf, count, route_pos, sel, tail, head);
+
+      if (idx < cnt) break;
+
+      idx -= cnt;
+    }
+
+    if (sel == walk->sel_cnt) return RC_INVALID;
+
+    if (route_pos == route_buf->changes - 1) pos->part_offset = idx;
+
+    pos->sel_buf[route_pos] = sel;
+
+    prev_sel = sel;
+
+    tail = head;
+  }
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const int id = walk->basechars_ids[basechar_pos];
+
+    if (id == RC_INVALID) continue;
+
+    if (keyset_test (tail, id) == 0) continue;
+
+    if (idx == 0)
+    {
+      pos->basechar_pos = basechar_pos;
+
+      return RC_OK;
+    }
+
+    idx--;
+  }
+
+  return RC_INVALID;
+}
+
+// maps a global candidate index to a route and a position in it, only the routes in front of it are counted
+
+static int seek_routes (const walk_t *walk, const route_t *routes_buf, const int routes_cnt, u64 idx, pos_t *pos)
+{
+  for (int routes_pos = 0; routes_pos < routes_cnt; routes_pos++)
+  {
+    const route_t *route_buf = routes_buf + routes_pos;
+
+    count_t count;
+
+    if (count_route (walk, route_buf, &count) == RC_INVALID)
+    {
+      free_count (&count);
+
+      return RC_INVALID;
+    }
+
+    if (idx < count.cnt)
+    {
+      pos->routes_pos   = routes_pos;
+      pos->route_offset = idx;
+
+      const int rc = seek_route (walk, route_buf, &count, idx, pos);
+
+      free_count (&count);
+
+      return rc;
+    }
+
+    idx -= count.cnt;
+
+    free_count (&count);
+  }
+
+  return RC_INVALID;
+}
+
+static u64 add_sat (const u64 a, const u64 b)
+{
+  return (a > UINT64_MAX - b) ? UINT64_MAX : a + b;
+}
+
+// candidates below a node by the key and the selection a walk enters it with: the routes ending at the node plus
+// every other selection into each child. tables_buf holds one [keys_cnt][sel_cnt] table per depth, counts that do
+// not fit into 64 bit saturate
+
+static void count_trie_suffix (const walk_t *walk, const trie_t *trie, const int node_pos, const int depth, u64 *tables_buf)
+{
+  const int keys_cnt = walk->keys_cnt;
+  const int sel_cnt  = walk->sel_cnt;
+
+  const int table_size = keys_cnt * sel_cnt;
+
+  u64 *table = tables_buf + (depth * table_size);
+
+  const u64 *child_table = table + table_size;
+
+  const node_t *node = trie->nodes_buf + node_pos;
+
+  for (int i = 0; i < table_size; i++) table[i] = node->routes;
+
+  for (int child_pos = node->child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    count_trie_suffix (walk, trie, child_pos, depth + 1, tables_buf);
+
+    const int *ends = walk_ends (walk, trie->nodes_buf[child_pos].repeat);
+
+    for (int id = 0; id < keys_cnt; id++)
+    {
+      u64 sum = 0;
+
+      for (int sel = 0; sel < sel_cnt; sel++)
+      {
+        const int end = ends[(id * sel_cnt) + sel];
+
+        if (end == RC_INVALID) continue;
+
+        sum = add_sat (sum, child_table[(end * sel_cnt) + sel]);
+      }
+
+      for (int prev_sel = 0; prev_sel < sel_cnt; prev_sel++)
+      {
+        const int prev_end = ends[(id * sel_cnt) + prev_sel];
+
+        u64 cnt = sum - ((prev_end == RC_INVALID) ? 0 : child_table[(prev_end * sel_cnt) + prev_sel]);
+
+        // a saturated sum can not be taken apart, add up the other selections instead
+
+        if (sum == UINT64_MAX)
+        {
+          cnt = 0;
+
+          for (int sel = 0; sel < sel_cnt; sel++)
+          {
+            const int end = ends[(id * sel_cnt) + sel];
+
+            if ((sel == prev_sel) || (end == RC_INVALID)) continue;
+
+            cnt = add_sat (cnt, child_table[(end * sel_cnt) + sel]);
+          }
+        }
+
+        table[(id * sel_cnt) + prev_sel] = add_sat (table[(id * sel_cnt) + prev_sel], cnt);
+      }
+    }
+  }
+}
+
+// the size of a part only depends on the root child, the key and the selection it starts with, so one table per root
+// child covers them all
+
+static void count_trie_parts (const walk_t *walk, const trie_t *trie, trie_count_t *count)
+{
+  const int table_size = walk->keys_cnt * walk->sel_cnt;
+
+  int children_cnt = 0;
+
+  for (int child_pos = trie->nodes_buf[0].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling) children_cnt++;
+
+  count->children_buf = (int *) calloc (children_cnt + 1, sizeof (int));
+  count->parts_buf    = (u64 *) calloc (((size_t) children_cnt * table_size) + 1, sizeof (u64));
+
+  u64 *tables_buf = (u64 *) calloc ((size_t) (ROUTE_LENGTH_MAX + 2) * table_size, sizeof (u64));
+
+  int children_pos = 0;
+
+  for (int child_pos = trie->nodes_buf[0].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    count_trie_suffix (walk, trie, child_pos, 1, tables_buf);
+
+    memcpy (count->parts_buf + ((size_t) children_pos * table_size), tables_buf + table_size, table_size * sizeof (u64));
+
+    count->children_buf[children_pos++] = child_pos;
+  }
+
+  free (tables_buf);
+}
+
+static void free_trie_count (trie_count_t *count)
+{
+  free (count->children_buf);
+  free (count->parts_buf);
+
+  count->children_buf = NULL;
+  count->parts_buf    = NULL;
+}
+
+// candidates of one (basechar, part), the same walks process_trie_part() visits
+
+static u64 trie_part_cnt (const walk_t *walk, const trie_t *trie, const trie_count_t *count, const int basechar_pos, const int part)
+{
+  if (part == 0) return trie->nodes_buf[0].routes;
+
+  const int id = walk->basechars_ids[basechar_pos];
+
+  if (id == RC_INVALID) return 0;
+
+  const int sel_cnt = walk->sel_cnt;
+
+  const int child = (part - 1) / sel_cnt;
+  const int sel   = (part - 1) % sel_cnt;
+
+  const int end = walk_ends (walk, trie->nodes_buf[count->children_buf[child]].repeat)[(id * sel_cnt) + sel];
+
+  if (end == RC_INVALID) return 0;
+
+  return count->parts_buf[((size_t) child * walk->keys_cnt * sel_cnt) + (end * sel_cnt) + sel];
+}
+
+// maps a global candidate index to a (basechar, part) and a position in it, in trie order
+
+static int seek_trie (const walk_t *walk, const trie_t *trie, u64 idx, pos_t *pos)
+{
+  trie_count_t count;
+
+  count_trie_parts (walk, trie, &count);
+
+  const int parts = trie_parts (walk, trie);
+
+  int rc = RC_INVALID;
+
+  for (int basechar_pos = 0; (basechar_pos < walk->basechars_cnt) && (rc == RC_INVALID); basechar_pos++)
+  {
+    for (int part = 0; part < parts; part++)
+    {
+      const u64 cnt = trie_part_cnt (walk, trie, &count, basechar_pos, part);
+
+      if (idx < cnt)
+      {
+        pos->routes_pos   = 0;
+        pos->basechar_pos = basechar_pos;
+        pos->part         = part;
+        pos->part_offset  = idx;
+
+        rc = RC_OK;
+
+        break;
+      }
+
+      idx -= cnt;
+    }
+  }
+
+  free_trie_count (&count);
+
+  return rc;
+}
+
+static void route_to_str (const route_t *route_buf, char *buf)
+{
+  static const char *hex = "0123456789abcdefg";
+
+  for (int route_pos = 0; route_pos < route_buf->changes; route_pos++)
+  {
+    buf[route_pos] = hex[route_buf->repeat[route_pos]];
+  }
+
+  buf[route_buf->changes] = 0;
+}
+
+// --match, the reverse of the generator. a word is a walk if its keys follow each other on the keymap and the runs of
+// equal selections, as repeats, spell a route of the trie. a step normally fits exactly one selection, the few
+// ambiguous ones are backtracked
+
+typedef struct
+{
+  const walk_t   *walk;
+  const trie_t   *trie;
+  const route_t  *routes_buf;
+  const policy_t *policy;
+
+  int   basechars_hash[MATCH_HASH_SIZE];  // open addressing character -> first basechar_pos, RC_INVALID marks a free slot
+  const wchar_t *basechars_buf;
+
+  int  *nodes_route;                      // [nodes_cnt] first route ending at a node, RC_INVALID if none
+
+  char (*sels_name)[MATCH_TOKEN_SIZE];    // [sel_cnt] direction, distance and keymap of a selection
+
+} matcher_t;
+
+typedef struct
+{
+  const matcher_t *matcher;
+
+  const wchar_t *word_buf;
+  int  ids[PW_MAX];             // keys walked so far, a character can be on several blocks
+  int  len;
+
+  int  sels_buf[ROUTE_LENGTH_MAX];
+  int  changes;
+  int  routes_pos;
+
+} match_t;
+
+// one block of whole lines, matched by one thread
+
+typedef struct
+{
+  const matcher_t *matcher;
+
+  char *in_buf;
+  int   in_len;
+  int   in_size;
+
+  char *out_buf;
+  int   out_len;
+  int   out_size;
+
+  u64   words;
+  u64   matched;
+
+} match_job_t;
+
+static int match_hash (const wchar_t c)
+{
+  return (int) (((uint32_t) c * 0x9e3779b1u) >> (32 - MATCH_HASH_BITS));
+}
+
+static int match_basechar (const matcher_t *matcher, const wchar_t c)
+{
+  for (int slot = match_hash (c); matcher->basechars_hash[slot] != RC_INVALID; slot = (slot + 1) & (MATCH_HASH_SIZE - 1))
+  {
+    const int basechar_pos = matcher->basechars_hash[slot];
+
+    if (matcher->basechars_buf[basechar_pos] == c) return basechar_pos;
+  }
+
+  return RC_INVALID;
+}
+
+static void matcher_init (matcher_t *matcher, const kwp_conf_t *conf, const walk_t *walk, const trie_t *trie, const route_t *routes_buf, const int routes_cnt, const wchar_t *basechars_buf, const policy_t *policy)
+{
+  matcher->walk          = walk;
+  matcher->trie          = trie;
+  matcher->routes_buf    = routes_buf;
+  matcher->policy        = policy;
+  matcher->basechars_buf = basechars_buf;
+
+  for (int slot = 0; slot < MATCH_HASH_SIZE; slot++) matcher->basechars_hash[slot] = RC_INVALID;
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    const wchar_t c = basechars_buf[basechar_pos];
+
+    if (match_basechar (matcher, c) != RC_INVALID) continue;
+
+    int slot = match_hash (c);
+
+    while (matcher->basechars_hash[slot] != RC_INVALID) slot = (slot + 1) & (MATCH_HASH_SIZE - 1);
+
+    matcher->basechars_hash[slot] = basechar_pos;
+  }
+
+  matcher->nodes_route = (int *) malloc (trie->nodes_cnt * sizeof (int));
+
+  for (int node_pos = 0; node_pos < trie->nodes_cnt; node_pos++) matcher->nodes_route[node_pos] = RC_INVALID;
+
+  for (int routes_pos = routes_cnt - 1; routes_pos >= 0; routes_pos--) matcher->nodes_route[trie->leaf_buf[routes_pos]] = routes_pos;
+
+  // same selection index decoding as setup_walk(): distance first, then modifier, then direction
+
+  static const char *dirs_name[DIR_CNT] = { "sw", "s", "se", "w", "r", "e", "nw", "n", "ne" };
+  static const char *mods_name[MOD_CNT] = { "", "+shift", "+altgr" };
+
+  const int dirs_user[DIR_CNT] = { conf->user_dir_south_west, conf->user_dir_south, conf->user_dir_south_east, conf->user_dir_west, conf->user_dir_repeat, conf->user_dir_east, conf->user_dir_north_west, conf->user_dir_north, conf->user_dir_north_east };
+  const int mods_user[MOD_CNT] = { conf->user_mod_basic, conf->user_mod_shift, conf->user_mod_altgr };
+
+  int dirs_buf[DIR_CNT];
+  int mods_buf[MOD_CNT];
+
+  int dir_cnt = 0;
+  int mod_cnt = 0;
+
+  for (int dir = 0; dir < DIR_CNT; dir++) if (dirs_user[dir] == 1) dirs_buf[dir_cnt++] = dir;
+  for (int mod = 0; mod < MOD_CNT; mod++) if (mods_user[mod] == 1) mods_buf[mod_cnt++] = mod;
+
+  const int dist_cnt = 1 + (conf->user_dist_max - conf->user_dist_min);
+
+  matcher->sels_name = (char (*)[MATCH_TOKEN_SIZE]) calloc (walk->sel_cnt, MATCH_TOKEN_SIZE);
+
+  for (int sel = 0; sel < walk->sel_cnt; sel++)
+  {
+    const int dist = conf->user_dist_min + (sel % dist_cnt);
+    const int mod  = mods_buf[(sel / dist_cnt) % mod_cnt];
+    const int dir  = dirs_buf[sel / (dist_cnt * mod_cnt)];
+
+    if (dist > 1) snprintf (matcher->sels_name[sel], MATCH_TOKEN_SIZE, "%s%d%s", dirs_name[dir], dist, mods_name[mod]);
+    else          snprintf (matcher->sels_name[sel], MATCH_TOKEN_SIZE, "%s%s",   dirs_name[dir],       mods_name[mod]);
+  }
+}
+
+static void matcher_free (matcher_t *matcher)
+{
+  free (matcher->nodes_route);
+  free (matcher->sels_name);
+}
+
+static int match_child (const trie_t *trie, const int node_pos, const int repeat)
+{
+  for (int child_pos = trie->nodes_buf[node_pos].child; child_pos != RC_INVALID; child_pos = trie->nodes_buf[child_pos].sibling)
+  {
+    if (trie->nodes_buf[child_pos].repeat == repeat) return child_pos;
+  }
+
+  return RC_INVALID;
+}
+
+// step pos goes from ids[pos - 1] to a key of word_buf[pos]. the segment still open runs seg_repeat times on seg_sel, the
+// closed ones lead to node_pos
+
+static int match_walk (match_t *match, const int pos, const int node_pos, const int seg_sel, const int seg_repeat, const int changes)
+{
+  const matcher_t *matcher = match->matcher;
+  const walk_t    *walk    = matcher->walk;
+  const trie_t    *trie    = matcher->trie;
+
+  const int child_pos = (seg_repeat) ? match_child (trie, node_pos, seg_repeat) : node_pos;
+
+  if (seg_repeat) match->sels_buf[changes] = seg_sel;
+
+  const int closed = changes + ((seg_repeat) ? 1 : 0);
+
+  if (pos == match->len)
+  {
+    if ((child_pos == RC_INVALID) || (matcher->nodes_route[child_pos] == RC_INVALID)) return RC_INVALID;
+
+    match->changes    = closed;
+    match->routes_pos = matcher->nodes_route[child_pos];
+
+    return RC_OK;
+  }
+
+  const int *next = walk->next_buf + (match->ids[pos - 1] * walk->sel_cnt);
+
+  for (int sel = 0; sel < walk->sel_cnt; sel++)
+  {
+    if ((next[sel] == RC_INVALID) || (walk->keys_buf[next[sel]] != match->word_buf[pos])) continue;
+
+    match->ids[pos] = next[sel];
+
+    if (sel == seg_sel)
+    {
+      if (seg_repeat == ROUTE_REPEAT_MAX) continue;
+
+      if (match_walk (match, pos + 1, node_pos, sel, seg_repeat + 1, changes) == RC_OK) return RC_OK;
+    }
+    else if (child_pos != RC_INVALID)
+    {
+      if (match_walk (match, pos + 1, child_pos, sel, 1, closed) == RC_OK) return RC_OK;
+    }
+  }
+
+  return RC_INVALID;
+}
+
+// basechar_pos of a word that is a walk, RC_INVALID if it is none
+
+static int match_word (match_t *match, const wchar_t *word_buf, const int word_len)
+{
+  const matcher_t *matcher = match->matcher;
+  const walk_t    *walk    = matcher->walk;
+  const policy_t  *policy  = matcher->policy;
+
+  if ((word_len < 1) || (word_len > PW_MAX)) return RC_INVALID;
+
+  const int basechar_first = match_basechar (matcher, word_buf[0]);
+
+  if (basechar_first == RC_INVALID) return RC_INVALID;
+
+  match->word_buf = word_buf;
+  match->len      = word_len;
+
+  int classes = (policy) ? policy->basechars_class[basechar_first] : 0;
+
+  for (int pos = 1; pos < word_len; pos++)
+  {
+    const int id = key_to_id (walk, word_buf[pos]);
+
+    if ((id == RC_INVALID) || (walk->keys_enc_len[id] == RC_INVALID)) return RC_INVALID;
+
+    if (policy) classes |= policy->keys_class[id];
+  }
+
+  if (policy)
+  {
+    if (policy->missing_buf[classes]) return RC_INVALID;
+
+    for (int pos = 1, run = 1; (pos < word_len) && (policy->run_max); pos++)
+    {
+      run = (word_buf[pos] == word_buf[pos - 1]) ? run + 1 : 1;
+
+      if (run > policy->run_max) return RC_INVALID;
+    }
+  }
+
+  // the copies of a basechar on several blocks follow each other, see filter_basechars()
+
+  for (int basechar_pos = basechar_first; (basechar_pos < walk->basechars_cnt) && (matcher->basechars_buf[basechar_pos] == word_buf[0]); basechar_pos++)
+  {
+    match->ids[0] = walk->basechars_ids[basechar_pos];
+
+    if (match->ids[0] == RC_INVALID) continue;
+
+    if (match_walk (match, 1, 0, RC_INVALID, 0, 0) == RC_OK) return basechar_pos;
+  }
+
+  return RC_INVALID;
+}
+
+static void match_append (match_job_t *job, const char *buf, const int len)
+{
+  if (job->out_len + len > job->out_size)
+  {
+    while (job->out_len + len > job->out_size) job->out_size = (job->out_size) ? job->out_size * 2 : MATCH_BLOCK;
+
+    job->out_buf = (char *) realloc (job->out_buf, job->out_size);
+  }
+
+  memcpy (job->out_buf + job->out_len, buf, len);
+
+  job->out_len += len;
+}
+
+// writes route, basechar, directions and the word of every walk in the block, tab separated and in input order
+
+static void *match_block (void *p)
+{
+  match_job_t *job = (match_job_t *) p;
+
+  const matcher_t *matcher = job->matcher;
+
+  match_t match;
+
+  match.matcher = matcher;
+
+  wchar_t *tmp = (wchar_t *) calloc (BUFSIZ, sizeof (wchar_t));
+
+  map_t map;
+
+  map.buf    = job->in_buf;
+  map.len    = job->in_len;
+  map.pos    = 0;
+  map.mapped = 0;
+
+  job->out_len = 0;
+  job->words   = 0;
+  job->matched = 0;
+
+  while (map.pos < map.len)
+  {
+    const char *line_buf = map.buf + map.pos;
+
+    int word_len;
+
+    const wchar_t *word_buf = map_getl (&map, tmp, BUFSIZ, &word_len);
+
+    int line_len = (map.buf + map.pos) - line_buf;
+
+    while ((line_len) && ((line_buf[line_len - 1] == '\n') || (line_buf[line_len - 1] == '\r'))) line_len--;
+
+    job->words++;
+
+    if (word_buf == NULL) continue;
+
+    const int basechar_pos = match_word (&match, word_buf, word_len);
+
+    if (basechar_pos == RC_INVALID) continue;
+
+    job->matched++;
+
+    char route_str[KWP_ROUTE_STR_SIZE];
+
+    route_to_str (matcher->routes_buf + match.routes_pos, route_str);
+
+    match_append (job, route_str, strlen (route_str));
+    match_append (job, "\t", 1);
+
+    // the basechar as it is in the input
+
+    mbstate_t state;
+
+    memset (&state, 0, sizeof (state));
+
+    const size_t basechar_len = ((u8) line_buf[0] < 0x80) ? 1 : mbrtowc (NULL, line_buf, line_len, &state);
+
+    match_append (job, line_buf, (int) basechar_len);
+    match_append (job, "\t", 1);
+
+    for (int route_pos = 0; route_pos < match.changes; route_pos++)
+    {
+      if (route_pos) match_append (job, ",", 1);
+
+      const char *sel_name = matcher->sels_name[match.sels_buf[route_pos]];
+
+      match_append (job, sel_name, strlen (sel_name));
+    }
+
+    match_append (job, "\t", 1);
+    match_append (job, line_buf, line_len);
+    match_append (job, "\n", 1);
+  }
+
+  free (tmp);
+
+  return NULL;
+}
+
+// fills the job with whole lines, the part of a line that did not fit stays in carry for the next job. a line longer
+// than a block makes the job grow
+
+static int match_read (FILE *fp, match_job_t *job, char *carry_buf, int *carry_len)
+{
+  memcpy (job->in_buf, carry_buf, *carry_len);
+
+  job->in_len = *carry_len;
+
+  *carry_len = 0;
+
+  while (1)
+  {
+    if (job->in_len + MATCH_BLOCK > job->in_size)
+    {
+      job->in_size = job->in_len + MATCH_BLOCK;
+
+      job->in_buf = (char *) realloc (job->in_buf, job->in_size);
+    }
+
+    const int nread = (int) fread (job->in_buf + job->in_len, 1, MATCH_BLOCK, fp);
+
+    if (nread == 0) return job->in_len;
+
+    const char *ptr = job->in_buf + job->in_len;
+
+    job->in_len += nread;
+
+    const char *eol = NULL;
+
+    for (const char *end = job->in_buf + job->in_len; end > ptr; end--)
+    {
+      if (end[-1] == '\n')
+      {
+        eol = end;
+
+        break;
+      }
+    }
+
+    if (eol == NULL) continue;
+
+    *carry_len = (job->in_buf + job->in_len) - eol;
+
+    memcpy (carry_buf, eol, *carry_len);
+
+    job->in_len -= *carry_len;
+
+    return job->in_len;
+  }
+}
+
+static int match_file (const matcher_t *matcher, FILE *in, FILE *out, const int threads, u64 *words, u64 *matched)
+{
+  match_job_t *jobs_buf = (match_job_t *) calloc (threads, sizeof (match_job_t));
+
+  pthread_t *threads_buf = (pthread_t *) calloc (threads, sizeof (pthread_t));
+
+  char *carry_buf = (char *) malloc (MATCH_BLOCK);
+  int   carry_len = 0;
+
+  for (int i = 0; i < threads; i++)
+  {
+    jobs_buf[i].matcher = matcher;
+    jobs_buf[i].in_size = MATCH_BLOCK;
+    jobs_buf[i].in_buf  = (char *) malloc (MATCH_BLOCK);
+  }
+
+  *words   = 0;
+  *matched = 0;
+
+  int rc = RC_OK;
+
+  while (1)
+  {
+    int jobs_cnt = 0;
+
+    while ((jobs_cnt < threads) && (match_read (in, jobs_buf + jobs_cnt, carry_buf, &carry_len) > 0)) jobs_cnt++;
+
+    if (jobs_cnt == 0) break;
+
+    if (jobs_cnt == 1)
+    {
+      match_block (jobs_buf);
+    }
+    else
+    {
+      for (int i = 0; i < jobs_cnt; i++) pthread_create (threads_buf + i, NULL, match_block, jobs_buf + i);
+      for (int i = 0; i < jobs_cnt; i++) pthread_join   (threads_buf[i], NULL);
+    }
+
+    for (int i = 0; i < jobs_cnt; i++)
+    {
+      if (fwrite (jobs_buf[i].out_buf, 1, jobs_buf[i].out_len, out) != (size_t) jobs_buf[i].out_len) rc = RC_INVALID;
+
+      *words   += jobs_buf[i].words;
+      *matched += jobs_buf[i].matched;
+    }
+
+    if ((rc == RC_INVALID) || (jobs_cnt < threads)) break;
+  }
+
+  if (ferror (in)) rc = RC_INVALID;
+
+  for (int i = 0; i < threads; i++)
+  {
+    free (jobs_buf[i].in_buf);
+    free (jobs_buf[i].out_buf);
+  }
+
+  free (carry_buf);
+  free (threads_buf);
+  free (jobs_buf);
+
+  return rc;
+}
+
+// threaded generation
+
+static int pool_next_job (pool_t *pool, job_t *job)
+{
+  const int cursor_cnt = (pool->trie) ? pool->walk->basechars_cnt : pool->routes_cnt;
+
+  while ((pool->left) && (pool->cursor_route < cursor_cnt))
+  {
+    const route_t *route_buf = (pool->trie) ? NULL : pool->routes_buf + pool->cursor_route;
+
+    const int parts = (pool->trie) ? trie_parts (pool->walk, pool->trie) : route_parts (pool->walk, route_buf);
+
+    if (pool->cursor_sel == parts)
+    {
+      pool->cursor_route++;
+      pool->cursor_sel = 0;
+
+      free_count (&pool->cursor_count);
+
+      if (pool->cursor_route == cursor_cnt) break;
+
+      if ((pool->left != UINT64_MAX) && (pool->trie == NULL)) count_route (pool->walk, pool->routes_buf + pool->cursor_route, &pool->cursor_count);
+
+      continue;
+    }
+
+    job->routes_pos = pool->cursor_route;
+    job->sel        = pool->cursor_sel++;
+    job->resume     = pool->resume;
+    job->resume_pos = pool->resume_pos;
+    job->left       = UINT64_MAX;
+
+    pool->resume = 0;
+
+    // with a limit every job gets its share up front, that needs the size of the part
+
+    if (pool->left != UINT64_MAX)
+    {
+      keyset_t head;
+
+      u64 cnt = 0;
+
+      if (pool->trie)
+      {
+        cnt = trie_part_cnt (pool->walk, pool->trie, &pool->cursor_trie_count, job->routes_pos, job->sel);
+      }
+      else
+      {
+        cnt = pool->cursor_count.cnt;
+
+        if (route_buf->changes) cnt = count_route_level (pool->walk, route_buf, &pool->cursor_count, route_buf->changes - 1, job->sel, NULL, &head);
+      }
+
+      if (job->resume) cnt -= job->resume_pos.part_offset;
+
+      if (cnt == 0) continue;
+
+      job->left = (cnt < pool->left) ? cnt : pool->left;
+
+      pool->left -= job->left;
+    }
+
+    return RC_OK;
+  }
+
+  pool->exhausted = 1;
+
+  return RC_INVALID;
+}
+
+static void pool_push (pool_t *pool, const u64 job_pos, const char *buf, const int len, const u64 cnt)
+{
+  chunk_t *chunk = (chunk_t *) malloc (sizeof (chunk_t) + len);
+
+  chunk->next = NULL;
+  chunk->len  = len;
+  chunk->cnt  = cnt;
+
+  memcpy (chunk->buf, buf, len);
+
+  pthread_mutex_lock (&pool->mux);
+
+  // jobs ahead of the writer wait once too much is buffered, the job being written never waits
+
+  while ((job_pos != pool->jobs_write) && (pool->bytes_buffered + len > POOL_BYTES_MAX))
+  {
+    pthread_cond_wait (&pool->cond, &pool->mux);
+  }
+
+  job_t *job = pool->jobs_buf + (job_pos % pool->jobs_window);
+
+  if (job->chunks_tail) job->chunks_tail->next = chunk;
+  else                  job->chunks_head       = chunk;
+
+  job->chunks_tail = chunk;
+
+  pool->bytes_buffered += len;
+
+  pthread_cond_broadcast (&pool->cond);
+
+  pthread_mutex_unlock (&pool->mux);
+}
+
+static void *pool_worker (void *p)
+{
+  pool_t *pool = (pool_t *) p;
+
+  out_t *out = out_init (pool->fp, OUT_CHUNK_SIZE);
+
+  if (pool->ordered) out->pool = pool;
+
+  out->stop        = pool->stop;
+  out->unique      = pool->unique;
+  out->route_stats = pool->route_stats;
+  out->policy      = pool->policy;
+  out->crack       = pool->crack;
+  out->rules       = pool->rules;
+  out->tag_enc     = pool->tag_enc;
+  out->tag_len     = pool->tag_len;
+
+  gen_t gen;
+
+  gen.walk = pool->walk;
+  gen.out  = out;
+  gen.skip = 0;
+
+  out->left = &gen.left;
+
+  while (1)
+  {
+    pthread_mutex_lock (&pool->mux);
+
+    while (pool->ordered && (pool->jobs_next >= pool->jobs_write + pool->jobs_window))
+    {
+      pthread_cond_wait (&pool->cond, &pool->mux);
+    }
+
+    job_t next;
+
+    if ((pool->stop) && (*pool->stop)) pool->left = 0;
+
+    if (pool_next_job (pool, &next) == RC_INVALID)
+    {
+      pthread_cond_broadcast (&pool->cond);
+
+      pthread_mutex_unlock (&pool->mux);
+
+      break;
+    }
+
+    const u64 job_pos = pool->jobs_next++;
+
+    job_t *job = pool->jobs_buf + (job_pos % pool->jobs_window);
+
+    *job = next;
+
+    job->done        = 0;
+    job->chunks_head = NULL;
+    job->chunks_tail = NULL;
+
+    pthread_mutex_unlock (&pool->mux);
+
+    out->job_pos = job_pos;
+
+    gen.route_buf  = (pool->trie) ? NULL : pool->routes_buf + next.routes_pos;
+    gen.resume     = next.resume;
+    gen.resume_pos = next.resume_pos;
+    gen.left       = next.left;
+
+    struct timespec start;
+
+    const u64 cnt   = out->cnt;
+    const u64 bytes = out->generated + out->len;
+
+    if (out->route_stats) clock_gettime (CLOCK_MONOTONIC, &start);
+
+    if (pool->trie)
+    {
+      process_trie_part (&gen, pool->trie, next.routes_pos, next.sel);
+    }
+    else
+    {
+      process_route_part (&gen, next.sel);
+    }
+
+    if (out->route_stats)
+    {
+      pthread_mutex_lock (&pool->mux);
+
+      out_route_stats (out, out->route_stats + next.routes_pos, cnt, bytes, &start);
+
+      pthread_mutex_unlock (&pool->mux);
+    }
+
+    if (pool->ordered == 0) continue;
+
+    out_flush (out);
+
+    pthread_mutex_lock (&pool->mux);
+
+    job->done = 1;
+
+    pthread_cond_broadcast (&pool->cond);
+
+    pthread_mutex_unlock (&pool->mux);
+  }
+
+  out_flush (out);
+
+  pthread_mutex_lock (&pool->mux);
+
+  pool->cnt      += out->cnt;
+  pool->bytes    += out->bytes;
+  pool->rejected += out->rejected;
+
+  pthread_mutex_unlock (&pool->mux);
+
+  out_free (out);
+
+  return NULL;
+}
+
+// merge stage, writes the chunks of the oldest job as they arrive and moves on once that job is done
+
+static void pool_write (pool_t *pool)
+{
+  pthread_mutex_lock (&pool->mux);
+
+  while (1)
+  {
+    if (pool->jobs_write < pool->jobs_next)
+    {
+      job_t *job = pool->jobs_buf + (pool->jobs_write % pool->jobs_window);
+
+      if (job->chunks_head)
+      {
+        chunk_t *chunk = job->chunks_head;
+
+        job->chunks_head = NULL;
+        job->chunks_tail = NULL;
+
+        const int done = job->done;
+
+        pthread_mutex_unlock (&pool->mux);
+
+        size_t len = 0;
+
+        while (chunk)
+        {
+          chunk_t *next = chunk->next;
+
+          if ((pool->stop) && (*pool->stop)) pool->stopped = 1;
+
+          if (pool->stopped == 0)
+          {
+            const int keep = (pool->unique) ? unique_filter (pool->unique, chunk->buf, chunk->len, pool->tag_len, NULL) : chunk->len;
+
+            pool->dropped += chunk->len - keep;
+
+            if (pool->fp) fwrite (chunk->buf, 1, keep, pool->fp);
+
+            pthread_mutex_lock (&pool->progress->mux);
+
+            pool->progress->cnt += chunk->cnt;
+
+            pthread_mutex_unlock (&pool->progress->mux);
+          }
+
+          len += chunk->len;
+
+          free (chunk);
+
+          chunk = next;
+        }
+
+        pthread_mutex_lock (&pool->mux);
+
+        pool->bytes_buffered -= len;
+
+        if (done) pool->jobs_write++;
+
+        pthread_cond_broadcast (&pool->cond);
+
+        continue;
+      }
+
+      if (job->done)
+      {
+        pool->jobs_write++;
+
+        pthread_cond_broadcast (&pool->cond);
+
+        continue;
+      }
+    }
+    else if (pool->exhausted)
+    {
+      break;
+    }
+
+    pthread_cond_wait (&pool->cond, &pool->mux);
+  }
+
+  pthread_mutex_unlock (&pool->mux);
+}
+
+static void process_routes_threaded (const walk_t *walk, const route_t *routes_buf, const int routes_cnt, const trie_t *trie, const pos_t *start, const u64 limit, out_t *out, const int threads, const int ordered, progress_t *progress)
+{
+  pool_t pool;
+
+  pthread_mutex_init (&pool.mux, NULL);
+  pthread_cond_init  (&pool.cond, NULL);
+
+  pool.walk           = walk;
+  pool.routes_buf     = routes_buf;
+  pool.routes_cnt     = routes_cnt;
+  pool.trie           = trie;
+  pool.fp             = out->fp;
+  pool.cnt            = 0;
+  pool.bytes          = 0;
+  pool.ordered        = ordered;
+  pool.cursor_route   = 0;
+  pool.cursor_sel     = 0;
+  pool.resume         = 0;
+  pool.left           = limit;
+  pool.exhausted      = 0;
+  pool.jobs_next      = 0;
+  pool.jobs_write     = 0;
+  pool.jobs_window    = threads * JOBS_PER_THREAD;
+  pool.jobs_buf       = (job_t *) calloc (pool.jobs_window, sizeof (job_t));
+  pool.bytes_buffered = 0;
+  pool.stop           = out->stop;
+  pool.stopped        = 0;
+  pool.progress       = progress;
+  pool.unique         = out->unique;
+  pool.dropped        = 0;
+  pool.route_stats    = out->route_stats;
+  pool.policy         = out->policy;
+  pool.rejected       = 0;
+  pool.crack          = out->crack;
+  pool.rules          = out->rules;
+  pool.tag_enc        = out->tag_enc;
+  pool.tag_len        = out->tag_len;
+
+  if ((start) && (trie))
+  {
+    pool.cursor_route = start->basechar_pos;
+    pool.cursor_sel   = start->part;
+    pool.resume       = 1;
+    pool.resume_pos   = *start;
+  }
+  else if (start)
+  {
+    const route_t *route_buf = routes_buf + start->routes_pos;
+
+    pool.cursor_route = start->routes_pos;
+    pool.cursor_sel   = (route_buf->changes) ? start->sel_buf[route_buf->changes - 1] : 0;
+    pool.resume       = 1;
+    pool.resume_pos   = *start;
+  }
+
+  pool.cursor_count.ways_buf = NULL;
+  pool.cursor_count.sums_buf = NULL;
+
+  pool.cursor_trie_count.children_buf = NULL;
+  pool.cursor_trie_count.parts_buf    = NULL;
+
+  if ((pool.left != UINT64_MAX) && (trie))
+  {
+    count_trie_parts (walk, trie, &pool.cursor_trie_count);
+  }
+  else if ((pool.left != UINT64_MAX) && (pool.cursor_route < routes_cnt))
+  {
+    count_route (walk, routes_buf + pool.cursor_route, &pool.cursor_count);
+  }
+
+  pthread_t *threads_buf = (pthread_t *) calloc (threads, sizeof (pthread_t));
+
+  for (int i = 0; i < threads; i++)
+  {
+    pthread_create (threads_buf + i, NULL, pool_worker, &pool);
+  }
+
+  if (ordered) pool_write (&pool);
+
+  for (int i = 0; i < threads; i++)
+  {
+    pthread_join (threads_buf[i], NULL);
+  }
+
+  free_count (&pool.cursor_count);
+  free_trie_count (&pool.cursor_trie_count);
+
+  out->cnt      += pool.cnt;
+  out->bytes    += pool.bytes - pool.dropped;
+  out->rejected += pool.rejected;
+
+  free (threads_buf);
+  free (pool.jobs_buf);
+
+  pthread_cond_destroy  (&pool.cond);
+  pthread_mutex_destroy (&pool.mux);
+}
+
+// batch iterator, the generator runs on its own thread and writes straight into the buffer of the caller. each
+// kwp_next_batch() hands one buffer over and waits until out_flush() hands it back filled
+
+typedef struct batch
+{
+  pthread_t       thread;
+  pthread_mutex_t mux;
+  pthread_cond_t  cond;
+
+  int             running;    // thread started and not joined yet
+
+  char           *buf;        // buffer given to the generator, NULL while it waits for the next one
+  int             size;
+
+  int             len;        // bytes in the buffer handed back
+  u64             cnt;        // candidates generated up to and including this buffer
+  u64             dups;       // duplicates and policy rejects dropped up to and including this buffer
+  int             full;       // the generator handed the buffer back
+  int             done;       // the generator has finished
+  int             stop;       // the caller wants the generator to end
+
+} batch_t;
+
+struct kwp_ctx
+{
+  kwp_conf_t   conf;
+
+  walk_t       walk;
+
+  wchar_t     *basechars_buf;
+  int          basechars_cnt;
+
+  wchar_t     *basechars_line;      // the basechars file before filter_basechars(), NULL for a --compile file
+  int          basechars_line_len;
+
+  const kwp_ctx_t *base;      // set by kwp_init_keymap(), routes, trie and a shared unique belong to it
+
+  route_t     *routes_buf;
+  int          routes_cnt;
+
+  trie_t       trie;
+
+  map_t        cache;         // set if the tables point into a --compile file, see kwp_init_cache()
+
+  u64          hash;          // output relevant configuration and tables, see kwp_restore_write()
+
+  // generation starts here, see kwp_seek()
+
+  pos_t        start;
+  int          start_set;
+  u64          start_idx;
+
+  batch_t      batch;
+  u64          batch_cnt;     // candidates already returned by kwp_next_batch(), duplicates included
+  u64          batch_dups;
+
+  unique_t    *unique;        // kept for the lifetime of the context, NULL without conf.unique
+
+  policy_t    *policy;        // NULL without conf.policy_classes, conf.policy_keyboards and conf.policy_run_max
+
+  crack_t     *crack;         // NULL without kwp_crack()
+
+  rules_t     *rules;         // NULL without kwp_rules()
+
+  char         tag_enc[TAG_MAX];  // kwp_set_tag(), written in front of every candidate
+  int          tag_len;
+
+  kwp_route_stats_t *route_stats_buf;   // [routes_cnt], NULL without conf.route_stats
+
+  progress_t   progress;      // candidates written since start_idx
+
+  volatile sig_atomic_t stop;
+
+  kwp_stats_t  stats;
+};
+
+static void batch_swap (batch_t *batch, out_t *out)
+{
+  pthread_mutex_lock (&batch->mux);
+
+  batch->len  = out->len;
+  batch->cnt  = out->cnt;
+  batch->dups = out->dups + out->rejected;
+  batch->full = 1;
+  batch->buf  = NULL;
+
+  pthread_cond_broadcast (&batch->cond);
+
+  while ((batch->buf == NULL) && (batch->stop == 0)) pthread_cond_wait (&batch->cond, &batch->mux);
+
+  if (batch->stop)
+  {
+    // nothing is written anymore once the budget is gone
+
+    *out->left = 0;
+
+    out->buf  = NULL;
+    out->size = 0;
+  }
+  else
+  {
+    out->buf  = batch->buf;
+    out->size = batch->size;
+  }
+
+  pthread_mutex_unlock (&batch->mux);
+}
+
+static void *batch_thread (void *p)
+{
+  kwp_ctx_t *ctx = (kwp_ctx_t *) p;
+
+  batch_t *batch = &ctx->batch;
+
+  out_t out;
+
+  memset (&out, 0, sizeof (out));
+
+  out.batch  = batch;
+  out.buf    = batch->buf;
+  out.size   = batch->size;
+  out.stop   = &ctx->stop;
+  out.unique = ctx->unique;
+  out.policy = ctx->policy;
+  out.rules  = ctx->rules;
+
+  out.tag_enc = ctx->tag_enc;
+  out.tag_len = ctx->tag_len;
+
+  const pos_t *start_ptr = (ctx->start_set) ? &ctx->start : NULL;
+
+  if (ctx->conf.route_order)
+  {
+    process_routes (&ctx->walk, ctx->routes_buf, ctx->routes_cnt, start_ptr, UINT64_MAX, &out);
+  }
+  else
+  {
+    process_trie (&ctx->walk, &ctx->trie, start_ptr, UINT64_MAX, &out);
+  }
+
+  // the last buffer goes back without waiting for another one
+
+  if (out.unique) out.len = unique_filter (out.unique, out.buf, out.len, out.tag_len, &out.dups);
+
+  pthread_mutex_lock (&batch->mux);
+
+  batch->len  = out.len;
+  batch->cnt  = out.cnt;
+  batch->dups = out.dups + out.rejected;
+  batch->full = 1;
+  batch->done = 1;
+
+  pthread_cond_broadcast (&batch->cond);
+
+  pthread_mutex_unlock (&batch->mux);
+
+  return NULL;
+}
+
+static void batch_stop (kwp_ctx_t *ctx)
+{
+  batch_t *batch = &ctx->batch;
+
+  if (batch->running)
+  {
+    pthread_mutex_lock (&batch->mux);
+
+    batch->stop = 1;
+
+    pthread_cond_broadcast (&batch->cond);
+
+    pthread_mutex_unlock (&batch->mux);
+
+    pthread_join (batch->thread, NULL);
+
+    pthread_cond_destroy  (&batch->cond);
+    pthread_mutex_destroy (&batch->mux);
+  }
+
+  memset (batch, 0, sizeof (batch_t));
+
+  ctx->batch_cnt  = 0;
+  ctx->batch_dups = 0;
+}
+
+// fnv-1a over everything that decides the output, a restore file only fits the run it was written by
+
+static u64 hash_bytes (u64 hash, const void *buf, const size_t len)
+{
+  const u8 *ptr = (const u8 *) buf;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= ptr[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static u64 hash_ctx (const kwp_ctx_t *ctx)
+{
+  const walk_t *walk = &ctx->walk;
+
+  u64 hash = 0xcbf29ce484222325ULL;
+
+  hash = hash_bytes (hash, &ctx->conf.route_order, sizeof (int));
+  hash = hash_bytes (hash, &walk->sel_cnt,         sizeof (int));
+  hash = hash_bytes (hash, &walk->keys_cnt,        sizeof (int));
+
+  const size_t next_size = (size_t) walk->keys_cnt * walk->sel_cnt;
+
+  hash = hash_bytes (hash, walk->next_buf, next_size * sizeof (int));
+
+  for (int id = 0; id < walk->keys_cnt; id++)
+  {
+    if (walk->keys_enc_len[id] == RC_INVALID) continue;
+
+    hash = hash_bytes (hash, walk->keys_enc[id], walk->keys_enc_len[id]);
+  }
+
+  hash = hash_bytes (hash, walk->eol_enc, walk->eol_enc_len);
+
+  for (int basechar_pos = 0; basechar_pos < walk->basechars_cnt; basechar_pos++)
+  {
+    hash = hash_bytes (hash, walk->basechars_ids + basechar_pos, sizeof (int));
+    hash = hash_bytes (hash, walk->basechars_enc[basechar_pos], walk->basechars_enc_len[basechar_pos]);
+  }
+
+  for (int routes_pos = 0; routes_pos < ctx->routes_cnt; routes_pos++)
+  {
+    const route_t *route_buf = ctx->routes_buf + routes_pos;
+
+    hash = hash_bytes (hash, &route_buf->changes, sizeof (int));
+    hash = hash_bytes (hash, route_buf->repeat,   route_buf->changes * sizeof (int));
+  }
+
+  return hash;
+}
+
+// a cache holds the tables of one set of options, these are all options that go into them
+
+static void cache_conf (const kwp_conf_t *conf, int *conf_buf)
+{
+  const int tmp_buf[CACHE_CONF] =
+  {
+    conf->user_mod_basic,
+    conf->user_mod_shift,
+    conf->user_mod_altgr,
+    conf->user_dir_south_west,
+    conf->user_dir_south,
+    conf->user_dir_south_east,
+    conf->user_dir_west,
+    conf->user_dir_repeat,
+    conf->user_dir_east,
+    conf->user_dir_north_west,
+    conf->user_dir_north,
+    conf->user_dir_north_east,
+    conf->user_dist_min,
+    conf->user_dist_max,
+    conf->encoding,
+    conf->policy_length_min,
+    conf->policy_length_max,
+  };
+
+  memcpy (conf_buf, tmp_buf, sizeof (tmp_buf));
+}
+
+static void cache_head (const kwp_ctx_t *ctx, cache_head_t *head)
+{
+  memset (head, 0, sizeof (cache_head_t));
+
+  memcpy (head->magic, "kwpcache", 8);
+
+  head->version      = CACHE_VERSION;
+  head->endian       = 0x01020304;
+  head->sizes_buf[0] = sizeof (wchar_t);
+  head->sizes_buf[1] = sizeof (int);
+  head->sizes_buf[2] = sizeof (void *);
+  head->sizes_buf[3] = sizeof (walk_t);
+  head->sizes_buf[4] = sizeof (route_t);
+  head->sizes_buf[5] = sizeof (node_t);
+
+  cache_conf (&ctx->conf, head->conf_buf);
+
+  const char *locale = setlocale (LC_CTYPE, NULL);
+
+  if (locale) strncpy (head->locale, locale, CACHE_LOCALE - 1);
+}
+
+// every table outside of walk_t, sized by the counts in walk_t and the header
+
+static void cache_sections (kwp_ctx_t *ctx, void **ptrs_buf[CACHE_SECTIONS], size_t sizes_buf[CACHE_SECTIONS])
+{
+  walk_t *walk = &ctx->walk;
+
+  const size_t keys_sel = (size_t) walk->keys_cnt * walk->sel_cnt;
+
+  ptrs_buf[ 0] = (void **) &walk->next_buf;          sizes_buf[ 0] = keys_sel * sizeof (int);
+  ptrs_buf[ 1] = (void **) &walk->ends_buf;          sizes_buf[ 1] = keys_sel * ROUTE_REPEAT_MAX * sizeof (int);
+  ptrs_buf[ 2] = (void **) &walk->segs_buf;          sizes_buf[ 2] = keys_sel * walk->segs_size;
+  ptrs_buf[ 3] = (void **) &walk->segs_len;          sizes_buf[ 3] = keys_sel * walk->segs_repeat;
+  ptrs_buf[ 4] = (void **) &walk->steps_cnt;         sizes_buf[ 4] = (size_t) walk->keys_cnt * walk->segs_repeat * sizeof (int);
+  ptrs_buf[ 5] = (void **) &walk->steps_sel;         sizes_buf[ 5] = keys_sel * walk->segs_repeat * sizeof (int);
+  ptrs_buf[ 6] = (void **) &walk->basechars_ids;     sizes_buf[ 6] = (size_t) walk->basechars_cnt * sizeof (int);
+  ptrs_buf[ 7] = (void **) &walk->basechars_enc;     sizes_buf[ 7] = (size_t) walk->basechars_cnt * ENC_MAX;
+  ptrs_buf[ 8] = (void **) &walk->basechars_enc_len; sizes_buf[ 8] = (size_t) walk->basechars_cnt * sizeof (int);
+  ptrs_buf[ 9] = (void **) &ctx->basechars_buf;      sizes_buf[ 9] = (size_t) ctx->basechars_cnt * sizeof (wchar_t);
+  ptrs_buf[10] = (void **) &ctx->routes_buf;         sizes_buf[10] = (size_t) ctx->routes_cnt * sizeof (route_t);
+  ptrs_buf[11] = (void **) &ctx->trie.nodes_buf;     sizes_buf[11] = (size_t) ctx->trie.nodes_cnt * sizeof (node_t);
+  ptrs_buf[12] = (void **) &ctx->trie.leaf_buf;      sizes_buf[12] = (size_t) ctx->routes_cnt * sizeof (int);
+}
+
+static u64 cache_align (const u64 offset)
+{
+  return (offset + CACHE_ALIGN - 1) & ~((u64) CACHE_ALIGN - 1);
+}
+
+static int cache_write (FILE *fp, const void *buf, const size_t len)
+{
+  static const char zero_buf[CACHE_ALIGN] = { 0 };
+
+  if (fwrite (buf, 1, len, fp) != len) return RC_INVALID;
+
+  const size_t pad = cache_align (len) - len;
+
+  if (fwrite (zero_buf, 1, pad, fp) != pad) return RC_INVALID;
+
+  return RC_OK;
+}
+
+// api
+
+void kwp_conf_init (kwp_conf_t *conf)
+{
+  conf->user_mod_basic      = USER_MOD_BASIC;
+  conf->user_mod_shift      = USER_MOD_SHIFT;
+  conf->user_mod_altgr      = USER_MOD_ALTGR;
+  conf->user_dir_south_west = USER_DIR_SOUTH_WEST;
+  conf->user_dir_south      = USER_DIR_SOUTH;
+  conf->user_dir_south_east = USER_DIR_SOUTH_EAST;
+  conf->user_dir_west       = USER_DIR_WEST;
+  conf->user_dir_repeat     = USER_DIR_REPEAT;
+  conf->user_dir_east       = USER_DIR_EAST;
+  conf->user_dir_north_west = USER_DIR_NORTH_WEST;
+  conf->user_dir_north      = USER_DIR_NORTH;
+  conf->user_dir_north_east = USER_DIR_NORTH_EAST;
+  conf->user_dist_min       = USER_DIST_MIN;
+  conf->user_dist_max       = USER_DIST_MAX;
+  conf->encoding            = ENCODING;
+  conf->route_order         = ROUTE_ORDER;
+  conf->threads             = THREADS;
+  conf->unordered           = UNORDERED;
+  conf->write_buffer        = WRITE_BUFFER;
+  conf->output_backend      = OUTPUT_BACKEND;
+  conf->unique              = UNIQUE;
+  conf->unique_memory       = UNIQUE_MEMORY;
+  conf->route_stats         = ROUTE_STATS;
+  conf->policy_length_min   = POLICY_LENGTH_MIN;
+  conf->policy_length_max   = POLICY_LENGTH_MAX;
+  conf->policy_classes      = POLICY_CLASSES;
+  conf->policy_keyboards    = POLICY_KEYBOARDS;
+  conf->policy_run_max      = POLICY_RUN_MAX;
+}
+
+int kwp_conf_check (const kwp_conf_t *conf)
+{
+  if (conf->user_dist_min < 1)
+  {
+    fprintf (stderr, "Keywalk distance minimum can not be smaller than than 1\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->user_dist_max < 1)
+  {
+    fprintf (stderr, "Keywalk distance maximum can not be smaller than than 1\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->user_dist_min > DIST_CNT)
+  {
+    fprintf (stderr, "Keywalk distance minimum can not be greater than than %d\n", DIST_CNT);
+
+    return RC_INVALID;
+  }
+
+  if (conf->user_dist_max > DIST_CNT)
+  {
+    fprintf (stderr, "Keywalk distance maximum can not be greater than than %d\n", DIST_CNT);
+
+    return RC_INVALID;
+  }
+
+  if (conf->user_dist_min > conf->user_dist_max)
+  {
+    fprintf (stderr, "Keywalk distance minimum can not be greater than maximum\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->encoding == RC_INVALID)
+  {
+    fprintf (stderr, "Output encoding must be one of locale, utf8, latin1 or utf16le\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->output_backend == RC_INVALID)
+  {
+    fprintf (stderr, "Output backend must be one of auto, fwrite or vmsplice\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->unique == RC_INVALID)
+  {
+    fprintf (stderr, "Unique must be one of none, exact or bloom\n");
+
+    return RC_INVALID;
+  }
+
+  if ((conf->unique_memory < UNIQUE_MEMORY_MIN) || (conf->unique_memory > UNIQUE_MEMORY_MAX))
+  {
+    fprintf (stderr, "Unique memory must be between %d and %d MB\n", UNIQUE_MEMORY_MIN, UNIQUE_MEMORY_MAX);
+
+    return RC_INVALID;
+  }
+
+  if ((conf->route_stats) && (conf->route_order == 0))
+  {
+    fprintf (stderr, "Route statistics require route order\n");
+
+    return RC_INVALID;
+  }
+
+  if ((conf->policy_length_min < 0) || (conf->policy_length_max < 0))
+  {
+    fprintf (stderr, "Policy length can not be smaller than 0\n");
+
+    return RC_INVALID;
+  }
+
+  if ((conf->policy_length_max) && (conf->policy_length_min > conf->policy_length_max))
+  {
+    fprintf (stderr, "Policy length minimum can not be greater than maximum\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->policy_classes == RC_INVALID)
+  {
+    fprintf (stderr, "Policy classes must be made of l, u, d and s\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->policy_keyboards == RC_INVALID)
+  {
+    fprintf (stderr, "Policy keyboards must be made of b, s and a\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->policy_run_max < 0)
+  {
+    fprintf (stderr, "Policy run maximum can not be smaller than 0\n");
+
+    return RC_INVALID;
+  }
+
+  if ((conf->write_buffer < WRITE_BUFFER_MIN) || (conf->write_buffer > WRITE_BUFFER_MAX))
+  {
+    fprintf (stderr, "Write buffer must be between %d and %d MB\n", WRITE_BUFFER_MIN, WRITE_BUFFER_MAX);
+
+    return RC_INVALID;
+  }
+
+  if (conf->threads < 1)
+  {
+    fprintf (stderr, "Threads can not be smaller than 1\n");
+
+    return RC_INVALID;
+  }
+
+  if (conf->threads > THREADS_MAX)
+  {
+    fprintf (stderr, "Threads can not be greater than %d\n", THREADS_MAX);
+
+    return RC_INVALID;
+  }
+
+  return RC_OK;
+}
+
+const char *kwp_backend_name (const int backend)
+{
+  return backend_names[backend];
+}
+
+// run state on top of the tables, shared by kwp_init() and kwp_init_cache()
+
+static int init_state (kwp_ctx_t *ctx)
+{
+  if ((ctx->conf.unique != UNIQUE_NONE) && (ctx->unique == NULL))
+  {
+    if ((ctx->unique = unique_init (ctx->conf.unique, ctx->conf.unique_memory, &ctx->walk)) == NULL) return RC_INVALID;
+  }
+
+  if (ctx->conf.route_stats) ctx->route_stats_buf = (kwp_route_stats_t *) calloc (ctx->routes_cnt, sizeof (kwp_route_stats_t));
+
+  const kwp_conf_t *conf = &ctx->conf;
+
+  if ((conf->policy_classes) || (conf->policy_keyboards) || (conf->policy_run_max))
+  {
+    ctx->policy = policy_init (&ctx->walk, ctx->basechars_buf, &ctx->trie, conf->policy_classes, conf->policy_keyboards, conf->policy_run_max);
+  }
+
+  return RC_OK;
+}
+
+// keymap and walk tables, shared by kwp_init() and kwp_init_keymap(). timer_keymap is taken once the keymap is parsed
+
+static int init_walk (kwp_ctx_t *ctx, const char *keymap_file, struct timespec *timer_keymap)
+{
+  map_t map;
+
+  if (map_open (&map, keymap_file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", keymap_file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  keymap_t *keymap = (keymap_t *) malloc (sizeof (keymap_t));
+
+  int rc = parse_keymap_file (&map, keymap);
+
+  map_close (&map);
+
+  if (rc == -1)
+  {
+    fprintf (stderr, "%s: Invalid keymap\n", keymap_file);
+
+    free (keymap);
+
+    return RC_INVALID;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, timer_keymap);
+
+  const kwp_conf_t *conf = &ctx->conf;
+
+  rc = setup_walk (&ctx->walk, keymap, conf->user_mod_basic, conf->user_mod_shift, conf->user_mod_altgr, conf->user_dir_south_west, conf->user_dir_south, conf->user_dir_south_east, conf->user_dir_west, conf->user_dir_repeat, conf->user_dir_east, conf->user_dir_north_west, conf->user_dir_north, conf->user_dir_north_east, conf->user_dist_min, conf->user_dist_max, conf->encoding);
+
+  free (keymap);
+
+  if (rc == -1)
+  {
+    fprintf (stderr, "%s: More than %d keys\n", keymap_file, KEYS_MAX);
+
+    return RC_INVALID;
+  }
+
+  return RC_OK;
+}
+
+// the files are read in the current locale, the caller sets it up with setlocale() first
+
+kwp_ctx_t *kwp_init (const kwp_conf_t *conf, const char *basechar_file, const char *keymap_file, const char *routes_file)
+{
+  if (kwp_conf_check (conf) == RC_INVALID) return NULL;
+
+  kwp_ctx_t *ctx = (kwp_ctx_t *) calloc (1, sizeof (kwp_ctx_t));
+
+  ctx->conf = *conf;
+
+  pthread_mutex_init (&ctx->progress.mux, NULL);
+
+  struct timespec timer_start;
+  struct timespec timer_keymap;
+  struct timespec timer_walk;
+  struct timespec timer_basechars;
+  struct timespec timer_segments;
+  struct timespec timer_routes;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_start);
+
+  // init keymaps and walk
+
+  if (init_walk (ctx, keymap_file, &timer_keymap) == RC_INVALID)
+  {
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  walk_t *walk = &ctx->walk;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_walk);
+
+  // init basechars
+
+  map_t map;
+
+  ctx->basechars_buf  = (wchar_t *) calloc (BASECHARS_MAX, sizeof (wchar_t));
+  ctx->basechars_line = (wchar_t *) calloc (BASECHARS_MAX, sizeof (wchar_t));
+
+  if (map_open (&map, basechar_file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", basechar_file, strerror (errno));
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  if (map_lines (&map) != 1)
+  {
+    fprintf (stderr, "Invalid basechars, not exactly 1 line\n");
+
+    map_close (&map);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  const int rc = parse_basechars_file (&map, ctx->basechars_line, &ctx->basechars_line_len);
+
+  map_close (&map);
+
+  if (rc == -1)
+  {
+    fprintf (stderr, "%s: Invalid basechars\n", basechar_file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  filter_basechars (walk, ctx->basechars_line, ctx->basechars_line_len, ctx->basechars_buf, &ctx->basechars_cnt, conf->user_mod_basic, conf->user_mod_shift, conf->user_mod_altgr);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_basechars);
+
+  // init routes
+
+  if (map_open (&map, routes_file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", routes_file, strerror (errno));
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  ctx->routes_cnt = parse_routes_file (&map, &ctx->routes_buf);
+
+  map_close (&map);
+
+  if (ctx->routes_cnt == 0)
+  {
+    fprintf (stderr, "%s: no routes load\n", routes_file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  ctx->routes_cnt = filter_routes (ctx->routes_buf, ctx->routes_cnt, conf->policy_length_min, conf->policy_length_max);
+
+  if (ctx->routes_cnt == 0)
+  {
+    fprintf (stderr, "%s: no routes fit the policy length\n", routes_file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  setup_basechars (walk, ctx->basechars_buf, ctx->basechars_cnt);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_segments);
+
+  setup_segments (walk, ctx->routes_buf, ctx->routes_cnt);
+
+  setup_trie (&ctx->trie, ctx->routes_buf, ctx->routes_cnt);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_routes);
+
+  ctx->stats.keymap_ms    = timer_ms (&timer_start,     &timer_keymap);
+  ctx->stats.tables_ms    = timer_ms (&timer_keymap,    &timer_walk) + timer_ms (&timer_segments, &timer_routes);
+  ctx->stats.basechars_ms = timer_ms (&timer_walk,      &timer_basechars);
+  ctx->stats.routes_ms    = timer_ms (&timer_basechars, &timer_routes);
+  ctx->stats.total_ms     = timer_ms (&timer_start,     &timer_routes);
+
+  ctx->hash = hash_ctx (ctx);
+
+  if (init_state (ctx) == RC_INVALID)
+  {
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  return ctx;
+}
+
+// only the keymap is read, the basechars line is filtered again since the level of a character depends on the keymap
+
+kwp_ctx_t *kwp_init_keymap (const kwp_ctx_t *base, const char *keymap_file, const int unique_shared)
+{
+  if (base->basechars_line == NULL)
+  {
+    fprintf (stderr, "%s: keymaps can not be added to a cache\n", keymap_file);
+
+    return NULL;
+  }
+
+  kwp_ctx_t *ctx = (kwp_ctx_t *) calloc (1, sizeof (kwp_ctx_t));
+
+  ctx->conf = base->conf;
+  ctx->base = base;
+
+  pthread_mutex_init (&ctx->progress.mux, NULL);
+
+  struct timespec timer_start;
+  struct timespec timer_keymap;
+  struct timespec timer_walk;
+  struct timespec timer_basechars;
+  struct timespec timer_routes;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_start);
+
+  if (init_walk (ctx, keymap_file, &timer_keymap) == RC_INVALID)
+  {
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  walk_t *walk = &ctx->walk;
+
+  const kwp_conf_t *conf = &ctx->conf;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_walk);
+
+  ctx->basechars_buf = (wchar_t *) calloc (BASECHARS_MAX, sizeof (wchar_t));
+
+  filter_basechars (walk, base->basechars_line, base->basechars_line_len, ctx->basechars_buf, &ctx->basechars_cnt, conf->user_mod_basic, conf->user_mod_shift, conf->user_mod_altgr);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_basechars);
+
+  // the routes are already filtered by the policy length, only the segments depend on the keymap
+
+  ctx->routes_buf = base->routes_buf;
+  ctx->routes_cnt = base->routes_cnt;
+  ctx->trie       = base->trie;
+
+  setup_basechars (walk, ctx->basechars_buf, ctx->basechars_cnt);
+
+  setup_segments (walk, ctx->routes_buf, ctx->routes_cnt);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_routes);
+
+  ctx->stats.keymap_ms    = timer_ms (&timer_start,     &timer_keymap);
+  ctx->stats.tables_ms    = timer_ms (&timer_keymap,    &timer_walk) + timer_ms (&timer_basechars, &timer_routes);
+  ctx->stats.basechars_ms = timer_ms (&timer_walk,      &timer_basechars);
+  ctx->stats.total_ms     = timer_ms (&timer_start,     &timer_routes);
+
+  ctx->hash = hash_ctx (ctx);
+
+  if (unique_shared) ctx->unique = base->unique;
+
+  if (init_state (ctx) == RC_INVALID)
+  {
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  return ctx;
+}
+
+int kwp_compile (kwp_ctx_t *ctx, const char *file)
+{
+  cache_head_t head;
+
+  cache_head (ctx, &head);
+
+  head.basechars_cnt = ctx->basechars_cnt;
+  head.routes_cnt    = ctx->routes_cnt;
+  head.nodes_cnt     = ctx->trie.nodes_cnt;
+  head.hash          = ctx->hash;
+
+  void  **ptrs_buf[CACHE_SECTIONS];
+  size_t  sizes_buf[CACHE_SECTIONS];
+
+  cache_sections (ctx, ptrs_buf, sizes_buf);
+
+  u64 offset = cache_align (sizeof (cache_head_t));
+
+  head.walk_offset = offset;
+
+  offset += cache_align (sizeof (walk_t));
+
+  for (int i = 0; i < CACHE_SECTIONS; i++)
+  {
+    head.offsets_buf[i] = offset;
+
+    offset += cache_align (sizes_buf[i]);
+  }
+
+  head.size = offset;
+
+  FILE *fp = fopen (file, "wb");
+
+  if (fp == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  int rc = cache_write (fp, &head, sizeof (cache_head_t));
+
+  if (rc == RC_OK) rc = cache_write (fp, &ctx->walk, sizeof (walk_t));
+
+  for (int i = 0; (rc == RC_OK) && (i < CACHE_SECTIONS); i++) rc = cache_write (fp, *ptrs_buf[i], sizes_buf[i]);
+
+  if (fclose (fp) != 0) rc = RC_INVALID;
+
+  if (rc == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    remove (file);
+
+    return RC_INVALID;
+  }
+
+  return RC_OK;
+}
+
+// the tables are used straight from the mapping, nothing is parsed or built
+
+kwp_ctx_t *kwp_init_cache (const kwp_conf_t *conf, const char *file)
+{
+  if (kwp_conf_check (conf) == RC_INVALID) return NULL;
+
+  kwp_ctx_t *ctx = (kwp_ctx_t *) calloc (1, sizeof (kwp_ctx_t));
+
+  ctx->conf = *conf;
+
+  pthread_mutex_init (&ctx->progress.mux, NULL);
+
+  struct timespec timer_start;
+  struct timespec timer_done;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_start);
+
+  if (map_open (&ctx->cache, file) == RC_INVALID)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  const map_t *map = &ctx->cache;
+
+  cache_head_t want;
+
+  cache_head (ctx, &want);
+
+  const cache_head_t *head = (const cache_head_t *) map->buf;
+
+  if ((map->len < sizeof (cache_head_t)) || (memcmp (head->magic, want.magic, 8) != 0) || (head->version != CACHE_VERSION) || (head->size != map->len))
+  {
+    fprintf (stderr, "%s: Invalid cache\n", file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  if ((head->endian != want.endian) || (memcmp (head->sizes_buf, want.sizes_buf, sizeof (want.sizes_buf)) != 0))
+  {
+    fprintf (stderr, "%s: Cache was compiled on a different platform\n", file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  const int locale_differs = (conf->encoding == ENCODING_LOCALE) && (strcmp (head->locale, want.locale) != 0);
+
+  if ((memcmp (head->conf_buf, want.conf_buf, sizeof (want.conf_buf)) != 0) || (locale_differs))
+  {
+    fprintf (stderr, "%s: Cache was compiled with different options\n", file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  walk_t *walk = &ctx->walk;
+
+  if ((head->walk_offset > map->len) || (sizeof (walk_t) > (map->len - head->walk_offset)))
+  {
+    fprintf (stderr, "%s: Invalid cache\n", file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  memcpy (walk, map->buf + head->walk_offset, sizeof (walk_t));
+
+  ctx->basechars_cnt  = head->basechars_cnt;
+  ctx->routes_cnt     = head->routes_cnt;
+  ctx->trie.nodes_cnt = head->nodes_cnt;
+
+  const int counts_valid = (walk->keys_cnt >= 0) && (walk->keys_cnt <= KEYS_MAX) && (walk->sel_cnt >= 0)
+                        && (walk->segs_repeat >= 1) && (walk->segs_repeat <= ROUTE_REPEAT_MAX) && (walk->segs_size >= 0)
+                        && (walk->basechars_cnt >= 0) && (ctx->basechars_cnt >= 0) && (ctx->routes_cnt > 0) && (ctx->trie.nodes_cnt > 0);
+
+  if (counts_valid == 0)
+  {
+    fprintf (stderr, "%s: Invalid cache\n", file);
+
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  void  **ptrs_buf[CACHE_SECTIONS];
+  size_t  sizes_buf[CACHE_SECTIONS];
+
+  cache_sections (ctx, ptrs_buf, sizes_buf);
+
+  for (int i = 0; i < CACHE_SECTIONS; i++)
+  {
+    const u64 offset = head->offsets_buf[i];
+
+    if ((offset > map->len) || (sizes_buf[i] > (map->len - offset)))
+    {
+      fprintf (stderr, "%s: Invalid cache\n", file);
+
+      kwp_free (ctx);
+
+      return NULL;
+    }
+
+    *ptrs_buf[i] = map->buf + offset;
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_done);
+
+  ctx->stats.tables_ms = timer_ms (&timer_start, &timer_done);
+  ctx->stats.total_ms  = timer_ms (&timer_start, &timer_done);
+
+  ctx->hash = head->hash;
+
+  if (init_state (ctx) == RC_INVALID)
+  {
+    kwp_free (ctx);
+
+    return NULL;
+  }
+
+  return ctx;
+}
+
+void kwp_free (kwp_ctx_t *ctx)
+{
+  batch_stop (ctx);
+
+  if (ctx->cache.buf)
+  {
+    map_close (&ctx->cache);
+  }
+  else
+  {
+    free_walk (&ctx->walk);
+
+    free (ctx->basechars_buf);
+    free (ctx->basechars_line);
+
+    // routes and trie of a kwp_init_keymap() context belong to its base
+
+    if (ctx->base == NULL)
+    {
+      free_trie (&ctx->trie);
+
+      free (ctx->routes_buf);
+    }
+  }
+
+  if ((ctx->base == NULL) || (ctx->unique != ctx->base->unique)) unique_free (ctx->unique);
+
+  policy_free (ctx->policy);
+
+  crack_free (ctx->crack);
+
+  rules_free (ctx->rules);
+
+  free (ctx->route_stats_buf);
+
+  pthread_mutex_destroy (&ctx->progress.mux);
+
+  free (ctx);
+}
+
+int kwp_keyspace (const kwp_ctx_t *ctx, u64 *total, u64 *routes_cnt_buf)
+{
+  u64 *cnt_buf = (u64 *) calloc (ctx->trie.nodes_cnt, sizeof (u64));
+
+  int rc = count_trie (&ctx->walk, &ctx->trie, cnt_buf);
+
+  *total = 0;
+
+  for (int routes_pos = 0; routes_pos < ctx->routes_cnt; routes_pos++)
+  {
+    const u64 cnt = cnt_buf[ctx->trie.leaf_buf[routes_pos]];
+
+    if (add_u64 (total, cnt) == RC_INVALID) rc = RC_INVALID;
+
+    if (routes_cnt_buf) routes_cnt_buf[routes_pos] = cnt;
+  }
+
+  free (cnt_buf);
+
+  return rc;
+}
+
+int kwp_routes_cnt (const kwp_ctx_t *ctx)
+{
+  return ctx->routes_cnt;
+}
+
+void kwp_route_str (const kwp_ctx_t *ctx, const int routes_pos, char *buf)
+{
+  route_to_str (ctx->routes_buf + routes_pos, buf);
+}
+
+static int seek_ctx (const kwp_ctx_t *ctx, const u64 idx, pos_t *pos)
+{
+  if (ctx->conf.route_order) return seek_routes (&ctx->walk, ctx->routes_buf, ctx->routes_cnt, idx, pos);
+
+  return seek_trie (&ctx->walk, &ctx->trie, idx, pos);
+}
+
+int kwp_seek (kwp_ctx_t *ctx, const u64 pos)
+{
+  batch_stop (ctx);
+
+  ctx->start_set = 0;
+  ctx->start_idx = 0;
+
+  pthread_mutex_lock (&ctx->progress.mux);
+
+  ctx->progress.cnt = 0;
+
+  pthread_mutex_unlock (&ctx->progress.mux);
+
+  if (pos == 0) return RC_OK;
+
+  if (seek_ctx (ctx, pos, &ctx->start) == RC_INVALID) return RC_INVALID;
+
+  ctx->start_set = 1;
+  ctx->start_idx = pos;
+
+  return RC_OK;
+}
+
+void kwp_stop (kwp_ctx_t *ctx)
+{
+  ctx->stop = 1;
+}
+
+int kwp_stopped (const kwp_ctx_t *ctx)
+{
+  return ctx->stop != 0;
+}
+
+u64 kwp_pos (kwp_ctx_t *ctx)
+{
+  pthread_mutex_lock (&ctx->progress.mux);
+
+  const u64 pos = ctx->start_idx + ctx->progress.cnt;
+
+  pthread_mutex_unlock (&ctx->progress.mux);
+
+  return pos;
+}
+
+// the restore file is small text: a version, the configuration hash, the index of the next candidate and where that
+// is in the order in use. only the index is needed to continue, the rest is for humans
+
+int kwp_restore_write (kwp_ctx_t *ctx, const char *file)
+{
+  const u64 idx = kwp_pos (ctx);
+
+  char tmp_file[PATH_MAX];
+
+  if (snprintf (tmp_file, sizeof (tmp_file), "%s.tmp", file) >= (int) sizeof (tmp_file)) return RC_INVALID;
+
+  FILE *fp = fopen (tmp_file, "w");
+
+  if (fp == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", tmp_file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  fprintf (fp, "kwp-restore %d\n", RESTORE_VERSION);
+  fprintf (fp, "hash %016llx\n", (unsigned long long) ctx->hash);
+  fprintf (fp, "pos %llu\n", (unsigned long long) idx);
+
+  pos_t pos;
+
+  if (seek_ctx (ctx, idx, &pos) == RC_OK)
+  {
+    if (ctx->conf.route_order)
+    {
+      fprintf (fp, "route %d %llu\n", pos.routes_pos, (unsigned long long) pos.route_offset);
+    }
+    else
+    {
+      fprintf (fp, "part %d %d %llu\n", pos.basechar_pos, pos.part, (unsigned long long) pos.part_offset);
+    }
+  }
+
+  if (fclose (fp) != 0)
+  {
+    fprintf (stderr, "%s: %s\n", tmp_file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  #ifdef WINDOWS
+  remove (file);
+  #endif
+
+  if (rename (tmp_file, file) == -1)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  return RC_OK;
+}
+
+int kwp_restore_read (const kwp_ctx_t *ctx, const char *file, u64 *pos)
+{
+  FILE *fp = fopen (file, "r");
+
+  if (fp == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  int version = 0;
+
+  unsigned long long hash = 0;
+  unsigned long long idx  = 0;
+
+  const int cnt = fscanf (fp, "kwp-restore %d hash %llx pos %llu", &version, &hash, &idx);
+
+  fclose (fp);
+
+  if ((cnt != 3) || (version != RESTORE_VERSION))
+  {
+    fprintf (stderr, "%s: Invalid restore file\n", file);
+
+    return RC_INVALID;
+  }
+
+  if (hash != ctx->hash)
+  {
+    fprintf (stderr, "%s: Restore file was written with a different configuration\n", file);
+
+    return RC_INVALID;
+  }
+
+  *pos = idx;
+
+  return RC_OK;
+}
+
+// characters in len encoded bytes, for the length cap of --combinator
+
+static int enc_chars (const int encoding, const char *buf, const int len)
+{
+  if (encoding == ENCODING_LATIN1)  return len;
+  if (encoding == ENCODING_UTF16LE) return len / 2;
+
+  int chars = 0;
+
+  if (encoding == ENCODING_UTF8)
+  {
+    for (int i = 0; i < len; i++) if (((u8) buf[i] & 0xc0) != 0x80) chars++;
+
+    return chars;
+  }
+
+  mbstate_t state;
+
+  memset (&state, 0, sizeof (state));
+
+  for (int pos = 0; pos < len; chars++)
+  {
+    const size_t n = mbrlen (buf + pos, len - pos, &state);
+
+    pos += ((n == (size_t) -1) || (n == (size_t) -2) || (n == 0)) ? 1 : (int) n;
+  }
+
+  return chars;
+}
+
+// next walk of a batch, NULL once it is used up
+
+static const char *batch_walk (const char *buf, const int len, int *pos, int *pw_len, const char *eol_enc, const int eol_enc_len)
+{
+  if (*pos >= len) return NULL;
+
+  const char *pw_buf = buf + *pos;
+
+  int end = *pos;
+
+  if (eol_enc_len == 1)
+  {
+    end = (const char *) memchr (pw_buf, eol_enc[0], len - *pos) - buf;
+  }
+  else
+  {
+    while (memcmp (buf + end, eol_enc, eol_enc_len)) end += eol_enc_len;
+  }
+
+  *pw_len = end - *pos;
+  *pos    = end + eol_enc_len;
+
+  return pw_buf;
+}
+
+static void arena_push (arena_t *arena, const char *pw_buf, const int pw_len, const int chars)
+{
+  const u64 rec_len = (2 * sizeof (uint16_t)) + pw_len;
+
+  if (arena->len + rec_len > arena->size)
+  {
+    while (arena->len + rec_len > arena->size) arena->size = (arena->size) ? arena->size * 2 : COMBINATOR_BATCH;
+
+    arena->buf = (char *) realloc (arena->buf, arena->size);
+  }
+
+  const uint16_t rec_bytes = (uint16_t) pw_len;
+  const uint16_t rec_chars = (uint16_t) chars;
+
+  memcpy (arena->buf + arena->len,                        &rec_bytes, sizeof (uint16_t));
+  memcpy (arena->buf + arena->len + sizeof (uint16_t),    &rec_chars, sizeof (uint16_t));
+  memcpy (arena->buf + arena->len + 2 * sizeof (uint16_t), pw_buf,    pw_len);
+
+  arena->len += rec_len;
+  arena->cnt++;
+}
+
+int kwp_next_batch (kwp_ctx_t *ctx, char *buf, const int max_bytes, u64 *cnt)
+{
+  batch_t *batch = &ctx->batch;
+
+  if (cnt) *cnt = 0;
+
+  if (max_bytes < KWP_BATCH_MIN) return RC_INVALID;
+
+  if (batch->done) return 0;
+
+  if (batch->running == 0)
+  {
+    pthread_mutex_init (&batch->mux, NULL);
+    pthread_cond_init  (&batch->cond, NULL);
+
+    batch->buf     = buf;
+    batch->size    = max_bytes;
+    batch->running = 1;
+
+    pthread_create (&batch->thread, NULL, batch_thread, ctx);
+
+    pthread_mutex_lock (&batch->mux);
+  }
+  else
+  {
+    pthread_mutex_lock (&batch->mux);
+
+    batch->buf  = buf;
+    batch->size = max_bytes;
+
+    pthread_cond_broadcast (&batch->cond);
+  }
+
+  while (batch->full == 0) pthread_cond_wait (&batch->cond, &batch->mux);
+
+  batch->full = 0;
+
+  const int len = batch->len;
+
+  if (cnt) *cnt = (batch->cnt - batch->dups) - (ctx->batch_cnt - ctx->batch_dups);
+
+  ctx->batch_cnt  = batch->cnt;
+  ctx->batch_dups = batch->dups;
+
+  pthread_mutex_unlock (&batch->mux);
+
+  pthread_mutex_lock (&ctx->progress.mux);
+
+  ctx->progress.cnt = ctx->batch_cnt;
+
+  pthread_mutex_unlock (&ctx->progress.mux);
+
+  return len;
+}
+
+void kwp_run (kwp_ctx_t *ctx, FILE *fp, const u64 limit)
+{
+  const kwp_conf_t *conf = &ctx->conf;
+
+  const trie_t *trie_ptr  = (conf->route_order) ? NULL : &ctx->trie;
+  const pos_t  *start_ptr = (ctx->start_set) ? &ctx->start : NULL;
+
+  // with a hash list fp gets the cracked hashes, the candidates themselves are discarded
+
+  crack_t *crack = ctx->crack;
+
+  const u64 cracked = (crack) ? crack->cracked : 0;
+
+  if (crack)
+  {
+    crack->fp = fp;
+
+    fp = NULL;
+  }
+
+  out_t *out = out_init (fp, OUT_BUF_SIZE);
+
+  out->stop        = &ctx->stop;
+  out->unique      = ctx->unique;
+  out->route_stats = ctx->route_stats_buf;
+  out->policy      = ctx->policy;
+  out->crack       = crack;
+  out->rules       = ctx->rules;
+  out->tag_enc     = ctx->tag_enc;
+  out->tag_len     = ctx->tag_len;
+
+  if (ctx->route_stats_buf) memset (ctx->route_stats_buf, 0, ctx->routes_cnt * sizeof (kwp_route_stats_t));
+
+  // kwp_pos() can already be polled from another thread, e.g. the restore timer of the frontend
+
+  pthread_mutex_lock (&ctx->progress.mux);
+
+  ctx->progress.cnt = 0;
+
+  pthread_mutex_unlock (&ctx->progress.mux);
+
+  const u64 dups = (ctx->unique) ? ctx->unique->dups : 0;
+
+  struct timespec timer_gen;
+  struct timespec timer_done;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_gen);
+
+  writer_t *writer = NULL;
+
+  if (conf->threads > 1)
+  {
+    // workers hand over large chunks, let stdio coalesce the small ones. the merge stage already runs on its own
+    // thread, so the write buffer only sizes stdio here
+
+    if (fp) setvbuf (fp, NULL, _IOFBF, conf->write_buffer << 20);
+
+    ctx->stats.backend = (fp) ? BACKEND_FWRITE : BACKEND_DISCARD;
+
+    process_routes_threaded (&ctx->walk, ctx->routes_buf, ctx->routes_cnt, trie_ptr, start_ptr, limit, out, conf->threads, conf->unordered == 0, &ctx->progress);
+  }
+  else
+  {
+    writer = writer_init (fp, conf->write_buffer << 20, conf->output_backend, &ctx->progress);
+
+    ctx->stats.backend = writer->backend;
+
+    out_set_writer (out, writer);
+
+    if (trie_ptr)
+    {
+      process_trie (&ctx->walk, trie_ptr, start_ptr, limit, out);
+    }
+    else
+    {
+      process_routes (&ctx->walk, ctx->routes_buf, ctx->routes_cnt, start_ptr, limit, out);
+    }
+  }
+
+  out_flush (out);
+
+  if (writer) writer_free (writer);
+
+  if (fp) fflush (fp);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_done);
+
+  ctx->stats.cnt    = out->cnt;
+  ctx->stats.bytes  = out->bytes;
+  ctx->stats.dups   = (ctx->unique) ? ctx->unique->dups - dups : 0;
+  ctx->stats.gen_ms = timer_ms (&timer_gen, &timer_done);
+
+  ctx->stats.rejected_policy = out->rejected;
+
+  ctx->stats.cracked = (crack) ? crack->cracked - cracked : 0;
+
+  if ((crack) && (crack->fp)) fflush (crack->fp);
+
+  out_free (out);
+}
+
+int kwp_crack (kwp_ctx_t *ctx, const int hash, const char *file)
+{
+  crack_free (ctx->crack);
+
+  ctx->crack = crack_init (hash, &ctx->walk, file);
+
+  if (ctx->crack == NULL) return RC_INVALID;
+
+  return ctx->crack->digests_cnt;
+}
+
+int kwp_combinator (kwp_ctx_t *ctx, kwp_ctx_t *right, const char *sep, const int length_max, FILE *fp, const u64 limit)
+{
+  const walk_t *walk = &ctx->walk;
+
+  if (right->walk.encoding != walk->encoding)
+  {
+    fprintf (stderr, "Combinator sides have to use the same encoding\n");
+
+    return RC_INVALID;
+  }
+
+  // every character of sep is one separator, without sep the walks are joined directly
+
+  char seps_enc[COMBINATOR_SEPS_MAX][ENC_MAX];
+  int  seps_len[COMBINATOR_SEPS_MAX];
+  int  seps_cnt = 0;
+
+  if ((sep) && (sep[0]))
+  {
+    wchar_t seps_buf[COMBINATOR_SEPS_MAX + 1];
+
+    const size_t len = mbstowcs (seps_buf, sep, COMBINATOR_SEPS_MAX + 1);
+
+    if ((len == (size_t) -1) || (len > COMBINATOR_SEPS_MAX))
+    {
+      fprintf (stderr, "Separators have to be at most %d characters of the locale\n", COMBINATOR_SEPS_MAX);
+
+      return RC_INVALID;
+    }
+
+    for (size_t i = 0; i < len; i++, seps_cnt++)
+    {
+      if ((seps_len[seps_cnt] = encode_chr (walk->encoding, seps_buf[i], seps_enc[seps_cnt])) == RC_INVALID)
+      {
+        fprintf (stderr, "Separator %lc can not be written in the output encoding\n", (wint_t) seps_buf[i]);
+
+        return RC_INVALID;
+      }
+    }
+  }
+  else
+  {
+    seps_len[seps_cnt++] = 0;
+  }
+
+  // the smaller side goes into the arena, the larger one is streamed batch by batch
+
+  u64 left_cnt  = UINT64_MAX;
+  u64 right_cnt = UINT64_MAX;
+
+  if (kwp_keyspace (ctx,   &left_cnt,  NULL) == RC_INVALID) left_cnt  = UINT64_MAX;
+  if (kwp_keyspace (right, &right_cnt, NULL) == RC_INVALID) right_cnt = UINT64_MAX;
+
+  const int held_left = (left_cnt < right_cnt);
+
+  kwp_ctx_t *held_ctx   = (held_left) ? ctx   : right;
+  kwp_ctx_t *stream_ctx = (held_left) ? right : ctx;
+
+  // unique, rules and the tag of ctx belong to the joined candidates, the sides are generated without them
+
+  unique_t *unique = ctx->unique;
+  rules_t  *rules  = ctx->rules;
+
+  const int tag_len = ctx->tag_len;
+
+  ctx->unique  = NULL;
+  ctx->rules   = NULL;
+  ctx->tag_len = 0;
+
+  char *batch_buf = (char *) malloc (COMBINATOR_BATCH);
+
+  arena_t arena;
+
+  memset (&arena, 0, sizeof (arena));
+
+  int batch_len;
+
+  while ((batch_len = kwp_next_batch (held_ctx, batch_buf, COMBINATOR_BATCH, NULL)) > 0)
+  {
+    const char *pw_buf;
+
+    int pos = 0;
+    int pw_len;
+
+    while ((pw_buf = batch_walk (batch_buf, batch_len, &pos, &pw_len, walk->eol_enc, walk->eol_enc_len)) != NULL)
+    {
+      arena_push (&arena, pw_buf, pw_len, enc_chars (walk->encoding, pw_buf, pw_len));
+    }
+  }
+
+  // same output stage as kwp_run(), single threaded. the writer gets its own progress, positions of ctx count the
+  // streamed side
+
+  crack_t *crack = ctx->crack;
+
+  const u64 cracked = (crack) ? crack->cracked : 0;
+
+  if (crack)
+  {
+    crack->fp = fp;
+
+    fp = NULL;
+  }
+
+  progress_t progress;
+
+  pthread_mutex_init (&progress.mux, NULL);
+
+  progress.cnt = 0;
+
+  out_t *out = out_init (fp, OUT_BUF_SIZE);
+
+  out->stop   = &ctx->stop;
+  out->unique = unique;
+  out->crack  = crack;
+  out->rules  = rules;
+
+  out->tag_enc = ctx->tag_enc;
+  out->tag_len = tag_len;
+
+  const u64 dups = (unique) ? unique->dups : 0;
+
+  struct timespec timer_gen;
+  struct timespec timer_done;
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_gen);
+
+  writer_t *writer = writer_init (fp, ctx->conf.write_buffer << 20, ctx->conf.output_backend, &progress);
+
+  ctx->stats.backend = writer->backend;
+
+  out_set_writer (out, writer);
+
+  u64 left = limit;
+
+  // the budget of out is only zeroed by kwp_stop()
+
+  out->left = &left;
+
+  while ((left) && ((batch_len = kwp_next_batch (stream_ctx, batch_buf, COMBINATOR_BATCH, NULL)) > 0))
+  {
+    const char *pw_buf;
+
+    int pos = 0;
+    int pw_len;
+
+    while ((left) && ((pw_buf = batch_walk (batch_buf, batch_len, &pos, &pw_len, walk->eol_enc, walk->eol_enc_len)) != NULL))
+    {
+      const int pw_chars = enc_chars (walk->encoding, pw_buf, pw_len);
+
+      for (int seps_pos = 0; (left) && (seps_pos < seps_cnt); seps_pos++)
+      {
+        const int sep_len   = seps_len[seps_pos];
+        const int sep_chars = (sep_len) ? 1 : 0;
+
+        for (u64 rec_pos = 0; (left) && (rec_pos < arena.len);)
+        {
+          uint16_t rec_bytes;
+          uint16_t rec_chars;
+
+          memcpy (&rec_bytes, arena.buf + rec_pos,                     sizeof (uint16_t));
+          memcpy (&rec_chars, arena.buf + rec_pos + sizeof (uint16_t), sizeof (uint16_t));
+
+          const char *rec_buf = arena.buf + rec_pos + 2 * sizeof (uint16_t);
+
+          rec_pos += 2 * sizeof (uint16_t) + rec_bytes;
+
+          // the cap is checked on the lengths, nothing is copied for a joined walk that is too long
+
+          if ((length_max) && (pw_chars + sep_chars + rec_chars > length_max)) continue;
+
+          const int len = pw_len + sep_len + rec_bytes;
+
+          if (len > RULE_PW_MAX) continue;
+
+          const char *head_buf = (held_left) ? rec_buf : pw_buf;
+          const int   head_len = (held_left) ? rec_bytes : pw_len;
+          const char *tail_buf = (held_left) ? pw_buf : rec_buf;
+          const int   tail_len = (held_left) ? pw_len : rec_bytes;
+
+          char *buf = out->buf + out->len;
+
+          memcpy (buf,                      head_buf,             head_len);
+          memcpy (buf + head_len,           seps_enc[seps_pos],   sep_len);
+          memcpy (buf + head_len + sep_len, tail_buf,             tail_len);
+          memcpy (buf + len,                walk->eol_enc,        ENC_MAX);
+
+          out_push (out, len + walk->eol_enc_len);
+
+          if (left != UINT64_MAX) left--;
+        }
+      }
+    }
+  }
+
+  out_flush (out);
+
+  writer_free (writer);
+
+  if (fp) fflush (fp);
+
+  if ((crack) && (crack->fp)) fflush (crack->fp);
+
+  clock_gettime (CLOCK_MONOTONIC, &timer_done);
+
+  ctx->stats.cnt     = out->cnt;
+  ctx->stats.bytes   = out->bytes;
+  ctx->stats.dups    = (unique) ? unique->dups - dups : 0;
+  ctx->stats.gen_ms  = timer_ms (&timer_gen, &timer_done);
+  ctx->stats.cracked = (crack) ? crack->cracked - cracked : 0;
+
+  ctx->stats.rejected_policy = 0;
+
+  out_free (out);
+
+  pthread_mutex_destroy (&progress.mux);
+
+  ctx->unique  = unique;
+  ctx->rules   = rules;
+  ctx->tag_len = tag_len;
+
+  free (arena.buf);
+  free (batch_buf);
+
+  return RC_OK;
+}
+
+int kwp_rules (kwp_ctx_t *ctx, const char *file)
+{
+  if (ctx->walk.encoding == ENCODING_UTF16LE)
+  {
+    fprintf (stderr, "Rules work on bytes and can not be combined with utf16le\n");
+
+    return RC_INVALID;
+  }
+
+  rules_free (ctx->rules);
+
+  ctx->rules = rules_init (&ctx->walk, file);
+
+  if (ctx->rules == NULL) return RC_INVALID;
+
+  return ctx->rules->rules_cnt;
+}
+
+int kwp_set_tag (kwp_ctx_t *ctx, const char *name)
+{
+  ctx->tag_len = 0;
+
+  if (name == NULL) return RC_OK;
+
+  wchar_t name_buf[TAG_MAX];
+
+  const size_t name_len = mbstowcs (name_buf, name, TAG_MAX);
+
+  if ((name_len == (size_t) -1) || (name_len >= TAG_MAX - 1))
+  {
+    fprintf (stderr, "%s: Invalid tag\n", name);
+
+    return RC_INVALID;
+  }
+
+  name_buf[name_len] = L'\t';
+
+  int tag_len = 0;
+
+  for (size_t name_pos = 0; name_pos <= name_len; name_pos++)
+  {
+    char enc[ENC_MAX];
+
+    const int enc_len = (name_buf[name_pos] == L'\n') ? RC_INVALID : encode_chr (ctx->walk.encoding, name_buf[name_pos], enc);
+
+    if ((enc_len == RC_INVALID) || (tag_len + enc_len > TAG_MAX))
+    {
+      fprintf (stderr, "%s: Invalid tag\n", name);
+
+      return RC_INVALID;
+    }
+
+    memcpy (ctx->tag_enc + tag_len, enc, enc_len);
+
+    tag_len += enc_len;
+  }
+
+  ctx->tag_len = tag_len;
+
+  return RC_OK;
+}
+
+int kwp_match (const kwp_ctx_t *ctx, const char *file, FILE *fp, u64 *words, u64 *matched)
+{
+  FILE *in = (strcmp (file, "-") == 0) ? stdin : fopen (file, "rb");
+
+  if (in == NULL)
+  {
+    fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+    return RC_INVALID;
+  }
+
+  matcher_t matcher;
+
+  matcher_init (&matcher, &ctx->conf, &ctx->walk, &ctx->trie, ctx->routes_buf, ctx->routes_cnt, ctx->basechars_buf, ctx->policy);
+
+  const int rc = match_file (&matcher, in, fp, ctx->conf.threads, words, matched);
+
+  matcher_free (&matcher);
+
+  if (rc == RC_INVALID) fprintf (stderr, "%s: %s\n", file, strerror (errno));
+
+  if (in != stdin) fclose (in);
+
+  return rc;
+}
+
+void kwp_route_stats (const kwp_ctx_t *ctx, kwp_route_stats_t *stats_buf)
+{
+  for (int routes_pos = 0; routes_pos < ctx->routes_cnt; routes_pos++)
+  {
+    kwp_route_stats_t *stats = stats_buf + routes_pos;
+
+    if (ctx->route_stats_buf) *stats = ctx->route_stats_buf[routes_pos];
+    else                      memset (stats, 0, sizeof (kwp_route_stats_t));
+
+    reject_route (&ctx->walk, ctx->routes_buf + routes_pos, &stats->keyspace, &stats->rejected_keymap, &stats->rejected_repeat);
+  }
+}
+
+void kwp_stats (const kwp_ctx_t *ctx, kwp_stats_t *stats)
+{
+  *stats = ctx->stats;
+
+  // rejected is the share of the original mixed-radix enumeration that is not a valid walk
+
+  const walk_t *walk = &ctx->walk;
+
+  u64 *cnt_buf = (u64 *) calloc (ctx->trie.nodes_cnt, sizeof (u64));
+
+  const int rc = count_trie (walk, &ctx->trie, cnt_buf);
+
+  double valid = 0;
+  double total = 0;
+
+  for (int routes_pos = 0; routes_pos < ctx->routes_cnt; routes_pos++)
+  {
+    double cnt = walk->basechars_cnt;
+
+    for (int route_pos = 0; route_pos < ctx->routes_buf[routes_pos].changes; route_pos++) cnt *= walk->sel_cnt;
+
+    valid += (double) cnt_buf[ctx->trie.leaf_buf[routes_pos]];
+    total += cnt;
+  }
+
+  free (cnt_buf);
+
+  stats->rejected     = (total > 0) ? 100 * (1 - (valid / total)) : 0;
+  stats->rejected_min = (rc == RC_INVALID);
+}